@@ -7,28 +7,239 @@
  */
 
 #include <linux/types.h>
+#include <linux/list.h>
+#include <linux/wait.h>
+#include <linux/cache.h>
+#include <linux/percpu.h>
+#include <linux/hrtimer.h>
+
+#include "chdev_common.h"
+
+struct iov_iter;
+struct chdev_stats;
 
 /*
  * Definitions of constants.
  */
 #define BUF_5KB          5120
+#define CHDEV_MAX_DEVICES 64                        /* maximum value of ndevices module parameter */
+#define CHDEV_MAX_PRIO   8                          /* maximum value of priorities module parameter */
+#define CHDEV_ITEM_PAD   ((u32)-1)                  /* item header which marks the rest of the buffer as unused */
+#define CHDEV_ITEM_LZ4   0x80000000                 /* item header flag of a compressed item */
+#define CHDEV_ITEM_TS    0x40000000                 /* item header flag of an item stamped with its enqueue time */
+#define CHDEV_LZ4_MAX    65536                      /* maximum size of a compressed item */
+#define CHDEV_SLOT_FAULT ((u32)-1)                  /* length of a slot which holds no item, its writer faulted */
+#define CHDEV_ITEM_MAX   0x3ffff000                 /* maximum item size, the largest single read() or write() */
+#define CHDEV_BUF_MIN    64                         /* minimum buffer size, half of it holds a stamped empty item */
+#define CHDEV_BUF_MAX    (UINT_MAX & PAGE_MASK)     /* maximum buffer size, offsets in the control page are uint */
 
 /*
  * Definitions of structures.
  */
+struct chdev_ring {
+	char             *buf;	                    /* circular buffer, item size are stored in first sizeof(u32) bytes */        
+	size_t           buf_size;                  /* size of circular buffer, a multiple of CHDEV_ITEM_ALIGN */
+	struct chdev_ring_ctrl *ctrl;               /* control page with buffer positions, mapped by user space */
+	uint             mapped;                    /* sides whose position user space publishes, CHDEV_ROLE_* bits */
+	struct semaphore sem;                       /* serializes writers of a shard in sharded mode */
+	
+	/* producer side, written only by the writer (see chdev_shared.c) */
+	char             *end ____cacheline_aligned_in_smp; /* pointer to the current end of the buffer */
+	size_t           wr_bytes;                  /* number of bytes ever written, including headers and padding */
+	uint             wr_item;                   /* number of items ever written, published with release semantics */
+	char             *rsv_end;                  /* ring->end after the reserved item is committed */
+	size_t           rsv_bytes;                 /* number of bytes taken by the reserved item */
+	size_t           rsv_len;                   /* payload size of the reserved item */
+	char             *rsv_ts;                   /* enqueue time of the reserved item, NULL if it is not stamped */
+	
+	/* consumer side, written only by the reader (see chdev_shared.c) */
+	char             *beg ____cacheline_aligned_in_smp; /* pointer to the current begining of the buffer */
+	size_t           rd_bytes;                  /* number of bytes ever read, published with release semantics */
+	uint             rd_item;                   /* number of items ever read */
+	u64              rd_seq;                    /* 64-bit rd_item, sequence number of the oldest item */
+};
+
+/*
+ * Header of a slot in slot mode (see chdev_slot.c). seq equals the queue position the slot is free for,
+ * or that position + 1 once the item written at it is published.
+ */
+struct chdev_slot {
+	unsigned long    seq;                       /* state of the slot, published with release semantics */
+	u32              len;                       /* length of the item which follows the header */
+};
+
+/*
+ * Queue of fixed-size slots shared by any number of writers and readers without dev->sem.
+ */
+struct chdev_slots {
+	char             *buf;                      /* mask + 1 slots of stride bytes each */
+	size_t           stride;                    /* bytes per slot, a multiple of the cache line */
+	size_t           size;                      /* maximum item size */
+	unsigned long    mask;                      /* number of slots - 1, a power of two - 1 */
+	unsigned long    enq ____cacheline_aligned_in_smp; /* position of the next written item */
+	unsigned long    deq ____cacheline_aligned_in_smp; /* position of the next read item */
+};
+
+#define CHDEV_SLOT_STRIDE(size)  ALIGN(sizeof(struct chdev_slot) + (size), L1_CACHE_BYTES)
+
+/*
+ * Read cursor of a file in broadcast mode, protected by dev->sem.
+ */
+struct chdev_cursor {
+	struct list_head node;                      /* entry in dev->cursors, empty until the first read */
+	char             *pos;                      /* header of the next item to read (or padding before it) */
+	u64              seq;                       /* sequence number of the next item to read */
+	u64              lost;                      /* number of items skipped because they were evicted */
+	bool             overrun;                   /* items were skipped since the previous read */
+};
+
+/*
+ * Counters of a device, every CPU updates its own copy (see chdev_stat_inc).
+ */
+struct chdev_pcpu_stats {
+	u64              enqueued;
+	u64              dequeued;
+	u64              bytes_in;
+	u64              bytes_out;
+	u64              full;
+	u64              empty;
+	u64              contended;
+	u64              interrupted;
+	u64              high_watermark;            /* maximum seen by writers on this CPU */
+	u64              dropped;
+	u64              dropped_bytes;
+	u64              compressed;
+	u64              compress_in;
+	u64              compress_out;
+	u64              compress_ns;
+	u64              decompress_ns;
+	u64              residence_ns;              /* sum of residence times of stamped items */
+	u64              residence_max;             /* maximum seen by readers on this CPU */
+	u64              residence[CHDEV_HIST_BUCKETS]; /* log-linear histogram of residence times */
+};
+
+#define chdev_stat_inc(dev, field)      this_cpu_inc((dev)->stats->field)
+#define chdev_stat_add(dev, field, n)   this_cpu_add((dev)->stats->field, (n))
+
+/*
+ * Scratch buffers of compression mode, allocated when it is enabled for the first time.
+ * Writers are serialized, and so are readers, so each side has its own buffers.
+ */
+struct chdev_lz4 {
+	void             *wrkmem;                   /* state of the compressor, also the beginning of the whole area */
+	char             *wr_src;                   /* item being compressed, CHDEV_LZ4_MAX bytes */
+	char             *wr_dst;                   /* compressed item, LZ4_COMPRESSBOUND(CHDEV_LZ4_MAX) bytes */
+	char             *rd_dst;                   /* decompressed item, CHDEV_LZ4_MAX bytes */
+};
+
+/*
+ * Eventfd notification registered by CHDEV_IOCTL_SET_NOTIFY. Writers and readers which work without
+ * dev->sem use it under RCU, so a new registration replaces the whole structure.
+ */
+struct chdev_notifier {
+	struct chdev_dev *dev;                      /* device of the notifier, for the timer */
+	struct eventfd_ctx *rd_ctx;                 /* signaled for readers, NULL if none */
+	struct eventfd_ctx *wr_ctx;                 /* signaled for writers, NULL if none */
+	uint             rd_items;                  /* watermark of items for readers, 0 if none */
+	size_t           rd_bytes;                  /* watermark of used bytes for readers, 0 if none */
+	size_t           wr_free;                   /* watermark of free bytes for writers, 0 if none */
+	u64              delay_ns;                  /* maximum delay of an item below the watermarks, 0 if none */
+	struct hrtimer   timer;                     /* signals readers once the delay passed */
+};
+
+/*
+ * State of the device when a batch of writes began, see chdev_notify_hold(...).
+ */
+struct chdev_notify_mark {
+	uint             items;                     /* items of the device */
+	size_t           used;                      /* used bytes of the device */
+	bool             held;                      /* writes of the batch do not signal readers one by one */
+};
+
 struct chdev_dev {
-	char             *buf;	                    /* chdev circular buffer, item size are stored in first sizeof(short) bytes */        
-	uint             buf_size;                  /* size of chdev circular buffer */
-	char             *beg;                      /* pointer to the current begining of the buffer */
-	char             *end;                      /* pointer to the current end of the buffer */
-	bool             inv;                       /* indicator of beg and end positions ([--beg--end--]:false, [--end--beg--]:true, [beg == end]:false) */
-	uint             num_item;                  /* number of items in the buffer at the current time point */
-	struct semaphore sem;                       /* mutual exclusion semaphore */
+	struct chdev_ring ring;                     /* chdev circular buffer, unused in sharded mode */
+	
+	/* configuration, read by both sides and rarely written */
+	size_t           buf_size;                  /* size of each circular buffer of the device */
+	struct chdev_ring *shards;                  /* per-CPU or per-priority circular buffers, NULL otherwise */
+	uint             nshards;                   /* number of elements in shards */
+	bool             unordered;                 /* shards are read round-robin, items take no sequence number */
+	uint             nprio;                     /* number of priority classes, shards[p] holds class p; 0 if none */
+	uint             weights[CHDEV_MAX_PRIO];   /* items read from a class in a row with CHDEV_MODE_WEIGHTED */
+	uint             mode;                      /* CHDEV_MODE_* set by CHDEV_IOCTL_SET_MODE */
+	struct chdev_slots *slots;                  /* queue of slot mode, NULL in other modes */
+	struct chdev_lz4 *lz4;                      /* scratch buffers of compression mode, NULL until it is enabled */
+	uint             compress_min;              /* smallest item which is compressed in compression mode */
+	int              node;                      /* NUMA node of the buffer, NUMA_NO_NODE until it is chosen */
+	bool             node_fixed;                /* node was chosen explicitly, the consumer does not move the buffer */
+	atomic_t         mappings;                  /* number of memory mappings of the buffer and control page */
+	spinlock_t       map_lock;                  /* serializes taking of positions published by mapped roles */
+	struct chdev_notifier __rcu *notifier;      /* eventfd notification, NULL if none is registered */
+	atomic_t         notify_hold;               /* batches of writes in progress, which signal readers at their end */
+	struct file      *producer;                 /* file which owns the producer side in SPSC mode, NULL if none */
+	struct file      *consumer;                 /* file which owns the consumer side in SPSC mode, NULL if none */
+	struct file      *rsv_filp;                 /* file which reserved space for zero-copy write, NULL if none */
+	struct file      *peek_filp;                /* file which reads the oldest item in place, NULL if none */
+	struct chdev_pcpu_stats __percpu *stats;    /* operation counters */
 	struct cdev      cdev;	                    /* chdev structure */
+	
+	/* consumer side, written by readers */
+	uint             next_shard ____cacheline_aligned_in_smp; /* shard to be read next (round-robin) */
+	uint             credit;                    /* items left to read from class next_shard */
+	struct list_head cursors;                   /* read cursors of subscribed files in broadcast mode */
+	wait_queue_head_t inq;                      /* readers waiting for an item */
+	
+	/* producer side, written by writers */
+	wait_queue_head_t outq ____cacheline_aligned_in_smp; /* writers waiting for free space */
+	atomic64_t       seq;                       /* enqueue sequence number of the last item in ordered sharded mode */
+	
+	/* taken by both sides, on its own cache line so that waiting on it does not slow down the others */
+	struct semaphore sem ____cacheline_aligned_in_smp; /* mutual exclusion semaphore */
+};
+
+struct chdev_file {
+	struct chdev_dev *dev;                      /* device of the open file */
+	uint             flags;                     /* CHDEV_FLAG_* set by CHDEV_IOCTL_SET_FLAGS */
+	struct chdev_cursor cursor;                 /* read cursor in broadcast mode */
+	uint             prio;                      /* priority class of written items, set by CHDEV_IOCTL_SET_PRIORITY */
+	atomic_t         wr_maps;                   /* writable mappings, which need the role of the file */
 };
 
 /*
  * Declarations of shared functions.
  */
-ssize_t         chdev_read_common(struct chdev_dev *, char __user *, size_t);
-ssize_t         chdev_write_common(struct chdev_dev *, const char __user *, size_t);
\ No newline at end of file
+uint            chdev_ring_num_item(struct chdev_ring *);
+size_t          chdev_ring_used(struct chdev_ring *);
+size_t          chdev_used(struct chdev_dev *);
+uint            chdev_num_item(struct chdev_dev *);
+bool            chdev_can_read(struct chdev_dev *);
+bool            chdev_can_write(struct chdev_dev *, size_t, uint);
+size_t          chdev_stamp_len(struct chdev_dev *);
+size_t          chdev_item_max(struct chdev_dev *);
+ssize_t         chdev_read_common(struct chdev_dev *, struct iov_iter *, uint);
+ssize_t         chdev_read_class(struct chdev_dev *, struct iov_iter *, uint, uint *);
+ssize_t         chdev_write_common(struct chdev_dev *, struct iov_iter *, size_t, uint, bool);
+int             chdev_lock(struct chdev_dev *, struct semaphore *);
+void            chdev_get_stats(struct chdev_dev *, struct chdev_stats *);
+void            chdev_get_hist(struct chdev_dev *, struct chdev_hist *);
+char           *chdev_reserve_common(struct chdev_dev *, size_t);
+void            chdev_commit_common(struct chdev_dev *);
+char           *chdev_peek_common(struct chdev_dev *, size_t *);
+int             chdev_drop_common(struct chdev_dev *);
+int             chdev_pull_mapped(struct chdev_dev *);
+int             chdev_map_side(struct chdev_dev *, uint, bool);
+void            chdev_notify_write(struct chdev_dev *, size_t);
+void            chdev_notify_hold(struct chdev_dev *, struct chdev_notify_mark *);
+void            chdev_notify_release(struct chdev_dev *, struct chdev_notify_mark *);
+void            chdev_notify_read(struct chdev_dev *, size_t, size_t);
+enum hrtimer_restart chdev_notify_timer(struct hrtimer *);
+bool            chdev_cursor_can_read(struct chdev_dev *, struct chdev_cursor *);
+ssize_t         chdev_cursor_read(struct chdev_dev *, struct chdev_cursor *, struct iov_iter *, uint);
+void            chdev_cursor_detach(struct chdev_dev *, struct chdev_cursor *);
+ssize_t         chdev_snapshot(struct chdev_dev *, char *, uint *);
+uint            chdev_slot_num_item(struct chdev_dev *);
+bool            chdev_slot_can_read(struct chdev_dev *);
+bool            chdev_slot_can_write(struct chdev_dev *);
+ssize_t         chdev_slot_read(struct chdev_dev *, struct iov_iter *, uint);
+ssize_t         chdev_slot_write(struct chdev_dev *, struct iov_iter *, size_t);
+ssize_t         chdev_snapshot_to_iter(struct chdev_dev *, const char *, size_t, struct iov_iter *, char *, uint *);
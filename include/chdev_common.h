@@ -6,6 +6,9 @@
  * acknowledgment appears in derived source files.
  */
 
+#ifndef CHDEV_COMMON_H
+#define CHDEV_COMMON_H
+
 /*
  * Definitions for ioctl().
  */
@@ -14,7 +17,156 @@
 #define CHDEV_IOCTL_SET_ITEM        _IOW(CHDEV_IOCTL_MAGIC,  1, char *)
 #define CHDEV_IOCTL_GET_NUM_ITEM    _IOR(CHDEV_IOCTL_MAGIC,  2, uint  )
 #define CHDEV_IOCTL_GET_BUF_SIZE    _IOR(CHDEV_IOCTL_MAGIC,  3, uint  )
-#define CHDEV_IOCTL_MAXNR           4 
+#define CHDEV_IOCTL_GET_ITEMS       _IOWR(CHDEV_IOCTL_MAGIC, 4, struct chdev_items)
+#define CHDEV_IOCTL_SET_ITEMS       _IOWR(CHDEV_IOCTL_MAGIC, 5, struct chdev_items)
+#define CHDEV_IOCTL_RESERVE         _IOWR(CHDEV_IOCTL_MAGIC, 6, struct chdev_mmap_item)
+#define CHDEV_IOCTL_COMMIT          _IO(CHDEV_IOCTL_MAGIC,   7)
+#define CHDEV_IOCTL_PEEK            _IOR(CHDEV_IOCTL_MAGIC,  8, struct chdev_mmap_item)
+#define CHDEV_IOCTL_RELEASE         _IO(CHDEV_IOCTL_MAGIC,   9)
+#define CHDEV_IOCTL_SET_ROLE        _IO(CHDEV_IOCTL_MAGIC,   10)
+#define CHDEV_IOCTL_SYNC            _IO(CHDEV_IOCTL_MAGIC,   11)
+#define CHDEV_IOCTL_SET_FLAGS       _IO(CHDEV_IOCTL_MAGIC,   12)
+#define CHDEV_IOCTL_GET_STATS       _IOWR(CHDEV_IOCTL_MAGIC, 13, struct chdev_stats)
+#define CHDEV_IOCTL_SET_MODE        _IO(CHDEV_IOCTL_MAGIC,   14)
+#define CHDEV_IOCTL_GET_CURSOR      _IOR(CHDEV_IOCTL_MAGIC,  15, struct chdev_cursor_info)
+#define CHDEV_IOCTL_SET_PRIORITY    _IO(CHDEV_IOCTL_MAGIC,   16)
+#define CHDEV_IOCTL_GET_PRIO_ITEM   _IOWR(CHDEV_IOCTL_MAGIC, 17, struct chdev_prio_item)
+#define CHDEV_IOCTL_SET_PRIO_ITEM   _IOW(CHDEV_IOCTL_MAGIC,  18, struct chdev_prio_item)
+#define CHDEV_IOCTL_SNAPSHOT        _IOWR(CHDEV_IOCTL_MAGIC, 19, struct chdev_snapshot)
+#define CHDEV_IOCTL_GET_ITEM_MAX    _IOR(CHDEV_IOCTL_MAGIC,  20, uint  )
+#define CHDEV_IOCTL_SET_NODE        _IO(CHDEV_IOCTL_MAGIC,   21)
+#define CHDEV_IOCTL_SET_NOTIFY      _IOW(CHDEV_IOCTL_MAGIC,  22, struct chdev_notify)
+#define CHDEV_IOCTL_GET_HIST        _IOR(CHDEV_IOCTL_MAGIC,  23, struct chdev_hist)
+#define CHDEV_IOCTL_MAXNR           24
+
+/*
+ * Roles for CHDEV_IOCTL_SET_ROLE (passed by value).
+ * Each role can be owned by one file at a time. While a role is owned, reads (consumer)
+ * or writes (producer) through other files fail with -EBUSY, and the owner works without
+ * taking the device lock. The owner file must not be used by several threads concurrently.
+ */
+#define CHDEV_ROLE_NONE             0
+#define CHDEV_ROLE_PRODUCER         1
+#define CHDEV_ROLE_CONSUMER         2
+
+/*
+ * CHDEV_ROLE_MAPPED, or'ed with CHDEV_ROLE_PRODUCER or CHDEV_ROLE_CONSUMER: the owner moves items through
+ * the mapped buffer without any system call and publishes its position (wr_pos or rd_pos of the control page)
+ * with release semantics, reading the position of the other side with acquire semantics. Items are laid out
+ * as the driver does it: a record of a u32 header with the item size and the payload starts at a position
+ * which is a multiple of CHDEV_ITEM_ALIGN and takes the item size + sizeof(u32) rounded up to it; a record
+ * never wraps around the end of the buffer, the rest of the buffer is skipped by a header of -1 instead.
+ * Items written so are neither stamped nor compressed, and a mapped consumer reads the items of the driver as
+ * they are stored, so it is not available with CHDEV_MODE_TIMESTAMP and CHDEV_MODE_COMPRESS. The driver takes
+ * the position when another file reads, writes or polls, or on CHDEV_IOCTL_SYNC, which an owner calls when the
+ * other side may sleep (it found the buffer empty or full); the driver checks every item up to it and wakes
+ * readers and writers as if it had moved the items itself. A position which does not fall on an item boundary,
+ * or runs past the other side, is not taken past the last whole item, and the call which took it fails with
+ * -EINVAL. Headers are checked again whenever an item is read, so one which was rewritten after the driver took
+ * it fails the read with -EIO.
+ * Both sides can be mapped only while the buffer is empty (-EBUSY otherwise, and the file is left without
+ * a role). Then the driver checks the positions only, and items are not counted in CHDEV_IOCTL_GET_NUM_ITEM
+ * until a side is taken back. read(), write() and zero-copy ioctls of the owner fail with -EINVAL.
+ * Not available in broadcast mode.
+ */
+#define CHDEV_ROLE_MAPPED           0x4
+
+/*
+ * Flags of an open file for CHDEV_IOCTL_SET_FLAGS (passed by value).
+ * CHDEV_FLAG_FRAMED: read() and splice() return every item preceded by its length as uint;
+ * write() expects a single item preceded by its length, which must match the rest of the data.
+ */
+#define CHDEV_FLAG_FRAMED           0x1
+
+/*
+ * CHDEV_FLAG_RESIDENCE: read() and splice() return every item preceded by the time it spent in the buffer
+ * in nanoseconds as unsigned long long (after the length prefix of CHDEV_FLAG_FRAMED), 0 for items which
+ * were written without CHDEV_MODE_TIMESTAMP. Not available in slot mode.
+ */
+#define CHDEV_FLAG_RESIDENCE        0x2
+
+/*
+ * CHDEV_FLAG_STREAM: read() returns as many whole items as fit into the buffer, each one preceded by its
+ * length as with CHDEV_FLAG_FRAMED; write() takes a buffer of such records and writes them all under a single
+ * lock hold. Only the first record is waited for: reading stops at the first record which does not fit into
+ * the user buffer, writing at the first one which does not fit into the device, and the number of bytes of
+ * whole records is returned. So readv()/writev() and standard tools move many items per system call.
+ */
+#define CHDEV_FLAG_STREAM           0x4
+#define CHDEV_FLAGS_MASK            (CHDEV_FLAG_FRAMED | CHDEV_FLAG_RESIDENCE | CHDEV_FLAG_STREAM)
+
+/*
+ * Modes of a device for CHDEV_IOCTL_SET_MODE (passed by value), shared by all its files.
+ * CHDEV_MODE_OVERWRITE: an item which does not fit evicts the oldest items until it fits, so writes
+ * neither fail nor block on a full buffer; evicted items are counted in struct chdev_stats.
+ * Items are not evicted while the oldest one is read in place (CHDEV_IOCTL_PEEK). Not available
+ * in sharded mode, and incompatible with the roles of CHDEV_IOCTL_SET_ROLE.
+ */
+#define CHDEV_MODE_OVERWRITE        0x1
+
+/*
+ * CHDEV_MODE_BROADCAST: every file reads all items through its own cursor. A file subscribes with
+ * its first read, starting from the oldest item in the buffer, and unsubscribes when it is closed;
+ * an item is removed from the buffer once every subscriber has read it, so the slowest subscriber
+ * holds writers back. Together with CHDEV_MODE_OVERWRITE writers evict items instead, and cursors
+ * which pointed to them are moved forward: the next read() of such file fails once with -EPIPE,
+ * and CHDEV_IOCTL_GET_CURSOR tells how many items it lost. Not available in sharded mode, and
+ * incompatible with the consumer role and with CHDEV_IOCTL_PEEK.
+ */
+#define CHDEV_MODE_BROADCAST        0x2
+
+/*
+ * CHDEV_MODE_WEIGHTED: device with priority classes (priorities module parameter) serves them
+ * in weighted round-robin order, from the highest class down, instead of strict priority order.
+ */
+#define CHDEV_MODE_WEIGHTED         0x4
+
+/*
+ * CHDEV_MODE_COMPRESS: items from compress_min (module parameter) up to 64 KB are compressed with LZ4
+ * by the writer and decompressed by the reader, unless they do not get smaller. A compressed item
+ * has CHDEV_ITEM_LZ4 set in its header, so it can not be read in place (CHDEV_IOCTL_PEEK fails
+ * with -EINVAL) nor through the mapping of a CHDEV_ROLE_MAPPED consumer. Not available in sharded
+ * mode and with priority classes.
+ */
+#define CHDEV_MODE_COMPRESS         0x8
+
+/*
+ * CHDEV_MODE_TIMESTAMP: every item is stamped with its enqueue time, 8 more bytes of the buffer, and the
+ * time it spent in the buffer is added to the histogram of CHDEV_IOCTL_GET_HIST when it is read (by every
+ * subscriber in broadcast mode). Zero-copy items are stamped when they are committed.
+ */
+#define CHDEV_MODE_TIMESTAMP        0x10
+#define CHDEV_MODES_MASK            (CHDEV_MODE_OVERWRITE | CHDEV_MODE_BROADCAST | CHDEV_MODE_WEIGHTED | CHDEV_MODE_COMPRESS | \
+                                     CHDEV_MODE_TIMESTAMP)
+
+/*
+ * Alignment of the records of items in the buffer (see CHDEV_ROLE_MAPPED), buffer sizes are its multiples.
+ * A record takes at most half of the buffer, CHDEV_IOCTL_GET_ITEM_MAX tells the largest item in the current mode.
+ */
+#define CHDEV_ITEM_ALIGN            8
+
+/*
+ * NUMA node for CHDEV_IOCTL_SET_NODE (passed by value): a node number, or CHDEV_NODE_LOCAL for the
+ * node of the calling CPU, so a consumer thread pinned to its CPU can move the buffer next to it.
+ * Buffer and control page are reallocated on the node and items are kept. Only devices with a single
+ * buffer can be moved, and only while it is not mapped, no SPSC role is owned and no zero-copy
+ * operation is in progress (-EBUSY otherwise). Until a node is chosen, by the nodes module parameter
+ * or this ioctl, the buffer is moved the same way to the node of the file which takes the consumer role,
+ * if no one else uses it; CHDEV_IOCTL_SET_ROLE then fails with -ENOMEM or -EBUSY if the move does.
+ * Writers go on while the buffer is copied, the device lock is held only to catch up with them.
+ */
+#define CHDEV_NODE_LOCAL            (-1)
+
+/*
+ * Definitions for mmap().
+ * Page at offset CHDEV_MMAP_CTRL_PGOFF holds struct chdev_ring_ctrl, it can be mapped read-write by the owner
+ * of a mapped role to publish its position (see CHDEV_ROLE_MAPPED). Buffer starts at page offset
+ * CHDEV_MMAP_BUF_PGOFF and can be mapped read-write by the owner of the producer role, which writes reserved
+ * items (CHDEV_IOCTL_RESERVE) or items of a mapped producer through it. Any other file maps them read-only,
+ * and a writable mapping fails with -EACCES. The role can not be changed while such mappings exist (-EBUSY).
+ */
+#define CHDEV_MMAP_CTRL_PGOFF       0
+#define CHDEV_MMAP_BUF_PGOFF        1
 
 /*
  * Definitions of shared structures.
@@ -23,4 +175,141 @@ struct chdev_item {
     char  *buf; /* item buffer */
     short size; /* item size (in bytes) */
 } __attribute__ ((__packed__)) ;
-  
\ No newline at end of file
+
+/*
+ * Item with its priority class for CHDEV_IOCTL_GET_PRIO_ITEM and CHDEV_IOCTL_SET_PRIO_ITEM.
+ * Class 0 is the lowest one and the default of write() (see CHDEV_IOCTL_SET_PRIORITY); a device
+ * has as many classes as the priorities module parameter tells, or just class 0.
+ */
+struct chdev_prio_item {
+    char          *buf;     /* item buffer */
+    short         size;     /* item size (in bytes) */
+    unsigned char priority; /* priority class (in: write, out: read) */
+} __attribute__ ((__packed__)) ;
+
+/*
+ * Vector of items for CHDEV_IOCTL_GET_ITEMS and CHDEV_IOCTL_SET_ITEMS.
+ * On return count holds the number of items transferred, and the size of each
+ * transferred item is replaced with the number of bytes actually read or written.
+ */
+struct chdev_items {
+    struct chdev_item *items; /* array of item descriptors */
+    uint              count;  /* number of descriptors in items (in), number of items transferred (out) */
+} __attribute__ ((__packed__)) ;
+
+/*
+ * Item located in the mapped buffer, used by CHDEV_IOCTL_RESERVE and CHDEV_IOCTL_PEEK.
+ * Payload of every item is contiguous, whichever way it was written.
+ */
+struct chdev_mmap_item {
+    uint off;  /* offset of item payload from the beginning of the buffer */
+    uint size; /* item size (in bytes) */
+} __attribute__ ((__packed__)) ;
+
+/*
+ * Statistics of a device for CHDEV_IOCTL_GET_STATS, summed over all CPUs (and shards).
+ * Caller sets size to sizeof(struct chdev_stats) it was compiled with; the driver fills at most
+ * that many bytes and returns the number of filled bytes in size. New fields are only appended.
+ */
+#define CHDEV_STATS_VERSION         3
+
+struct chdev_stats {
+    uint               version;         /* CHDEV_STATS_VERSION of the driver */
+    uint               size;            /* size of the structure (in: caller, out: filled by the driver) */
+    uint               buf_size;        /* size of each buffer of the device */
+    uint               num_item;        /* number of items in the device */
+    unsigned long long enqueued;        /* number of items written */
+    unsigned long long dequeued;        /* number of items read or dropped (by every subscriber in broadcast mode) */
+    unsigned long long bytes_in;        /* payload bytes written */
+    unsigned long long bytes_out;       /* payload bytes read or dropped */
+    unsigned long long full;            /* writes which found no room for the item */
+    unsigned long long empty;           /* reads which found no item */
+    unsigned long long contended;       /* lock acquisitions which had to wait */
+    unsigned long long interrupted;     /* lock or item waits interrupted by a signal */
+    unsigned long long high_watermark;  /* largest number of bytes ever used in a buffer, including headers */
+    unsigned long long dropped;         /* number of items evicted in overwrite mode (version 2) */
+    unsigned long long dropped_bytes;   /* payload bytes evicted in overwrite mode (version 2) */
+    unsigned long long compressed;      /* number of items stored compressed (version 3) */
+    unsigned long long compress_in;     /* bytes of compressed items before compression (version 3) */
+    unsigned long long compress_out;    /* bytes of compressed items in the buffer (version 3) */
+    unsigned long long compress_ns;     /* time spent compressing items, including incompressible ones (version 3) */
+    unsigned long long decompress_ns;   /* time spent decompressing items (version 3) */
+} __attribute__ ((__packed__)) ;
+
+/*
+ * Copy of the buffer for CHDEV_IOCTL_SNAPSHOT, items are not removed. Items are stored to buf oldest
+ * first, each preceded by its length as uint, as framed reads return them (see CHDEV_FLAG_FRAMED).
+ * Only whole items are stored: if num_item < total, the next item did not fit into buf.
+ * Not available in sharded mode, with priority classes and while a role is owned.
+ */
+struct chdev_snapshot {
+    char               *buf;            /* buffer for the items */
+    uint               size;            /* size of buf (in), number of bytes stored (out) */
+    uint               num_item;        /* number of items stored (out) */
+    uint               total;           /* number of items in the device buffer (out) */
+} __attribute__ ((__packed__)) ;
+
+/*
+ * Eventfd notification of the device for CHDEV_IOCTL_SET_NOTIFY, it replaces the previous one and
+ * both descriptors -1 remove it. Instead of every item, rd_fd is signaled by the write which raises
+ * the device from below rd_items items or rd_bytes used bytes to at least that many (a batch of
+ * CHDEV_IOCTL_SET_ITEMS or a write of stream mode counts as one write), and delay_us after a write
+ * which stays below them, so a trickle of items is still delivered in time. wr_fd is signaled by the
+ * read which raises free space to wr_free bytes (of the buffer read from, in sharded mode and with
+ * priority classes).
+ * Zero disables a watermark or the delay. Readers and writers still have to handle empty and full buffer.
+ */
+struct chdev_notify {
+    int                rd_fd;           /* eventfd for readers, -1 if none */
+    uint               rd_items;        /* watermark of items for readers */
+    uint               rd_bytes;        /* watermark of used bytes for readers */
+    uint               delay_us;        /* maximum delay of items below the watermarks of readers */
+    int                wr_fd;           /* eventfd for writers, -1 if none */
+    uint               wr_free;         /* watermark of free bytes for writers */
+} __attribute__ ((__packed__)) ;
+
+/*
+ * Histogram of residence times of stamped items for CHDEV_IOCTL_GET_HIST, summed over all CPUs.
+ * Buckets 0..3 hold times of 0..3 ns; above that every power of two is split into 4 buckets, so bucket
+ * 4 * (e - 1) + m holds times in [(4 + m) << (e - 2), (5 + m) << (e - 2)) ns for e >= 2 and m = 0..3.
+ * The last bucket also holds all longer times, from 2^41 ns (about 37 minutes).
+ */
+#define CHDEV_HIST_BUCKETS          160
+
+struct chdev_hist {
+    unsigned long long count;           /* number of stamped items read */
+    unsigned long long sum_ns;          /* sum of their residence times */
+    unsigned long long max_ns;          /* maximum residence time */
+    unsigned long long buckets[CHDEV_HIST_BUCKETS];
+} __attribute__ ((__packed__)) ;
+
+/*
+ * Read cursor of the file for CHDEV_IOCTL_GET_CURSOR, broadcast mode only.
+ */
+struct chdev_cursor_info {
+    unsigned long long seq;             /* sequence number of the next item to read */
+    unsigned long long lost;            /* number of items evicted before this file read them */
+    uint               num_item;        /* number of items left to read by this file */
+} __attribute__ ((__packed__)) ;
+
+/*
+ * Control page of the mapped buffer. Producer and consumer fields are placed on different cache lines;
+ * positions and item counters are updated with release semantics, and the number of items in the buffer
+ * is (wr_item - rd_item). Positions are free-running byte counters, including headers and padding, so the
+ * byte at position pos is located at offset pos % buf_size and (wr_pos - rd_pos) bytes are used.
+ * The driver updates the fields of a side, unless it is owned by a mapped role: then its owner updates
+ * the position only, and the rest of its cache line is left as it was.
+ */
+struct chdev_ring_ctrl {
+    uint               buf_size;        /* size of the buffer */
+    uint               end;             /* offset of the first byte after the newest committed item */
+    uint               wr_item;         /* number of items ever committed */
+    uint               reserved;        /* padding up to wr_pos */
+    unsigned long long wr_pos;          /* position of the producer */
+    uint               reserved2[10];   /* padding up to 64 bytes */
+    uint               beg;             /* offset of the oldest item header */
+    uint               rd_item;         /* number of items ever consumed */
+    unsigned long long rd_pos;          /* position of the consumer */
+} __attribute__ ((__packed__)) ;
+
+#endif /* CHDEV_COMMON_H */
@@ -0,0 +1,173 @@
+/* 
+ * Copyright (C) 2014 Sergey Morozov
+ * 
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.
+ */
+
+/*
+ * Tracepoints of chdev, available as events/chdev/ in tracefs (ftrace, perf, bpftrace).
+ * Disabled tracepoints cost a patched-out branch; arguments which take time to compute
+ * are only computed if trace_<event>_enabled().
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM chdev
+
+#if !defined(_CHDEV_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _CHDEV_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * Layout of an item in the circular buffer, records never wrap around its end.
+ */
+#define CHDEV_TRACE_FLAT       0   /* item follows the previous one */
+#define CHDEV_TRACE_PAD        1   /* item follows padding at the end of the buffer */
+
+#define chdev_trace_layout(layout) __print_symbolic(layout,  \
+    { CHDEV_TRACE_FLAT,  "flat"  },                          \
+    { CHDEV_TRACE_PAD,   "pad"   })
+
+DECLARE_EVENT_CLASS(chdev_item,
+    
+    TP_PROTO(unsigned int minor, size_t len, size_t used, unsigned int items, int layout),
+    
+    TP_ARGS(minor, len, used, items, layout),
+    
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(size_t,       len)
+        __field(size_t,       used)
+        __field(unsigned int, items)
+        __field(int,          layout)
+    ),
+    
+    TP_fast_assign(
+        __entry->minor  = minor;
+        __entry->len    = len;
+        __entry->used   = used;
+        __entry->items  = items;
+        __entry->layout = layout;
+    ),
+    
+    TP_printk("chdev%u len=%zu used=%zu items=%u layout=%s",
+        __entry->minor, __entry->len, __entry->used, __entry->items, chdev_trace_layout(__entry->layout))
+);
+
+/*
+ * Item became visible to readers; used and items are the occupancy of its buffer after that.
+ */
+DEFINE_EVENT(chdev_item, chdev_enqueue,
+    TP_PROTO(unsigned int minor, size_t len, size_t used, unsigned int items, int layout),
+    TP_ARGS(minor, len, used, items, layout)
+);
+
+/*
+ * Item was read or dropped; used and items are the occupancy of its buffer after that.
+ */
+DEFINE_EVENT(chdev_item, chdev_dequeue,
+    TP_PROTO(unsigned int minor, size_t len, size_t used, unsigned int items, int layout),
+    TP_ARGS(minor, len, used, items, layout)
+);
+
+/*
+ * Item was evicted by a writer of an overwrite mode device; used and items are the occupancy after that.
+ */
+DEFINE_EVENT(chdev_item, chdev_evict,
+    TP_PROTO(unsigned int minor, size_t len, size_t used, unsigned int items, int layout),
+    TP_ARGS(minor, len, used, items, layout)
+);
+
+/*
+ * Item was not transferred: buffer is full or empty (-ENOMEM, -EAGAIN) or user buffer is too small (-ENOMEM).
+ */
+TRACE_EVENT(chdev_reject,
+    
+    TP_PROTO(unsigned int minor, bool write, size_t len, size_t used, int err),
+    
+    TP_ARGS(minor, write, len, used, err),
+    
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(bool,         write)
+        __field(size_t,       len)
+        __field(size_t,       used)
+        __field(int,          err)
+    ),
+    
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->write = write;
+        __entry->len   = len;
+        __entry->used  = used;
+        __entry->err   = err;
+    ),
+    
+    TP_printk("chdev%u %s len=%zu used=%zu err=%d",
+        __entry->minor, __entry->write ? "write" : "read", __entry->len, __entry->used, __entry->err)
+);
+
+/*
+ * Semaphore was acquired (or the wait for it was interrupted) after wait_ns.
+ */
+TRACE_EVENT(chdev_lock,
+    
+    TP_PROTO(unsigned int minor, u64 wait_ns, bool interrupted),
+    
+    TP_ARGS(minor, wait_ns, interrupted),
+    
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(u64,          wait_ns)
+        __field(bool,         interrupted)
+    ),
+    
+    TP_fast_assign(
+        __entry->minor       = minor;
+        __entry->wait_ns     = wait_ns;
+        __entry->interrupted = interrupted;
+    ),
+    
+    TP_printk("chdev%u wait_ns=%llu%s",
+        __entry->minor, __entry->wait_ns, __entry->interrupted ? " interrupted" : "")
+);
+
+/*
+ * Blocking read() or write() slept wait_ns for an item or free space; ret is 0 or -ERESTARTSYS.
+ */
+TRACE_EVENT(chdev_wait,
+    
+    TP_PROTO(unsigned int minor, bool write, size_t len, u64 wait_ns, int ret),
+    
+    TP_ARGS(minor, write, len, wait_ns, ret),
+    
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(bool,         write)
+        __field(size_t,       len)
+        __field(u64,          wait_ns)
+        __field(int,          ret)
+    ),
+    
+    TP_fast_assign(
+        __entry->minor   = minor;
+        __entry->write   = write;
+        __entry->len     = len;
+        __entry->wait_ns = wait_ns;
+        __entry->ret     = ret;
+    ),
+    
+    TP_printk("chdev%u %s len=%zu wait_ns=%llu ret=%d",
+        __entry->minor, __entry->write ? "write" : "read", __entry->len, __entry->wait_ns, __entry->ret)
+);
+
+#endif /* _CHDEV_TRACE_H */
+
+/* this part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE chdev_trace
+#include <trace/define_trace.h>
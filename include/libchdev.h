@@ -0,0 +1,186 @@
+/* 
+ * Copyright (C) 2014 Sergey Morozov
+ * 
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.
+ * 
+ * C++ client library of the chdev driver, build it with:
+ *     make lib
+ * and link bin/libchdev.a. All calls return negative errno values on failure, as the driver does;
+ * a Device must not be used by several threads concurrently.
+ */
+
+#ifndef LIBCHDEV_H
+#define LIBCHDEV_H
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+
+#include "chdev_common.h"
+
+#define CHDEV_LIB_BATCH    32          /* items received by a single CHDEV_IOCTL_GET_ITEMS */
+#define CHDEV_LIB_ITEM_MAX 32767       /* largest item of a batch, struct chdev_item has a short size */
+
+namespace chdev {
+
+/*
+ * Bytes of an item which are not owned by the view, std::span of C++20.
+ */
+struct Bytes {
+    const char *data;
+    size_t     size;
+    
+    Bytes() : data(NULL), size(0) {
+    }
+    Bytes(const void *data, size_t size) : data((const char *)data), size(size) {
+    }
+    Bytes(const std::string &str) : data(str.data()), size(str.size()) {
+    }
+    std::string str() const {
+        return std::string(data, size);
+    }
+};
+
+/*
+ * Receive buffers of a device, each one large enough for any item. Buffers are only allocated
+ * while all of them are taken, so a consumer which releases what it received does not allocate.
+ */
+class BufferPool {
+public:
+    explicit BufferPool(size_t size) : size(size) {
+    }
+    char   *acquire();
+    void   release(char *buf);
+    size_t buf_size() const {
+        return size;
+    }
+    
+private:
+    size_t                               size;       /* size of every buffer */
+    std::vector<char *>                  spare;      /* buffers which are not taken */
+    std::vector<std::unique_ptr<char[]>> all;        /* every buffer ever allocated */
+};
+
+/*
+ * Item received by Device::pop(Buffer &), its storage goes back to the pool when the buffer is
+ * destroyed or reused. Buffers must not outlive the device they were received from.
+ */
+class Buffer {
+public:
+    Buffer() : pool(NULL), buf(NULL), len(0) {
+    }
+    Buffer(Buffer &&other);
+    Buffer &operator=(Buffer &&other);
+    Buffer(const Buffer &) = delete;
+    Buffer &operator=(const Buffer &) = delete;
+    ~Buffer() {
+        reset();
+    }
+    
+    const char *data() const {
+        return buf;
+    }
+    size_t size() const {
+        return len;
+    }
+    Bytes bytes() const {
+        return Bytes(buf, len);
+    }
+    void reset();
+    
+private:
+    friend class Device;
+    
+    BufferPool *pool;
+    char       *buf;
+    size_t     len;
+};
+
+/*
+ * Kernel interface used by Device::consume(...) to receive items, chosen when the device is opened.
+ */
+enum class Interface {
+    Batched,    /* CHDEV_IOCTL_GET_ITEMS of up to CHDEV_LIB_BATCH items, read() sleeps while the device is empty */
+    Blocking,   /* read() of every item, the driver has no batches */
+    Poll        /* poll() on a file opened with O_NONBLOCK, then batches (or reads without them) */
+};
+
+/*
+ * Open file of a chdev device, closed when the handle is destroyed.
+ */
+class Device {
+public:
+    Device() : fd(-1), item_max(0), nonblock(false), batches(false), iface(Interface::Blocking) {
+    }
+    Device(Device &&other);
+    Device &operator=(Device &&other);
+    Device(const Device &) = delete;
+    Device &operator=(const Device &) = delete;
+    ~Device() {
+        close();
+    }
+    
+    int  open(const std::string &path, int flags = O_RDWR);
+    void close();
+    int  file() const {
+        return fd;
+    }
+    
+    /*
+     * Items of at most bytes bytes are copied to a batch which is written by a single CHDEV_IOCTL_SET_ITEMS
+     * when the next item does not fit into count items or bytes bytes, or by flush(). count 0 writes every
+     * item at once.
+     */
+    int     set_coalescing(uint count, size_t bytes);
+    ssize_t push(Bytes item);
+    int     flush();
+    
+    ssize_t pop(char *buf, size_t size);
+    ssize_t pop(Buffer &out);
+    
+    /*
+     * Pass every received item to callback until it returns false, waiting for items as the interface
+     * tells; the item is valid during the call only. timeout_ms limits every wait of Interface::Poll.
+     * Returns 0 if the callback stopped the loop, -ETIMEDOUT or another error otherwise.
+     */
+    int       consume(const std::function<bool(Bytes)> &callback, int timeout_ms = -1);
+    Interface interface() const {
+        return iface;
+    }
+    
+private:
+    ssize_t write_item(Bytes item);
+    ssize_t next(Bytes &item, bool wait);
+    
+    int                         fd;
+    size_t                      item_max;       /* largest item the device takes, see CHDEV_IOCTL_GET_ITEM_MAX */
+    bool                        nonblock;       /* file was opened with O_NONBLOCK */
+    bool                        batches;        /* driver knows CHDEV_IOCTL_GET_ITEMS */
+    Interface                   iface;
+    
+    /* coalescing of writes */
+    uint                        max_items = 0;
+    size_t                      max_bytes = 0;
+    std::vector<char>           batch;          /* payload of coalesced items */
+    size_t                      batch_len = 0;  /* bytes of batch taken */
+    std::vector<chdev_item>     pending;        /* descriptors of coalesced items */
+    size_t                      submitted = 0;  /* descriptors already written */
+    
+    /* receive buffers */
+    std::unique_ptr<BufferPool> pool;
+    std::vector<char>           rx_buf;         /* CHDEV_LIB_BATCH buffers of a batch, then one for the largest item */
+    std::vector<chdev_item>     items;          /* descriptors of the last batch */
+    size_t                      received = 0;   /* items of the last batch */
+    size_t                      delivered = 0;  /* items of the last batch already returned */
+};
+
+} /* namespace chdev */
+
+#endif /* LIBCHDEV_H */
@@ -0,0 +1,562 @@
+/* 
+ * Copyright (C) 2014 Sergey Morozov
+ * 
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.
+ * 
+ * Throughput and latency benchmark of a loaded chdev driver, build it with:
+ *     make bench
+ * 
+ * Usage: bench_chdev [-d device] [-p producers] [-c consumers] [-s size[,size...]]
+ *                    [-t seconds | -n items] [-b backend[,backend...]]
+ * Backends: write (read()/write()), ioctl (CHDEV_IOCTL_SET_ITEM/GET_ITEMS), and the baselines
+ * pipe (packet mode), socket (AF_UNIX SOCK_SEQPACKET) and eventfd (8 byte counter, no payload).
+ * Results are printed to stdout as JSON.
+ */
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <getopt.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include "chdev_common.h"
+
+#define HIST_SUB       64          /* histogram buckets per power of two */
+#define HIST_POW       40          /* powers of two covered by the histogram, up to ~18 minutes in ns */
+
+using namespace std;
+
+/*
+ * Log-linear latency histogram: relative error of a percentile is below 1/HIST_SUB.
+ */
+struct histogram {
+    vector<uint64_t> counts;
+    uint64_t         total;
+    
+    histogram() : counts(HIST_SUB * (HIST_POW + 1), 0), total(0) {
+    }
+    
+    /* values below 2 * HIST_SUB have own buckets, larger ones keep log2(HIST_SUB) + 1 significant bits */
+    static size_t bucket(uint64_t ns) {
+        int pow = 0;
+        
+        while ((ns >> pow) >= 2 * HIST_SUB && pow < HIST_POW - 1) {
+            ++pow;
+        }
+        return (size_t)pow * HIST_SUB + (ns >> pow);
+    }
+    
+    static uint64_t value(size_t index) {
+        size_t pow = index < 2 * HIST_SUB ? 0 : index / HIST_SUB - 1;
+        
+        return (uint64_t)(index - pow * HIST_SUB) << pow;
+    }
+    
+    void record(uint64_t ns) {
+        counts[min(bucket(ns), counts.size() - 1)]++;
+        total++;
+    }
+    
+    void merge(const histogram &other) {
+        for (size_t i = 0; i < counts.size(); i++) {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+    }
+    
+    uint64_t percentile(double p) const {
+        uint64_t rank = (uint64_t)(p * total), seen = 0;
+        
+        for (size_t i = 0; i < counts.size(); i++) {
+            seen += counts[i];
+            if (seen > rank) {
+                return value(i);
+            }
+        }
+        return 0;
+    }
+    
+    string json() const {
+        ostringstream out;
+        
+        if (!total) {
+            return "null";
+        }
+        out << "{\"p50\": " << percentile(0.5) << ", \"p99\": " << percentile(0.99) << ", \"p999\": " << percentile(0.999) << "}";
+        return out.str();
+    }
+};
+
+/*
+ * Statistics collected by a single thread.
+ */
+struct thread_stats {
+    uint64_t  items = 0;        /* items transferred */
+    uint64_t  bytes = 0;        /* payload bytes transferred */
+    uint64_t  full  = 0;        /* rejected writes: buffer full (-EAGAIN or -ENOMEM) */
+    uint64_t  empty = 0;        /* reads which found the buffer empty */
+    histogram call;             /* duration of a successful write call */
+    histogram e2e;              /* time from write to read, for items which carry a timestamp */
+};
+
+/*
+ * Transport under test. Every thread gets its own descriptor from open_tx()/open_rx().
+ * send()/recv() return number of bytes transferred, -EAGAIN if the transport is full/empty or -errno.
+ */
+struct transport {
+    virtual ~transport() {
+    }
+    virtual string  name() const = 0;
+    virtual size_t  max_size() const = 0;
+    virtual bool    payload() const {
+        return true;
+    }
+    virtual int     open_tx() = 0;
+    virtual int     open_rx() = 0;
+    virtual void    close_fd(int fd) {
+    }
+    virtual ssize_t send(int fd, const char *buf, size_t size) = 0;
+    virtual ssize_t recv(int fd, char *buf, size_t size) = 0;
+};
+
+static ssize_t errno_result(ssize_t retval) {
+    if (retval >= 0) {
+        return retval;
+    }
+    return (errno == EAGAIN || errno == ENOMEM) ? -EAGAIN : -errno;
+}
+
+/*
+ * Base for chdev transports: a non-blocking descriptor per thread.
+ */
+struct chdev_transport : transport {
+    string   device;
+    uint     item_max;   /* largest item the device takes */
+    
+    chdev_transport(const string &device) : device(device), item_max(0) {
+        int fd = open_dev();
+        
+        if (ioctl(fd, CHDEV_IOCTL_GET_ITEM_MAX, &item_max)) {
+            cerr << "ERROR: Item size request failed." << endl;
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+    }
+    int open_dev() {
+        int fd = open(device.c_str(), O_RDWR | O_NONBLOCK);
+        
+        if (fd == -1) {
+            cerr << "ERROR: " << device << " file not found." << endl;
+            exit(EXIT_FAILURE);
+        }
+        return fd;
+    }
+    int open_tx() {
+        return open_dev();
+    }
+    int open_rx() {
+        return open_dev();
+    }
+    void close_fd(int fd) {
+        close(fd);
+    }
+};
+
+struct chdev_rw_transport : chdev_transport {
+    chdev_rw_transport(const string &device) : chdev_transport(device) {
+    }
+    string name() const {
+        return "write";
+    }
+    size_t max_size() const {
+        return item_max;
+    }
+    ssize_t send(int fd, const char *buf, size_t size) {
+        return errno_result(write(fd, buf, size));
+    }
+    ssize_t recv(int fd, char *buf, size_t size) {
+        return errno_result(read(fd, buf, size));
+    }
+};
+
+struct chdev_ioctl_transport : chdev_transport {
+    chdev_ioctl_transport(const string &device) : chdev_transport(device) {
+    }
+    string name() const {
+        return "ioctl";
+    }
+    size_t max_size() const {
+        return min((size_t)SHRT_MAX, (size_t)item_max);
+    }
+    ssize_t send(int fd, const char *buf, size_t size) {
+        struct chdev_item item;
+        
+        item.buf  = const_cast<char *>(buf);
+        item.size = size;
+        return ioctl(fd, CHDEV_IOCTL_SET_ITEM, &item) ? errno_result(-1) : (ssize_t)size;
+    }
+    ssize_t recv(int fd, char *buf, size_t size) {
+        struct chdev_item  item;   /* GET_ITEMS tells an empty buffer from an empty item */
+        struct chdev_items vec;
+        
+        item.buf   = buf;
+        item.size  = min(size, (size_t)SHRT_MAX);
+        vec.items  = &item;
+        vec.count  = 1;
+        if (ioctl(fd, CHDEV_IOCTL_GET_ITEMS, &vec)) {
+            return errno_result(-1);
+        }
+        return vec.count ? item.size : -EAGAIN;
+    }
+};
+
+/*
+ * Baselines share one pair of descriptors between all threads.
+ */
+struct pair_transport : transport {
+    int tx, rx;
+    
+    ~pair_transport() {
+        close(tx);
+        if (rx != tx) {
+            close(rx);
+        }
+    }
+    int open_tx() {
+        return tx;
+    }
+    int open_rx() {
+        return rx;
+    }
+    ssize_t send(int fd, const char *buf, size_t size) {
+        return errno_result(write(fd, buf, size));
+    }
+    ssize_t recv(int fd, char *buf, size_t size) {
+        return errno_result(read(fd, buf, size));
+    }
+};
+
+struct pipe_transport : pair_transport {
+    pipe_transport() {
+        int fds[2];
+        
+        /* packet mode keeps item boundaries for items up to PIPE_BUF */
+        if (pipe2(fds, O_DIRECT | O_NONBLOCK)) {
+            cerr << "ERROR: Pipe creation failed." << endl;
+            exit(EXIT_FAILURE);
+        }
+        rx = fds[0];
+        tx = fds[1];
+    }
+    string name() const {
+        return "pipe";
+    }
+    size_t max_size() const {
+        return PIPE_BUF;
+    }
+};
+
+struct socket_transport : pair_transport {
+    socket_transport() {
+        int fds[2];
+        
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0, fds)) {
+            cerr << "ERROR: Socket creation failed." << endl;
+            exit(EXIT_FAILURE);
+        }
+        rx = fds[0];
+        tx = fds[1];
+    }
+    string name() const {
+        return "socket";
+    }
+    size_t max_size() const {
+        return 65536;
+    }
+};
+
+struct eventfd_transport : pair_transport {
+    eventfd_transport() {
+        tx = rx = eventfd(0, EFD_SEMAPHORE | EFD_NONBLOCK);
+        if (tx == -1) {
+            cerr << "ERROR: Eventfd creation failed." << endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    string name() const {
+        return "eventfd";
+    }
+    size_t max_size() const {
+        return sizeof(uint64_t);
+    }
+    bool payload() const {
+        return false;
+    }
+    ssize_t send(int fd, const char *buf, size_t size) {
+        uint64_t one = 1;
+        
+        return errno_result(write(fd, &one, sizeof(one)));
+    }
+    ssize_t recv(int fd, char *buf, size_t size) {
+        uint64_t value;
+        
+        return errno_result(read(fd, &value, sizeof(value)));
+    }
+};
+
+/*
+ * Benchmark parameters.
+ */
+struct options {
+    string         device    = "/dev/chdev";
+    int            producers = 1;
+    int            consumers = 1;
+    vector<size_t> sizes;                   /* empty: powers of two up to the maximum */
+    double         seconds   = 1.0;
+    uint64_t       count     = 0;           /* items per producer, 0: run for seconds */
+    vector<string> backends  = { "write", "ioctl", "pipe", "socket", "eventfd" };
+};
+
+static uint64_t now_ns() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*
+ * Remove items left in the transport by a previous run.
+ */
+static void drain(transport &tr, size_t max_size) {
+    vector<char> buf(max_size + 1);
+    int          fd = tr.open_rx();
+    
+    while (tr.recv(fd, buf.data(), buf.size()) >= 0) {
+    }
+    tr.close_fd(fd);
+}
+
+/*
+ * Run producers and consumers on the transport with items of the given size, print a JSON object.
+ */
+static void run(transport &tr, const options &opt, size_t size, bool first) {
+    vector<thread>       threads;
+    vector<thread_stats> pstats(opt.producers), cstats(opt.consumers);
+    atomic<bool>         stop(false);
+    atomic<int>          active(opt.producers);   /* producers still running */
+    atomic<uint64_t>     sent(0), received(0);
+    bool                 stamp = tr.payload() && size >= sizeof(uint64_t);
+    thread_stats         total;
+    uint64_t             start, elapsed;
+    ostringstream        out;
+    
+    drain(tr, tr.max_size());
+    start = now_ns();
+    
+    for (int i = 0; i < opt.producers; i++) {
+        threads.emplace_back([&, i]() {
+            thread_stats &st = pstats[i];
+            vector<char> buf(max(size, (size_t)1), 'x');
+            int          fd = tr.open_tx();
+            
+            while (!stop.load(memory_order_relaxed) && (!opt.count || st.items < opt.count)) {
+                uint64_t t0 = now_ns();
+                ssize_t  retval;
+                
+                if (stamp) {
+                    memcpy(buf.data(), &t0, sizeof(t0));
+                }
+                retval = tr.send(fd, buf.data(), size);
+                if (retval >= 0) {
+                    st.call.record(now_ns() - t0);
+                    st.items++;
+                    st.bytes += size;
+                    sent.fetch_add(1, memory_order_release);
+                }
+                else if (retval == -EAGAIN) {
+                    st.full++;
+                    this_thread::yield();
+                }
+                else {
+                    cerr << "ERROR: " << tr.name() << " write failed: " << strerror(-retval) << endl;
+                    exit(EXIT_FAILURE);
+                }
+            }
+            tr.close_fd(fd);
+            active.fetch_sub(1, memory_order_release);
+        });
+    }
+    
+    for (int i = 0; i < opt.consumers; i++) {
+        threads.emplace_back([&, i]() {
+            thread_stats &st = cstats[i];
+            vector<char> buf(tr.max_size() + 1);
+            int          fd = tr.open_rx();
+            
+            for (;;) {
+                ssize_t retval = tr.recv(fd, buf.data(), buf.size());
+                
+                if (retval >= 0) {
+                    if (stamp && (size_t)retval >= sizeof(uint64_t)) {
+                        uint64_t t0;
+                        
+                        memcpy(&t0, buf.data(), sizeof(t0));
+                        st.e2e.record(now_ns() - t0);
+                    }
+                    st.items++;
+                    st.bytes += retval;
+                    received.fetch_add(1, memory_order_relaxed);
+                }
+                else if (retval == -EAGAIN) {
+                    /* all producers finished and everything they sent was received */
+                    if (!active.load(memory_order_acquire) && received.load() >= sent.load(memory_order_acquire)) {
+                        break;
+                    }
+                    st.empty++;
+                    this_thread::yield();
+                }
+                else {
+                    cerr << "ERROR: " << tr.name() << " read failed: " << strerror(-retval) << endl;
+                    exit(EXIT_FAILURE);
+                }
+            }
+            tr.close_fd(fd);
+        });
+    }
+    
+    if (!opt.count) {
+        this_thread::sleep_for(chrono::duration<double>(opt.seconds));
+        stop = true;
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    elapsed = now_ns() - start;
+    
+    for (auto &st : pstats) {
+        total.full += st.full;
+        total.call.merge(st.call);
+    }
+    for (auto &st : cstats) {
+        total.items += st.items;
+        total.bytes += st.bytes;
+        total.empty += st.empty;
+        total.e2e.merge(st.e2e);
+    }
+    
+    out << (first ? "" : ",\n") << "    {\"backend\": \"" << tr.name() << "\", \"item_size\": " << size
+        << ", \"producers\": " << opt.producers << ", \"consumers\": " << opt.consumers
+        << ", \"seconds\": " << elapsed / 1e9 << ", \"items\": " << total.items
+        << ", \"items_per_s\": " << total.items * 1e9 / elapsed
+        << ", \"mb_per_s\": " << total.bytes * 1e3 / elapsed
+        << ", \"full_rate\": " << (double)total.full / max((uint64_t)1, total.full + total.call.total)
+        << ", \"empty_rate\": " << (double)total.empty / max((uint64_t)1, total.empty + total.items)
+        << ", \"write_ns\": " << total.call.json()
+        << ", \"latency_ns\": " << total.e2e.json() << "}";
+    cout << out.str() << flush;
+}
+
+static vector<string> split(const string &list) {
+    vector<string> parts;
+    istringstream  in(list);
+    string         part;
+    
+    while (getline(in, part, ',')) {
+        parts.push_back(part);
+    }
+    return parts;
+}
+
+static void usage(const char *prog) {
+    cerr << "Usage: " << prog << " [-d device] [-p producers] [-c consumers] [-s size[,size...]]" << endl
+         << "       [-t seconds | -n items] [-b write,ioctl,pipe,socket,eventfd]" << endl;
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    options opt;
+    int     c;
+    bool    first = true;
+    
+    while ((c = getopt(argc, argv, "d:p:c:s:t:n:b:h")) != -1) {
+        switch (c) {
+            case 'd': opt.device    = optarg;                 break;
+            case 'p': opt.producers = atoi(optarg);           break;
+            case 'c': opt.consumers = atoi(optarg);           break;
+            case 't': opt.seconds   = atof(optarg);           break;
+            case 'n': opt.count     = strtoull(optarg, 0, 0); break;
+            case 'b': opt.backends  = split(optarg);          break;
+            case 's':
+                for (auto &s : split(optarg)) {
+                    opt.sizes.push_back(strtoul(s.c_str(), 0, 0));
+                }
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (opt.producers < 1 || opt.consumers < 1) {
+        usage(argv[0]);
+    }
+    
+    cout << "{\"device\": \"" << opt.device << "\", \"results\": [\n";
+    
+    for (auto &name : opt.backends) {
+        transport *tr;
+        
+        if (name == "write") {
+            tr = new chdev_rw_transport(opt.device);
+        }
+        else if (name == "ioctl") {
+            tr = new chdev_ioctl_transport(opt.device);
+        }
+        else if (name == "pipe") {
+            tr = new pipe_transport();
+        }
+        else if (name == "socket") {
+            tr = new socket_transport();
+        }
+        else if (name == "eventfd") {
+            tr = new eventfd_transport();
+        }
+        else {
+            usage(argv[0]);
+        }
+        
+        /* sweep from 1 B to the largest item of the transport */
+        vector<size_t> sizes = opt.sizes;
+        if (!tr->payload()) {
+            sizes.assign(1, tr->max_size());
+        }
+        else if (sizes.empty()) {
+            for (size_t size = 1; size < tr->max_size(); size *= 2) {
+                sizes.push_back(size);
+            }
+            sizes.push_back(tr->max_size());
+        }
+        
+        for (size_t size : sizes) {
+            if (size <= tr->max_size()) {
+                run(*tr, opt, size, first);
+                first = false;
+            }
+        }
+        delete tr;
+    }
+    
+    cout << "\n]}" << endl;
+    
+    return EXIT_SUCCESS;
+}
@@ -9,27 +9,85 @@
 #include <linux/module.h>
 #include <linux/cdev.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/gfp.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
+#include <linux/uio.h>
+#include <linux/fs.h>
+#include <linux/log2.h>
+#include <linux/lz4.h>
+#include <linux/eventfd.h>
+#include <linux/hrtimer.h>
+#include <linux/rcupdate.h>
 #include <asm/uaccess.h>
 
 #include "chdev.h"
 #include "chdev_common.h"
 
+#define CREATE_TRACE_POINTS
+#include "chdev_trace.h"
+
 /*
  * Declarations of functions.
  */
 static int  __init     chdev_init_module(void);
-static int  __init     chdev_setup(void);
+static int  __init     chdev_setup(struct chdev_dev *, int);
+static int  __init     chdev_node(int);
+static int  __init     chdev_setup_ring(struct chdev_ring *, size_t, int);
+static int  __init     chdev_setup_slots(struct chdev_dev *);
+static void            chdev_free_slots(struct chdev_slots *);
+static void            chdev_free_ring(struct chdev_ring *);
+static char           *chdev_alloc_buf(size_t, int);
+static void            chdev_free_buf(char *, size_t);
+static struct chdev_ring_ctrl *chdev_alloc_ctrl(int);
+static int             chdev_move_ring(struct chdev_dev *, int, bool);
+static struct chdev_lz4 *chdev_alloc_lz4(int);
+static void            chdev_free_lz4(struct chdev_lz4 *);
 static void            chdev_cleanup_module(void);
-static void            chdev_setup_cdev(struct chdev_dev *);
+static void            chdev_setup_cdev(struct chdev_dev *, int);
 static int             chdev_open(struct inode *, struct file *);
 static int             chdev_release(struct inode *, struct file *);
-static ssize_t         chdev_read(struct file *, char __user *, size_t, loff_t *);
-static ssize_t         chdev_write(struct file *, const char __user *, size_t, loff_t *);
+static void            chdev_drop_role(struct chdev_dev *, struct file *);
+static uint            chdev_file_role(struct chdev_dev *, struct file *);
+static int             chdev_down(struct chdev_dev *, bool);
+static int             chdev_down_read(struct chdev_dev *, struct file *, bool);
+static void            chdev_up_read(struct chdev_dev *, struct file *);
+static int             chdev_down_write(struct chdev_dev *, struct file *, bool);
+static void            chdev_up_write(struct chdev_dev *, struct file *);
+static ssize_t         chdev_read_iter(struct kiocb *, struct iov_iter *);
+static ssize_t         chdev_write_iter(struct kiocb *, struct iov_iter *);
+static bool            chdev_file_can_read(struct chdev_file *);
+static ssize_t         chdev_file_read(struct chdev_file *, struct iov_iter *, uint, uint *);
+static size_t          chdev_read_records(struct chdev_file *, struct iov_iter *, uint);
+static size_t          chdev_write_records(struct chdev_dev *, struct iov_iter *, uint, bool);
+static ssize_t         chdev_read_user(struct chdev_file *, char __user *, size_t, uint *);
+static ssize_t         chdev_write_user(struct chdev_dev *, const char __user *, size_t, uint);
 static long            chdev_ioctl(struct file *, unsigned int, unsigned long);
-static void __init     chdev_create_proc(void);
-static void            chdev_remove_proc(void);
+static long            chdev_ioctl_items(struct file *, unsigned int, struct chdev_items __user *);
+static long            chdev_ioctl_role(struct file *, unsigned long);
+static long            chdev_ioctl_flags(struct file *, unsigned long);
+static long            chdev_ioctl_mode(struct file *, unsigned long);
+static long            chdev_ioctl_cursor(struct file *, struct chdev_cursor_info __user *);
+static long            chdev_ioctl_snapshot(struct file *, struct chdev_snapshot __user *);
+static long            chdev_ioctl_node(struct file *, unsigned long);
+static long            chdev_ioctl_notify(struct file *, struct chdev_notify __user *);
+static void            chdev_free_notifier(struct chdev_notifier *);
+static long            chdev_ioctl_priority(struct file *, unsigned long);
+static long            chdev_ioctl_prio_item(struct file *, unsigned int, struct chdev_prio_item __user *);
+static long            chdev_ioctl_stats(struct file *, struct chdev_stats __user *);
+static long            chdev_ioctl_hist(struct file *, struct chdev_hist __user *);
+static long            chdev_ioctl_mmap(struct file *, unsigned int, struct chdev_mmap_item __user *);
+static int             chdev_mmap(struct file *, struct vm_area_struct *);
+static void            chdev_vm_open(struct vm_area_struct *);
+static void            chdev_vm_close(struct vm_area_struct *);
+static int             chdev_mmap_vmalloc(struct vm_area_struct *, char *);
+static unsigned int    chdev_poll(struct file *, poll_table *);
+static void __init     chdev_create_proc(struct chdev_dev *, int);
+static void            chdev_remove_proc(int);
 static int             chdev_proc_open(struct inode *, struct file *);
 static int             chdev_proc_show(struct seq_file *, void *);
 
@@ -38,15 +96,38 @@ static int             chdev_proc_show(struct seq_file *, void *);
  */
 static int                    chdev_major   = 0;                    /* dynamic major */
 static int                    chdev_minor   = 0; 
-static int __initdata         buffer        = BUF_5KB;              /* size of the chdev buffer in 5 KB by default */
-static struct chdev_dev       *chdev;
+static uint __initdata        buffer        = BUF_5KB;              /* size of the chdev buffer in 5 KB by default */
+static uint __initdata        buffers[CHDEV_MAX_DEVICES];           /* sizes of particular chdev buffers, 0 means default */
+static int __initdata         nbuffers      = 0;                    /* number of elements in buffers */
+static int                    ndevices      = 1;                    /* number of chdev devices */
+static bool __initdata        sharded       = false;                /* one buffer per CPU instead of a single buffer */
+static bool __initdata        unordered     = false;                /* shards are drained round-robin, not in enqueue order */
+static bool                   linear_buf    = true;                 /* prefer buffers in the linear mapping */
+static bool __initdata        overwrite     = false;                /* evict the oldest items instead of rejecting writes */
+static uint __initdata        priorities    = 0;                    /* number of priority classes, 0 means none */
+static uint __initdata        weights[CHDEV_MAX_PRIO];              /* weights of priority classes, 0 means default */
+static int __initdata         nweights      = 0;                    /* number of elements in weights */
+static uint __initdata        compress_min  = 128;                  /* smaller items are not worth compressing */
+static uint __initdata        slot_size     = 0;                    /* maximum item size in slot mode, 0 means no slot mode */
+static uint __initdata        slot_count    = 1024;                 /* number of slots in slot mode */
+static int __initdata         nodes[CHDEV_MAX_DEVICES];             /* NUMA nodes of particular devices, -1 means the consumer's */
+static int __initdata         nnodes        = 0;                    /* number of elements in nodes */
+static struct chdev_dev       **chdev_devices;                      /* allocated in chdev_init_module */
 static struct file_operations chdev_fops    = {
     .owner            = THIS_MODULE,
     .open             = chdev_open,
     .release          = chdev_release,
-    .read             = chdev_read,
-    .write            = chdev_write,
+    .read_iter        = chdev_read_iter,
+    .write_iter       = chdev_write_iter,
+    .splice_read      = generic_file_splice_read,
+    .splice_write     = iter_file_splice_write,
     .unlocked_ioctl   = chdev_ioctl,
+    .mmap             = chdev_mmap,
+    .poll             = chdev_poll,
+};
+static const struct vm_operations_struct chdev_vm_ops = {
+    .open  = chdev_vm_open,
+    .close = chdev_vm_close,
 };
 static struct file_operations chdev_proc_ops = {
     .owner   = THIS_MODULE,
@@ -59,74 +140,484 @@ static struct file_operations chdev_proc_ops = {
 /*
  * Initialization of module parameters.
  */
-module_param(buffer, int, 0);
-MODULE_PARM_DESC(buffer, "size of chdev buffer in bytes");
+module_param(buffer, uint, 0);
+MODULE_PARM_DESC(buffer, "size of chdev buffer in bytes, rounded down to a multiple of 8; an item takes at most half of it");
+module_param_array(buffers, uint, &nbuffers, 0);
+MODULE_PARM_DESC(buffers, "sizes of buffers of particular devices in bytes, overrides buffer");
+module_param(ndevices, int, S_IRUGO);
+MODULE_PARM_DESC(ndevices, "number of chdev devices");
+module_param(sharded, bool, 0);
+MODULE_PARM_DESC(sharded, "use a buffer of the given size per CPU, readers drain them in enqueue order");
+module_param(unordered, bool, 0);
+MODULE_PARM_DESC(unordered, "readers of sharded devices drain the buffers round-robin, items take no sequence number");
+module_param(linear_buf, bool, 0);
+MODULE_PARM_DESC(linear_buf, "place buffers up to the largest page block (4 MB with 4 KB pages) into the linear mapping, "
+                             "vmalloc larger ones page by page, without huge pages");
+module_param(overwrite, bool, 0);
+MODULE_PARM_DESC(overwrite, "start devices in overwrite mode: writes to a full buffer evict the oldest items");
+module_param(priorities, uint, 0);
+MODULE_PARM_DESC(priorities, "number of priority classes, each with a buffer of the given size");
+module_param_array(weights, uint, &nweights, 0);
+MODULE_PARM_DESC(weights, "items read in a row from priority classes 0, 1, ... in weighted mode, 2^class by default");
+module_param(compress_min, uint, 0);
+MODULE_PARM_DESC(compress_min, "smallest item which is compressed in compression mode, 128 bytes by default");
+module_param(slot_size, uint, 0);
+MODULE_PARM_DESC(slot_size, "store items of at most this size in fixed-size slots, writers and readers do not lock");
+module_param(slot_count, uint, 0);
+MODULE_PARM_DESC(slot_count, "number of slots in slot mode, a power of two, 1024 by default");
+module_param_array(nodes, int, &nnodes, 0);
+MODULE_PARM_DESC(nodes, "NUMA nodes of buffers and state of particular devices, -1 places the buffer on the node of the consumer role owner");
 
 MODULE_AUTHOR("Sergey Morozov");
 MODULE_LICENSE("Dual BSD/GPL");
 
+/*
+ * Device of an open file.
+ */
+static inline struct chdev_dev *chdev_filp_dev(struct file *filp) {
+    return ((struct chdev_file *)filp->private_data)->dev;
+}
+
 /*
  * Implementation of file_operations.open for chdev_fops.
  */
 static int chdev_open(struct inode *inode, struct file *filp) {
-    struct chdev_dev *dev;    /* device information */
-    dev = container_of(inode->i_cdev, struct chdev_dev, cdev);
-    filp->private_data = dev; /* for other methods */
+    struct chdev_file *cfile;  /* per-file state */
+    
+    cfile = kmalloc(sizeof(struct chdev_file), GFP_KERNEL);
+    if (!cfile) {
+        return -ENOMEM;
+    }
+    cfile->dev   = container_of(inode->i_cdev, struct chdev_dev, cdev);
+    cfile->flags = 0;
+    cfile->prio  = 0;
+    memset(&cfile->cursor, 0, sizeof(struct chdev_cursor));
+    INIT_LIST_HEAD(&cfile->cursor.node);
+    atomic_set(&cfile->wr_maps, 0);
+    filp->private_data = cfile; /* for other methods */
+    
+    /* read_iter and write_iter honour IOCB_NOWAIT, so preadv2(2) and pwritev2(2) accept RWF_NOWAIT */
+    filp->f_mode |= FMODE_NOWAIT;
     
     return 0;  /* success */
 }
 
+/*
+ * Give up the SPSC role of the file, the caller holds the semaphore. Items which the owner of a mapped
+ * role moved are taken before the driver publishes the position of that side again.
+ */
+static void chdev_drop_role(struct chdev_dev *dev, struct file *filp) {
+    if (dev->producer == filp) {
+        chdev_map_side(dev, CHDEV_ROLE_PRODUCER, false);
+        WRITE_ONCE(dev->producer, NULL);
+    }
+    if (dev->consumer == filp) {
+        chdev_map_side(dev, CHDEV_ROLE_CONSUMER, false);
+        WRITE_ONCE(dev->consumer, NULL);
+    }
+}
+
+/*
+ * SPSC role of the file, with CHDEV_ROLE_MAPPED if its side is mapped. The caller holds the semaphore.
+ */
+static uint chdev_file_role(struct chdev_dev *dev, struct file *filp) {
+    uint role = CHDEV_ROLE_NONE;
+    
+    if (dev->producer == filp) {
+        role = CHDEV_ROLE_PRODUCER;
+    }
+    else if (dev->consumer == filp) {
+        role = CHDEV_ROLE_CONSUMER;
+    }
+    if (role != CHDEV_ROLE_NONE && (dev->ring.mapped & role)) {
+        role |= CHDEV_ROLE_MAPPED;
+    }
+    return role;
+}
+
 /*
  * Implementation of file_operations.release for chdev_fops.
  */
 static int chdev_release(struct inode *inode, struct file *filp) {
+    struct chdev_dev *dev = chdev_filp_dev(filp);
+    
+    /* drop roles, reservation and in place read which were not finished by this file */
+    down(&dev->sem);
+    chdev_drop_role(dev, filp);
+    if (dev->rsv_filp == filp) {
+        dev->rsv_filp = NULL;
+    }
+    if (dev->peek_filp == filp) {
+        dev->peek_filp = NULL;
+    }
+    chdev_cursor_detach(dev, &((struct chdev_file *)filp->private_data)->cursor);
+    up(&dev->sem);
+    
+    /* awake readers and writers which waited for the dropped reservation or in place read */
+    wake_up_interruptible(&dev->inq);
+    wake_up_interruptible(&dev->outq);
+    
+    kfree(filp->private_data);
     return 0;  /* success */
 }
 
 /*
- * Implementation of file_operations.read for chdev_fops.
+ * Take the semaphore of the device, or fail with -EAGAIN instead of sleeping if nowait is set.
+ */
+static int chdev_down(struct chdev_dev *dev, bool nowait) {
+    if (!nowait) {
+        return chdev_lock(dev, &dev->sem) ? -ERESTARTSYS : 0;
+    }
+    if (down_trylock(&dev->sem)) {
+        chdev_stat_inc(dev, contended);
+        return -EAGAIN;
+    }
+    return 0;
+}
+
+/*
+ * Enter a critical section for readers, without sleeping if nowait is set.
+ * Consumer of SPSC mode does not take the semaphore, other files are rejected while it exists.
+ * Mapped consumer reads through the mapping only, readers of slot mode are not serialized at all.
+ */
+static int chdev_down_read(struct chdev_dev *dev, struct file *filp, bool nowait) {
+    int err;
+    
+    if (dev->slots) {
+        return 0;
+    }
+    if (READ_ONCE(dev->consumer) == filp) {
+        return (READ_ONCE(dev->ring.mapped) & CHDEV_ROLE_CONSUMER) ? -EINVAL : 0;
+    }
+    
+    if ((err = chdev_down(dev, nowait))) {
+        return err;
+    }
+    if (dev->consumer) {
+        up(&dev->sem);
+        return -EBUSY;
+    }
+    return 0;
+}
+
+/*
+ * Exit a critical section for readers.
+ */
+static void chdev_up_read(struct chdev_dev *dev, struct file *filp) {
+    if (!dev->slots && dev->consumer != filp) {
+        up(&dev->sem);
+    }
+}
+
+/*
+ * Enter a critical section for writers, without sleeping if nowait is set.
+ * Producer of SPSC mode does not take the semaphore, other files are rejected while it exists.
+ * Mapped producer writes through the mapping only.
+ * In sharded mode and with priority classes writers are serialized per ring by chdev_write_common(...),
+ * in slot mode they are not serialized at all.
+ */
+static int chdev_down_write(struct chdev_dev *dev, struct file *filp, bool nowait) {
+    int err;
+    
+    if (dev->shards || dev->slots) {
+        return 0;
+    }
+    if (READ_ONCE(dev->producer) == filp) {
+        return (READ_ONCE(dev->ring.mapped) & CHDEV_ROLE_PRODUCER) ? -EINVAL : 0;
+    }
+    
+    if ((err = chdev_down(dev, nowait))) {
+        return err;
+    }
+    if (dev->producer) {
+        up(&dev->sem);
+        return -EBUSY;
+    }
+    return 0;
+}
+
+/*
+ * Exit a critical section for writers.
+ */
+static void chdev_up_write(struct chdev_dev *dev, struct file *filp) {
+    if (!dev->shards && !dev->slots && dev->producer != filp) {
+        up(&dev->sem);
+    }
+}
+
+/*
+ * Implementation of file_operations.read_iter for chdev_fops, also used by read(2) and splice(2).
+ * Blocks until an item is available unless the file was opened with O_NONBLOCK, or the request
+ * has IOCB_NOWAIT (preadv2(2) with RWF_NOWAIT): then it fails with -EAGAIN instead of sleeping
+ * on an empty buffer or a contended semaphore, and the caller may wait in poll(2).
+ * In stream mode only the first record is waited for, the following ones are read while they fit.
  */
-static ssize_t chdev_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos) {
-    struct chdev_dev *dev = filp->private_data; 
+static ssize_t chdev_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+    struct file      *filp  = iocb->ki_filp;
+    struct chdev_file *cfile = filp->private_data;
+    struct chdev_dev *dev   = cfile->dev;
+    bool             nowait = (filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+    uint             flags  = cfile->flags;
     ssize_t          retval = 0;                 /* 0 because initially we haven't read nothing */
+    u64              start;                      /* beginning of the wait, only if it is traced */
+    
+    /* records of a stream are framed items */
+    if (flags & CHDEV_FLAG_STREAM) {
+        flags |= CHDEV_FLAG_FRAMED;
+    }
     
     /* enter a critical section */
-    if (down_interruptible(&dev->sem)) {
-        return -ERESTARTSYS;
+    if ((retval = chdev_down_read(dev, filp, iocb->ki_flags & IOCB_NOWAIT))) {
+        return retval;
+    }
+    
+    /* wait for an item, the semaphore is released while sleeping */
+    retry:
+    while (!chdev_file_can_read(cfile)) {
+        chdev_up_read(dev, filp);
+        chdev_stat_inc(dev, empty);
+        if (nowait) {
+            trace_chdev_reject(MINOR(dev->cdev.dev), false, iov_iter_count(to), chdev_used(dev), -EAGAIN);
+            return -EAGAIN;
+        }
+        start  = trace_chdev_wait_enabled() ? ktime_get_ns() : 0;
+        retval = wait_event_interruptible(dev->inq, chdev_file_can_read(cfile));
+        if (trace_chdev_wait_enabled()) {
+            trace_chdev_wait(MINOR(dev->cdev.dev), false, iov_iter_count(to), ktime_get_ns() - start, retval);
+        }
+        if (retval) {
+            chdev_stat_inc(dev, interrupted);
+            return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
+        }
+        if ((retval = chdev_down_read(dev, filp, iocb->ki_flags & IOCB_NOWAIT))) {
+            return retval;
+        }
+    }
+    
+    retval = chdev_file_read(cfile, to, flags, NULL); /* call common part of read method */
+    
+    /* readers of slot mode are not serialized, another one may have taken the item */
+    if (retval == -EAGAIN && !nowait) {
+        goto retry;
     }
     
-    retval = chdev_read_common(dev, buf, count); /* call common part of read method */
+    if (retval > 0 && (flags & CHDEV_FLAG_STREAM)) {
+        retval += chdev_read_records(cfile, to, flags);
+    }
     
     /* exit a critical section */
-    up(&dev->sem);
+    chdev_up_read(dev, filp);
     
     return retval;
 }
 
 /*
- * Implementation of file_operations.write for chdev_fops.
+ * Implementation of file_operations.write_iter for chdev_fops, also used by write(2) and splice(2).
+ * Blocks until there is enough free space unless the file was opened with O_NONBLOCK or the request has
+ * IOCB_NOWAIT, see chdev_read_iter(...). In stream mode only the first record is waited for, the following
+ * ones are written while they fit, and the number of bytes of written records is returned.
  */
-static ssize_t chdev_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos) {
-    struct chdev_dev *dev   = filp->private_data;
+static ssize_t chdev_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+    struct file      *filp  = iocb->ki_filp;
+    struct chdev_file *cfile = filp->private_data;
+    struct chdev_dev *dev   = cfile->dev;
+    bool             nowait = (filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+    size_t           count  = iov_iter_count(from);
+    bool             stream = cfile->flags & CHDEV_FLAG_STREAM;
+    uint             frame_len;             /* length prefix of a framed item */
     ssize_t          retval = -ENOMEM;      /* -ENOMEM because free_space == 0 by default */
+    u64              start;                 /* beginning of the wait, only if it is traced */
+    struct chdev_notify_mark mark;          /* records of a stream signal readers once */
     
-    /* enter a critical section */
-    if (down_interruptible(&dev->sem)) {
-        return -ERESTARTSYS;
+    /* framed item must consist of its length and exactly that many bytes, a stream starts with such a record */
+    if (cfile->flags & (CHDEV_FLAG_FRAMED | CHDEV_FLAG_STREAM)) {
+        if (count < sizeof(uint) || copy_from_iter((char *)&frame_len, sizeof(uint), from) != sizeof(uint)) {
+            return -EINVAL;
+        }
+        count -= sizeof(uint);
+        if (stream ? frame_len > count : frame_len != count) {
+            return -EINVAL;
+        }
+        count = frame_len;
     }
     
-    retval = chdev_write_common(dev, buf, count); /* call common part of write method */
+    /* item which never fits into the buffer is rejected without waiting */
+    if (count > CHDEV_ITEM_MAX) {
+        return -EINVAL;
+    }
+    if (count > chdev_item_max(dev)) {
+        return -ENOMEM;
+    }
     
     /* enter a critical section */
-    up(&dev->sem);
+    if ((retval = chdev_down_write(dev, filp, iocb->ki_flags & IOCB_NOWAIT))) {
+        return retval;
+    }
+    
+    /* wait for free space, the semaphore is released while sleeping */
+    while (!chdev_can_write(dev, count, cfile->prio)) {
+        chdev_up_write(dev, filp);
+        chdev_stat_inc(dev, full);
+        if (nowait) {
+            trace_chdev_reject(MINOR(dev->cdev.dev), true, count, chdev_used(dev), -EAGAIN);
+            return -EAGAIN;
+        }
+        start  = trace_chdev_wait_enabled() ? ktime_get_ns() : 0;
+        retval = wait_event_interruptible(dev->outq, chdev_can_write(dev, count, cfile->prio));
+        if (trace_chdev_wait_enabled()) {
+            trace_chdev_wait(MINOR(dev->cdev.dev), true, count, ktime_get_ns() - start, retval);
+        }
+        if (retval) {
+            chdev_stat_inc(dev, interrupted);
+            return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
+        }
+        if ((retval = chdev_down_write(dev, filp, iocb->ki_flags & IOCB_NOWAIT))) {
+            return retval;
+        }
+    }
+    
+    if (stream) {
+        chdev_notify_hold(dev, &mark);
+    }
+    
+    retval = chdev_write_common(dev, from, count, cfile->prio, iocb->ki_flags & IOCB_NOWAIT); /* call common part of write method */
+    
+    /* the length prefix was consumed as well */
+    if (retval >= 0 && (cfile->flags & (CHDEV_FLAG_FRAMED | CHDEV_FLAG_STREAM))) {
+        retval += sizeof(uint);
+    }
+    if (retval >= 0 && stream) {
+        retval += chdev_write_records(dev, from, cfile->prio, iocb->ki_flags & IOCB_NOWAIT);
+    }
+    
+    /* exit a critical section */
+    chdev_up_write(dev, filp);
+    
+    if (stream) {
+        chdev_notify_release(dev, &mark);
+    }
+    
     return retval;
 }
 
+/*
+ * Read the records which follow the first one in stream mode while they fit into the iterator,
+ * the caller holds the read lock. Returns number of bytes read.
+ */
+static size_t chdev_read_records(struct chdev_file *cfile, struct iov_iter *to, uint flags) {
+    size_t  done = 0;
+    ssize_t retval;
+    
+    while (iov_iter_count(to) >= sizeof(uint) && chdev_file_can_read(cfile)) {
+        if ((retval = chdev_file_read(cfile, to, flags, NULL)) <= 0) {
+            break;  /* the next record does not fit, or another reader of slot mode took it */
+        }
+        done += retval;
+    }
+    return done;
+}
+
+/*
+ * Write the records which follow the first one in stream mode while they fit into the buffer, the caller
+ * holds the write lock. A malformed record stops the stream as well, and so does a taken ring lock if nowait
+ * is set. Returns number of bytes written.
+ */
+static size_t chdev_write_records(struct chdev_dev *dev, struct iov_iter *from, uint prio, bool nowait) {
+    size_t done = 0;
+    size_t count;
+    uint   frame_len;   /* length prefix of the record */
+    
+    while ((count = iov_iter_count(from)) >= sizeof(uint)) {
+        if (copy_from_iter((char *)&frame_len, sizeof(uint), from) != sizeof(uint) ||
+            frame_len > count - sizeof(uint) || !chdev_can_write(dev, frame_len, prio)) {
+            break;
+        }
+        if (chdev_write_common(dev, from, frame_len, prio, nowait) < 0) {
+            break;
+        }
+        done += sizeof(uint) + frame_len;
+    }
+    return done;
+}
+
+/*
+ * Check if there is an item which can be read through the file.
+ */
+static bool chdev_file_can_read(struct chdev_file *cfile) {
+    if (READ_ONCE(cfile->dev->mode) & CHDEV_MODE_BROADCAST) {
+        return chdev_cursor_can_read(cfile->dev, &cfile->cursor);
+    }
+    return chdev_can_read(cfile->dev);
+}
+
+/*
+ * Read a single item through the file, from its own cursor in broadcast mode. The caller holds the read lock.
+ * Priority class of the item is stored to prio if it is not NULL.
+ */
+static ssize_t chdev_file_read(struct chdev_file *cfile, struct iov_iter *to, uint flags, uint *prio) {
+    if (cfile->dev->mode & CHDEV_MODE_BROADCAST) {
+        if (prio) {
+            *prio = 0;  /* device with priority classes has no broadcast mode */
+        }
+        return chdev_cursor_read(cfile->dev, &cfile->cursor, to, flags);
+    }
+    return chdev_read_class(cfile->dev, to, flags, prio);
+}
+
+/*
+ * Read a single item into a user buffer, the caller holds the read lock.
+ */
+static ssize_t chdev_read_user(struct chdev_file *cfile, char __user *buf, size_t count, uint *prio) {
+    struct iovec     iov;
+    struct iov_iter  iter;
+    int              err;
+    
+    if ((err = import_single_range(READ, buf, count, &iov, &iter))) {
+        return err;
+    }
+    return chdev_file_read(cfile, &iter, 0, prio);
+}
+
+/*
+ * Write a single item of the priority class from a user buffer, the caller holds the write lock.
+ */
+static ssize_t chdev_write_user(struct chdev_dev *dev, const char __user *buf, size_t count, uint prio) {
+    struct iovec     iov;
+    struct iov_iter  iter;
+    int              err;
+    
+    if ((err = import_single_range(WRITE, (char __user *)buf, count, &iov, &iter))) {
+        return err;
+    }
+    return chdev_write_common(dev, &iter, count, prio, false);
+}
+
+/*
+ * Implementation of file_operations.poll for chdev_fops.
+ * The device is writable if there is room for at least an empty item.
+ */
+static unsigned int chdev_poll(struct file *filp, poll_table *wait) {
+    struct chdev_dev *dev  = chdev_filp_dev(filp);
+    unsigned int     mask = 0;
+    
+    poll_wait(filp, &dev->inq,  wait);
+    poll_wait(filp, &dev->outq, wait);
+    
+    if (chdev_file_can_read(filp->private_data)) {
+        mask |= POLLIN | POLLRDNORM;  /* readable */
+    }
+    if (chdev_can_write(dev, 0, ((struct chdev_file *)filp->private_data)->prio)) {
+        mask |= POLLOUT | POLLWRNORM; /* writable */
+    }
+    
+    return mask;
+}
+
 /*
  * Implementation of file_operations.ioctl for chdev_fops.
  */
 static long chdev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
-    struct chdev_dev *dev = filp->private_data; 
+    struct chdev_dev *dev = chdev_filp_dev(filp);
     int               err = 0,
                       retval = 0;
     struct chdev_item item; /* used in read and write requests */
@@ -162,15 +653,15 @@ static long chdev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
             }
             
             /* enter a critical section */
-            if (down_interruptible(&dev->sem)) {
-                return -ERESTARTSYS;
+            if ((err = chdev_down_read(dev, filp, false))) {
+                return err;
             }
             
             /* call common part of read method */
-            err = (int)chdev_read_common(dev, item.buf, item.size);
+            err = (int)chdev_read_user(filp->private_data, item.buf, item.size, NULL);
             
             /* exit a critical section */
-            up(&dev->sem);
+            chdev_up_read(dev, filp);
             
             /* if error occured in chdev_read_common(...) */
             if (err < 0) {
@@ -185,15 +676,15 @@ static long chdev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
             }
             
             /* enter a critical section */
-            if (down_interruptible(&dev->sem)) {
-                return -ERESTARTSYS;
+            if ((err = chdev_down_write(dev, filp, false))) {
+                return err;
             }
             
             /* call common part of write method */
-            err = (int)chdev_write_common(dev, item.buf, item.size);
+            err = (int)chdev_write_user(dev, item.buf, item.size, ((struct chdev_file *)filp->private_data)->prio);
             
             /* exit a critical section */
-            up(&dev->sem);
+            chdev_up_write(dev, filp);
             
             /* if error occured in chdev_read_common(...) */
             if (err < 0) {
@@ -201,12 +692,63 @@ static long chdev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
             }
             break;
             
+        case CHDEV_IOCTL_GET_ITEMS:
+        case CHDEV_IOCTL_SET_ITEMS:
+            return chdev_ioctl_items(filp, cmd, (struct chdev_items __user *)arg);
+            
+        case CHDEV_IOCTL_RESERVE:
+        case CHDEV_IOCTL_COMMIT:
+        case CHDEV_IOCTL_PEEK:
+        case CHDEV_IOCTL_RELEASE:
+            return chdev_ioctl_mmap(filp, cmd, (struct chdev_mmap_item __user *)arg);
+            
+        case CHDEV_IOCTL_SET_ROLE:
+            return chdev_ioctl_role(filp, arg);
+            
+        case CHDEV_IOCTL_SYNC:
+            return chdev_pull_mapped(dev);
+            
+        case CHDEV_IOCTL_SET_FLAGS:
+            return chdev_ioctl_flags(filp, arg);
+            
+        case CHDEV_IOCTL_SET_MODE:
+            return chdev_ioctl_mode(filp, arg);
+            
+        case CHDEV_IOCTL_GET_CURSOR:
+            return chdev_ioctl_cursor(filp, (struct chdev_cursor_info __user *)arg);
+            
+        case CHDEV_IOCTL_SNAPSHOT:
+            return chdev_ioctl_snapshot(filp, (struct chdev_snapshot __user *)arg);
+            
+        case CHDEV_IOCTL_SET_NODE:
+            return chdev_ioctl_node(filp, arg);
+            
+        case CHDEV_IOCTL_SET_NOTIFY:
+            return chdev_ioctl_notify(filp, (struct chdev_notify __user *)arg);
+            
+        case CHDEV_IOCTL_SET_PRIORITY:
+            return chdev_ioctl_priority(filp, arg);
+            
+        case CHDEV_IOCTL_GET_PRIO_ITEM:
+        case CHDEV_IOCTL_SET_PRIO_ITEM:
+            return chdev_ioctl_prio_item(filp, cmd, (struct chdev_prio_item __user *)arg);
+            
+        case CHDEV_IOCTL_GET_STATS:
+            return chdev_ioctl_stats(filp, (struct chdev_stats __user *)arg);
+            
+        case CHDEV_IOCTL_GET_HIST:
+            return chdev_ioctl_hist(filp, (struct chdev_hist __user *)arg);
+            
         case CHDEV_IOCTL_GET_NUM_ITEM:
-            retval = __put_user(chdev->num_item, (uint __user *)arg);
+            retval = __put_user(chdev_num_item(dev), (uint __user *)arg);
             break;
             
         case CHDEV_IOCTL_GET_BUF_SIZE:
-            retval = __put_user(chdev->buf_size, (uint __user *)arg);
+            retval = __put_user((uint)dev->buf_size, (uint __user *)arg);
+            break;
+            
+        case CHDEV_IOCTL_GET_ITEM_MAX:
+            retval = __put_user((uint)chdev_item_max(dev), (uint __user *)arg);
             break;
             
         default:  /* redundant, as cmd was checked against MAXNR */
@@ -216,119 +758,1372 @@ static long chdev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 }
 
 /*
- * Create "chdevstat" file in /proc file system.
- */
-static void __init chdev_create_proc(void) {
-    proc_create("chdev", 0, NULL, &chdev_proc_ops);
-}
-
-/*
- * Remove "chdevstat" file from /proc file system.
- */
-static void chdev_remove_proc(void) {
-    /* no problem if it was not registered */
-    remove_proc_entry("chdev", NULL /* parent dir */);
-}
-
-/*
- * Implementation of file_operations.open for chdev_proc_ops.
- */
-static int chdev_proc_open(struct inode *inode, struct file *filp) {
-    return single_open(filp, chdev_proc_show, NULL);
-}
-
-/*
- * Implementation of show method for /proc file system
- */
-static int chdev_proc_show(struct seq_file *s, void *v) {
-    seq_printf(s, "%-20.20s : %10u\n"
-    "%-20.20s : %10u\n",
-    "Buffer size",  chdev->buf_size,
-    "Item counter", chdev->num_item);
-    return 0;
-}
-
-/*
- * Set up the cdev structure for this device.
+ * Implementation of CHDEV_IOCTL_GET_ITEMS and CHDEV_IOCTL_SET_ITEMS.
+ * The semaphore is taken once for the whole vector; transfer stops at the first item
+ * which does not fit into (or cannot be taken from) the buffer, so partial success is possible.
  */
-static void chdev_setup_cdev(struct chdev_dev *dev) {
-    int err; 
-    int devno = MKDEV(chdev_major, chdev_minor);
+static long chdev_ioctl_items(struct file *filp, unsigned int cmd, struct chdev_items __user *arg) {
+    struct chdev_dev   *dev = chdev_filp_dev(filp);
+    struct chdev_items items;   /* vector of item descriptors */
+    struct chdev_item  item;    /* current item descriptor */
+    uint               i;       /* number of transferred items */
+    ssize_t            err = 0;
+    struct chdev_notify_mark mark;  /* written items signal readers once */
     
-    cdev_init(&dev->cdev, &chdev_fops);
-    dev->cdev.owner = THIS_MODULE;
-    dev->cdev.ops = &chdev_fops;
+    /* get chdev_items value from user */
+    if (copy_from_user((char *)&items, (char __user *)arg, sizeof(struct chdev_items))) {
+        return -EFAULT;
+    }
     
-    err = cdev_add(&dev->cdev, devno, 1);
+    /* enter a critical section */
+    err = (cmd == CHDEV_IOCTL_GET_ITEMS) ? chdev_down_read(dev, filp, false) : chdev_down_write(dev, filp, false);
     if (err) {
-        printk(KERN_NOTICE "Error %d adding chdev", err);  
+        return err;
+    }
+    if (cmd == CHDEV_IOCTL_SET_ITEMS) {
+        chdev_notify_hold(dev, &mark);
+    }
+    
+    for (i = 0; i < items.count; i++) {
+        /* get next chdev_item value from user */
+        if (copy_from_user((char *)&item, (char __user *)(items.items + i), sizeof(struct chdev_item))) {
+            err = -EFAULT;
+            break;
+        }
+        
+        if (cmd == CHDEV_IOCTL_GET_ITEMS) {
+            if ((dev->mode & CHDEV_MODE_BROADCAST) ? !chdev_file_can_read(filp->private_data) : chdev_num_item(dev) == 0) {
+                break; /* buffer was emptied, nothing more to read */
+            }
+            err = chdev_read_user(filp->private_data, item.buf, item.size, NULL);   /* call common part of read method */
+        }
+        else {
+            err = chdev_write_user(dev, item.buf, item.size, ((struct chdev_file *)filp->private_data)->prio);  /* call common part of write method */
+        }
+        
+        /* buffer is full, item does not fit into the user buffer, or bad user pointer */
+        if (err < 0) {
+            break;
+        }
+        
+        /* report number of transferred bytes; the item already went through the buffer */
+        item.size = (short)err;
+        if (copy_to_user((char __user *)&items.items[i].size, (char *)&item.size, sizeof(short))) {
+            err = -EFAULT;
+            ++i;
+            break;
+        }
+    }
+    
+    /* exit a critical section */
+    if (cmd == CHDEV_IOCTL_GET_ITEMS) {
+        chdev_up_read(dev, filp);
+    }
+    else {
+        chdev_up_write(dev, filp);
+        chdev_notify_release(dev, &mark);
+    }
+    
+    /* report number of transferred items */
+    if (__put_user(i, &arg->count)) {
+        return -EFAULT;
     }
+    
+    /* error is reported only if no item was transferred */
+    return (i == 0 && err < 0) ? err : 0;
 }
 
 /*
- * Set up chdev_dev structure for this device.
+ * Implementation of zero-copy ioctls which work with the buffer mapped by chdev_mmap(...).
+ * Only one reservation and one in place read may be outstanding at a time; until they are
+ * finished by CHDEV_IOCTL_COMMIT and CHDEV_IOCTL_RELEASE, other writers and readers get -EBUSY.
  */
-static int __init chdev_setup(void) {
-    int   result;
-    /* allocate chdev memory */
-    chdev = kmalloc(sizeof(struct chdev_dev), GFP_KERNEL);
-    if (!chdev) {
-        result = -ENOMEM;
-        goto fail;
+static long chdev_ioctl_mmap(struct file *filp, unsigned int cmd, struct chdev_mmap_item __user *arg) {
+    struct chdev_dev       *dev = chdev_filp_dev(filp);
+    struct chdev_mmap_item item;          /* item in the mapped buffer */
+    char                   *payload;      /* item payload inside dev->ring.buf */
+    size_t                 count = 0;     /* item size */
+    bool                   producer = (cmd == CHDEV_IOCTL_RESERVE || cmd == CHDEV_IOCTL_COMMIT);
+    long                   retval = 0;
+    
+    /* there is no single buffer to work with in place */
+    if (dev->shards || dev->slots) {
+        return -EINVAL;
     }
-    memset(chdev, 0, sizeof(struct chdev_dev));
     
-    /* allocate buffer memory */
-    chdev->buf = kmalloc(buffer, GFP_KERNEL);
-    if (!(chdev->buf)) {
-        result = -ENOMEM;
-        goto fail;
+    /* get chdev_mmap_item value from user */
+    if (cmd == CHDEV_IOCTL_RESERVE) {
+        if (copy_from_user((char *)&item, (char __user *)arg, sizeof(struct chdev_mmap_item))) {
+            return -EFAULT;
+        }
     }
-    chdev->buf_size = buffer;
     
-    /* set beg and end pointers */
-    chdev->beg   = chdev->buf;
-    chdev->end   = chdev->buf;
-    chdev->inv   = false;
+    /* enter a critical section */
+    retval = producer ? chdev_down_write(dev, filp, false) : chdev_down_read(dev, filp, false);
+    if (retval) {
+        return retval;
+    }
     
-    /* set statistics */
-    chdev->num_item   = 0;
+    switch (cmd) {
+        case CHDEV_IOCTL_RESERVE:
+            if (dev->rsv_filp) {
+                retval = -EBUSY;
+                break;
+            }
+            payload = chdev_reserve_common(dev, item.size);
+            if (IS_ERR(payload)) {
+                retval = PTR_ERR(payload);
+                break;
+            }
+            dev->rsv_filp = filp;
+            item.off      = payload - dev->ring.buf;
+            break;
+            
+        case CHDEV_IOCTL_COMMIT:
+            if (dev->rsv_filp != filp) {
+                retval = -EINVAL;
+                break;
+            }
+            dev->rsv_filp = NULL;
+            chdev_commit_common(dev);
+            break;
+            
+        case CHDEV_IOCTL_PEEK:
+            if (dev->mode & CHDEV_MODE_BROADCAST) {
+                retval = -EINVAL; /* the oldest item may be read through other cursors */
+                break;
+            }
+            if (dev->peek_filp && dev->peek_filp != filp) {
+                retval = -EBUSY;
+                break;
+            }
+            payload = chdev_peek_common(dev, &count);
+            if (IS_ERR(payload)) {
+                retval = PTR_ERR(payload);
+                break;
+            }
+            if (!payload) {
+                retval = -EAGAIN;  /* there is nothing to read from buffer */
+                break;
+            }
+            if (IS_ERR(payload)) {
+                retval = PTR_ERR(payload);
+                break;
+            }
+            dev->peek_filp = filp;
+            item.off       = payload - dev->ring.buf;
+            item.size      = count;
+            break;
+            
+        case CHDEV_IOCTL_RELEASE:
+            if (dev->peek_filp != filp) {
+                retval = -EINVAL;
+                break;
+            }
+            dev->peek_filp = NULL;
+            retval         = chdev_drop_common(dev);
+            break;
+    }
     
-    /* initialize device */
-    chdev_setup_cdev(chdev);
+    /* exit a critical section */
+    if (producer) {
+        chdev_up_write(dev, filp);
+    }
+    else {
+        chdev_up_read(dev, filp);
+    }
     
-    sema_init(&(chdev->sem), 1);
+    /* awake writers and readers which waited for the reservation or in place read to finish */
+    if (!retval && cmd == CHDEV_IOCTL_COMMIT) {
+        wake_up_interruptible(&dev->outq);
+    }
+    if (!retval && cmd == CHDEV_IOCTL_RELEASE) {
+        wake_up_interruptible(&dev->inq);
+    }
     
-    return 0;
+    /* report location of the item */
+    if (!retval && (cmd == CHDEV_IOCTL_RESERVE || cmd == CHDEV_IOCTL_PEEK)) {
+        if (copy_to_user((char __user *)arg, (char *)&item, sizeof(struct chdev_mmap_item))) {
+            return -EFAULT;
+        }
+    }
     
-    fail:
-    chdev_cleanup_module();
-    return result; /* failed */
+    return retval;
 }
 
 /*
- * Initialization function.
+ * Implementation of CHDEV_IOCTL_SET_ROLE.
+ * The semaphore guarantees that no locked reader or writer is running while a role changes hands.
  */
-static int __init chdev_init_module(void) {
-    int   result;
-    dev_t dev = 0; /* device number */
+static long chdev_ioctl_role(struct file *filp, unsigned long role) {
+    struct chdev_file *cfile  = filp->private_data;
+    struct chdev_dev  *dev    = cfile->dev;
+    bool              mapped  = role & CHDEV_ROLE_MAPPED;   /* owner publishes its position in the control page */
+    long              retval  = 0;
+    int               nid;
     
-    /* asking for a dinamic major */
-    result      = alloc_chrdev_region(&dev, chdev_minor, 1, "chdev");
-    chdev_major = MAJOR(dev);
-    /* allocation was unsuccessful */
-    if (result < 0) {
-        printk(KERN_WARNING "chdev: can't get major %d\n", chdev_major);
-        return result;
+    role &= ~(unsigned long)CHDEV_ROLE_MAPPED;
+    if (role != CHDEV_ROLE_NONE && role != CHDEV_ROLE_PRODUCER && role != CHDEV_ROLE_CONSUMER) {
+        return -EINVAL;
+    }
+    if (mapped && role == CHDEV_ROLE_NONE) {
+        return -EINVAL;
+    }
+    
+    /* writers of sharded device and of slot mode never take the semaphore anyway */
+    if (dev->shards || dev->slots) {
+        return -EINVAL;
+    }
+    
+    /* buffer of a device without a chosen node follows the consumer before it takes the role, unless it is in use */
+    nid = numa_node_id();
+    if (role == CHDEV_ROLE_CONSUMER && !READ_ONCE(dev->node_fixed) && READ_ONCE(dev->node) != nid &&
+        !READ_ONCE(dev->producer) && !READ_ONCE(dev->consumer) && !READ_ONCE(dev->rsv_filp) &&
+        !READ_ONCE(dev->peek_filp) && !atomic_read(&dev->mappings)) {
+        if ((retval = chdev_move_ring(dev, nid, false))) {
+            return retval;
+        }
+    }
+    
+    /* enter a critical section */
+    if (chdev_lock(dev, &dev->sem)) {
+        return -ERESTARTSYS;
+    }
+    
+    /* role is owned by another file, or another file has not finished a zero-copy operation */
+    if ((role == CHDEV_ROLE_PRODUCER && ((dev->producer && dev->producer != filp) || (dev->rsv_filp && dev->rsv_filp != filp))) ||
+        (role == CHDEV_ROLE_CONSUMER && ((dev->consumer && dev->consumer != filp) || (dev->peek_filp && dev->peek_filp != filp)))) {
+        retval = -EBUSY;
+    }
+    else if (role != CHDEV_ROLE_NONE && (dev->mode & CHDEV_MODE_OVERWRITE)) {
+        retval = -EINVAL; /* writers of overwrite mode move the consumer side, so both need the semaphore */
+    }
+    else if (atomic_read(&cfile->wr_maps)) {
+        /* writable mappings were granted by the role of the file, it is kept while they exist */
+        retval = (role | (mapped ? CHDEV_ROLE_MAPPED : 0)) == chdev_file_role(dev, filp) ? 0 : -EBUSY;
+    }
+    else if ((role == CHDEV_ROLE_CONSUMER || mapped) && (dev->mode & CHDEV_MODE_BROADCAST)) {
+        retval = -EINVAL; /* cursors of all readers are protected by the semaphore */
+    }
+    else if (mapped && role == CHDEV_ROLE_CONSUMER && (dev->mode & (CHDEV_MODE_TIMESTAMP | CHDEV_MODE_COMPRESS))) {
+        retval = -EINVAL; /* stamps and compressed items are not visible through the mapping */
+    }
+    else if (mapped && (dev->rsv_filp == filp || dev->peek_filp == filp)) {
+        retval = -EBUSY;  /* zero-copy operation of this file must be finished first */
+    }
+    else {
+        /* give up previous role of this file, the position it published is taken */
+        chdev_drop_role(dev, filp);
+        
+        /* both sides may be mapped only while the buffer is empty, the file is left without a role otherwise */
+        if (mapped) {
+            retval = chdev_map_side(dev, role, true);
+        }
+        if (!retval && role == CHDEV_ROLE_PRODUCER) {
+            WRITE_ONCE(dev->producer, filp);
+        }
+        else if (!retval && role == CHDEV_ROLE_CONSUMER) {
+            WRITE_ONCE(dev->consumer, filp);
+        }
+    }
+    
+    /* exit a critical section */
+    up(&dev->sem);
+    
+    return retval;
+}
+
+/*
+ * Implementation of CHDEV_IOCTL_SET_FLAGS.
+ * Flags belong to the open file, so no lock is needed.
+ */
+static long chdev_ioctl_flags(struct file *filp, unsigned long flags) {
+    struct chdev_file *cfile = filp->private_data;
+    
+    if (flags & ~(unsigned long)CHDEV_FLAGS_MASK) {
+        return -EINVAL;
+    }
+    if ((flags & CHDEV_FLAG_RESIDENCE) && cfile->dev->slots) {
+        return -EINVAL; /* slots hold no enqueue time */
+    }
+    
+    cfile->flags = flags;
+    return 0;
+}
+
+/*
+ * Implementation of CHDEV_IOCTL_SET_MODE.
+ * Mode is changed under the semaphore, so no locked reader or writer sees it in the middle of an operation.
+ */
+static long chdev_ioctl_mode(struct file *filp, unsigned long mode) {
+    struct chdev_dev *dev   = chdev_filp_dev(filp);
+    long             retval = 0;
+    
+    if (mode & ~(unsigned long)CHDEV_MODES_MASK) {
+        return -EINVAL;
+    }
+    
+    /* writers of sharded device do not serialize with readers, and cursors and scratch buffers need a single buffer */
+    if ((mode & (CHDEV_MODE_OVERWRITE | CHDEV_MODE_BROADCAST | CHDEV_MODE_COMPRESS)) && dev->shards) {
+        return -EINVAL;
+    }
+    if (mode && dev->slots) {
+        return -EINVAL; /* all modes work on the items of a ring */
+    }
+    if ((mode & CHDEV_MODE_WEIGHTED) && !dev->nprio) {
+        return -EINVAL;
+    }
+    
+    /* enter a critical section */
+    if (chdev_lock(dev, &dev->sem)) {
+        return -ERESTARTSYS;
+    }
+    
+    /* owners of SPSC roles work without the semaphore, the oldest item may be read in place, a mapped consumer reads raw items */
+    if (((mode & CHDEV_MODE_OVERWRITE) && (dev->producer || dev->consumer)) ||
+        ((mode & CHDEV_MODE_BROADCAST) && (dev->consumer || dev->peek_filp || dev->ring.mapped)) ||
+        ((mode & (CHDEV_MODE_TIMESTAMP | CHDEV_MODE_COMPRESS)) && (dev->ring.mapped & CHDEV_ROLE_CONSUMER))) {
+        retval = -EBUSY;
+    }
+    else if ((mode & CHDEV_MODE_COMPRESS) && !dev->lz4 && !(dev->lz4 = chdev_alloc_lz4(dev->node))) {
+        retval = -ENOMEM;
+    }
+    else {
+        /* cursors are dropped when broadcast mode ends, the buffer keeps what the slowest one has not read */
+        if (!(mode & CHDEV_MODE_BROADCAST)) {
+            while (!list_empty(&dev->cursors)) {
+                list_del_init(dev->cursors.next);
+            }
+        }
+        
+        /* the producer of SPSC mode does not take the semaphore, it must see scratch buffers with the mode */
+        smp_store_release(&dev->mode, mode);
+    }
+    
+    /* exit a critical section */
+    up(&dev->sem);
+    
+    /* awake writers which waited for free space, they may evict items now, and readers of cursors */
+    if (!retval) {
+        wake_up_interruptible(&dev->outq);
+        wake_up_interruptible(&dev->inq);
+    }
+    return retval;
+}
+
+/*
+ * Implementation of CHDEV_IOCTL_GET_CURSOR.
+ */
+static long chdev_ioctl_cursor(struct file *filp, struct chdev_cursor_info __user *arg) {
+    struct chdev_file        *cfile  = filp->private_data;
+    struct chdev_dev         *dev    = cfile->dev;
+    struct chdev_cursor_info info;
+    long                     retval;
+    
+    /* enter a critical section */
+    if ((retval = chdev_down_read(dev, filp, false))) {
+        return retval;
+    }
+    
+    if (!(dev->mode & CHDEV_MODE_BROADCAST)) {
+        chdev_up_read(dev, filp);
+        return -EINVAL;
+    }
+    
+    /* file which has not subscribed yet would start from the oldest item */
+    info.seq      = list_empty(&cfile->cursor.node) ? dev->ring.rd_seq : cfile->cursor.seq;
+    info.lost     = cfile->cursor.lost;
+    info.num_item = dev->ring.rd_seq + chdev_ring_num_item(&dev->ring) - info.seq;
+    
+    /* exit a critical section */
+    chdev_up_read(dev, filp);
+    
+    if (copy_to_user(arg, &info, sizeof(struct chdev_cursor_info))) {
+        return -EFAULT;
+    }
+    return 0;
+}
+
+/*
+ * Implementation of CHDEV_IOCTL_SNAPSHOT.
+ * Items are copied as they are stored to a kernel buffer under the semaphore, which is then released
+ * before the slow part: decompression and copying to user space.
+ */
+static long chdev_ioctl_snapshot(struct file *filp, struct chdev_snapshot __user *arg) {
+    struct chdev_dev      *dev = chdev_filp_dev(filp);
+    struct chdev_snapshot snap;
+    struct iovec          iov;
+    struct iov_iter       iter;
+    char                  *copy;          /* items as they are stored, followed by decompression scratch */
+    ssize_t               len;            /* bytes used in copy */
+    uint                  total, num_item;
+    ssize_t               retval;
+    
+    if (copy_from_user(&snap, arg, sizeof(struct chdev_snapshot))) {
+        return -EFAULT;
+    }
+    if (dev->shards || dev->slots) {
+        return -EINVAL;
+    }
+    if ((retval = import_single_range(READ, snap.buf, snap.size, &iov, &iter))) {
+        return retval;
+    }
+    
+    /* compression may be enabled at any time, so scratch is always allocated */
+    copy = vmalloc(dev->buf_size + CHDEV_LZ4_MAX);
+    if (!copy) {
+        return -ENOMEM;
+    }
+    
+    /* enter a critical section */
+    if (chdev_lock(dev, &dev->sem)) {
+        vfree(copy);
+        return -ERESTARTSYS;
+    }
+    
+    /* owners of SPSC roles move beg and end without the semaphore */
+    if (dev->producer || dev->consumer) {
+        up(&dev->sem);
+        vfree(copy);
+        return -EBUSY;
+    }
+    len = chdev_snapshot(dev, copy, &total);
+    
+    /* exit a critical section */
+    up(&dev->sem);
+    
+    if (len < 0) {
+        vfree(copy);
+        return len;
+    }
+    retval = chdev_snapshot_to_iter(dev, copy, len, &iter, copy + dev->buf_size, &num_item);
+    vfree(copy);
+    if (retval < 0) {
+        return retval;
+    }
+    
+    snap.size     = retval;
+    snap.num_item = num_item;
+    snap.total    = total;
+    if (copy_to_user(arg, &snap, sizeof(struct chdev_snapshot))) {
+        return -EFAULT;
+    }
+    return 0;
+}
+
+/*
+ * Implementation of CHDEV_IOCTL_SET_NODE.
+ */
+static long chdev_ioctl_node(struct file *filp, unsigned long arg) {
+    struct chdev_dev *dev    = chdev_filp_dev(filp);
+    int              nid     = (int)arg;
+    long             retval  = 0;
+    
+    if (nid == CHDEV_NODE_LOCAL) {
+        nid = numa_node_id();
+    }
+    if (nid < 0 || nid >= nr_node_ids || !node_online(nid)) {
+        return -EINVAL;
+    }
+    
+    /* shards of sharded device are placed on the nodes of their CPUs, writers of classes and slots do not take the semaphore */
+    if (dev->shards || dev->slots) {
+        return -EINVAL;
+    }
+    
+    /* buffer is copied without the semaphore, which is taken only for the swap */
+    if (nid != READ_ONCE(dev->node)) {
+        return chdev_move_ring(dev, nid, true);
+    }
+    
+    /* enter a critical section */
+    if (chdev_lock(dev, &dev->sem)) {
+        return -ERESTARTSYS;
+    }
+    
+    /* owners of SPSC roles and zero-copy operations use the buffer without the semaphore */
+    if (dev->producer || dev->consumer || dev->rsv_filp || dev->peek_filp) {
+        retval = -EBUSY;
+    }
+    else {
+        dev->node_fixed = true;
+    }
+    
+    /* exit a critical section */
+    up(&dev->sem);
+    
+    return retval;
+}
+
+/*
+ * Implementation of CHDEV_IOCTL_SET_NOTIFY.
+ * The new notifier is prepared outside of the semaphore, which only serializes replacing the pointer.
+ */
+static long chdev_ioctl_notify(struct file *filp, struct chdev_notify __user *arg) {
+    struct chdev_dev      *dev      = chdev_filp_dev(filp);
+    struct chdev_notifier *notifier = NULL;
+    struct chdev_notifier *old;
+    struct chdev_notify   notify;
+    long                  retval;
+    
+    if (copy_from_user(&notify, arg, sizeof(struct chdev_notify))) {
+        return -EFAULT;
+    }
+    
+    if (notify.rd_fd >= 0 || notify.wr_fd >= 0) {
+        notifier = kzalloc_node(sizeof(struct chdev_notifier), GFP_KERNEL, dev->node);
+        if (!notifier) {
+            return -ENOMEM;
+        }
+        hrtimer_init(&notifier->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+        notifier->timer.function = chdev_notify_timer;
+        notifier->dev            = dev;
+        notifier->rd_items       = notify.rd_items;
+        notifier->rd_bytes       = notify.rd_bytes;
+        notifier->wr_free        = notify.wr_free;
+        notifier->delay_ns       = (u64)notify.delay_us * NSEC_PER_USEC;
+        
+        if (notify.rd_fd >= 0 && IS_ERR(notifier->rd_ctx = eventfd_ctx_fdget(notify.rd_fd))) {
+            retval           = PTR_ERR(notifier->rd_ctx);
+            notifier->rd_ctx = NULL;
+            goto fail;
+        }
+        if (notify.wr_fd >= 0 && IS_ERR(notifier->wr_ctx = eventfd_ctx_fdget(notify.wr_fd))) {
+            retval           = PTR_ERR(notifier->wr_ctx);
+            notifier->wr_ctx = NULL;
+            goto fail;
+        }
+    }
+    
+    /* enter a critical section */
+    if (chdev_lock(dev, &dev->sem)) {
+        retval = -ERESTARTSYS;
+        goto fail;
+    }
+    
+    old = rcu_dereference_protected(dev->notifier, 1);
+    rcu_assign_pointer(dev->notifier, notifier);
+    
+    /* exit a critical section */
+    up(&dev->sem);
+    
+    chdev_free_notifier(old);
+    return 0;
+    
+    fail:
+    chdev_free_notifier(notifier);
+    return retval;
+}
+
+/*
+ * Free the notifier once no writer or reader uses it, they work under RCU.
+ */
+static void chdev_free_notifier(struct chdev_notifier *notifier) {
+    if (!notifier) {
+        return;
+    }
+    
+    /* no one starts the timer after the grace period */
+    synchronize_rcu();
+    hrtimer_cancel(&notifier->timer);
+    if (notifier->rd_ctx) {
+        eventfd_ctx_put(notifier->rd_ctx);
+    }
+    if (notifier->wr_ctx) {
+        eventfd_ctx_put(notifier->wr_ctx);
+    }
+    kfree(notifier);
+}
+
+/*
+ * Implementation of CHDEV_IOCTL_SET_PRIORITY.
+ * Priority class belongs to the open file, so no lock is needed.
+ */
+static long chdev_ioctl_priority(struct file *filp, unsigned long prio) {
+    struct chdev_file *cfile = filp->private_data;
+    
+    if (prio >= max(cfile->dev->nprio, 1U)) {
+        return -EINVAL;
+    }
+    
+    cfile->prio = prio;
+    return 0;
+}
+
+/*
+ * Implementation of CHDEV_IOCTL_GET_PRIO_ITEM and CHDEV_IOCTL_SET_PRIO_ITEM.
+ */
+static long chdev_ioctl_prio_item(struct file *filp, unsigned int cmd, struct chdev_prio_item __user *arg) {
+    struct chdev_dev       *dev = chdev_filp_dev(filp);
+    struct chdev_prio_item item;    /* item with its priority class */
+    uint                   prio;    /* priority class of the item read */
+    long                   err;
+    
+    /* get chdev_prio_item value from user */
+    if (copy_from_user((char *)&item, (char __user *)arg, sizeof(struct chdev_prio_item))) {
+        return -EFAULT;
+    }
+    
+    if (cmd == CHDEV_IOCTL_GET_PRIO_ITEM) {
+        /* enter a critical section */
+        if ((err = chdev_down_read(dev, filp, false))) {
+            return err;
+        }
+        
+        /* call common part of read method */
+        err = chdev_read_user(filp->private_data, item.buf, item.size, &prio);
+        
+        /* exit a critical section */
+        chdev_up_read(dev, filp);
+        
+        /* report priority class of the item */
+        if (err > 0 && put_user((unsigned char)prio, &arg->priority)) {
+            return -EFAULT;
+        }
+    }
+    else {
+        if (item.priority >= max(dev->nprio, 1U)) {
+            return -EINVAL;
+        }
+        
+        /* enter a critical section */
+        if ((err = chdev_down_write(dev, filp, false))) {
+            return err;
+        }
+        
+        /* call common part of write method */
+        err = chdev_write_user(dev, item.buf, item.size, item.priority);
+        
+        /* exit a critical section */
+        chdev_up_write(dev, filp);
+    }
+    
+    return err < 0 ? err : 0;
+}
+
+/*
+ * Implementation of CHDEV_IOCTL_GET_STATS.
+ * Only as many bytes as the caller knows about are copied, so older binaries keep working.
+ */
+static long chdev_ioctl_stats(struct file *filp, struct chdev_stats __user *arg) {
+    struct chdev_stats stats;
+    uint               size;    /* size of the structure known by the caller */
+    
+    if (get_user(size, &arg->size)) {
+        return -EFAULT;
+    }
+    if (size < offsetof(struct chdev_stats, enqueued)) {
+        return -EINVAL;
+    }
+    
+    chdev_get_stats(chdev_filp_dev(filp), &stats);
+    stats.size = min_t(uint, size, sizeof(struct chdev_stats));
+    
+    if (copy_to_user(arg, &stats, stats.size)) {
+        return -EFAULT;
+    }
+    return 0;
+}
+
+/*
+ * Implementation of CHDEV_IOCTL_GET_HIST, the histogram is too large for the stack.
+ */
+static long chdev_ioctl_hist(struct file *filp, struct chdev_hist __user *arg) {
+    struct chdev_hist *hist;
+    long              retval = 0;
+    
+    if (!(hist = kmalloc(sizeof(struct chdev_hist), GFP_KERNEL))) {
+        return -ENOMEM;
+    }
+    
+    chdev_get_hist(chdev_filp_dev(filp), hist);
+    if (copy_to_user(arg, hist, sizeof(struct chdev_hist))) {
+        retval = -EFAULT;
+    }
+    
+    kfree(hist);
+    return retval;
+}
+
+/*
+ * Upper bound of the residence time which permille of the items in the histogram did not exceed.
+ */
+static u64 chdev_hist_quantile(struct chdev_hist *hist, uint permille) {
+    u64  rank = div_u64(hist->count * permille + 999, 1000);    /* items up to the quantile */
+    u64  seen = 0;
+    uint i;
+    
+    for (i = 0; i < CHDEV_HIST_BUCKETS - 1; i++) {
+        seen += hist->buckets[i];
+        if (seen >= rank) {
+            break;
+        }
+    }
+    if (i < 4) {
+        return i;
+    }
+    return ((u64)(5 + i % 4) << (i / 4 - 1)) - 1;
+}
+
+/*
+ * Implementation of file_operations.mmap for chdev_fops.
+ * Control page and buffer pages are mapped read-write only for the owner of the role which writes them
+ * (see chdev_common.h), read-only otherwise. The driver reads nothing from the control page but the positions
+ * of mapped roles, and checks them and every item header before it takes them.
+ */
+static int chdev_mmap(struct file *filp, struct vm_area_struct *vma) {
+    struct chdev_file *cfile = filp->private_data;
+    struct chdev_dev  *dev   = cfile->dev;
+    unsigned long     size   = vma->vm_end - vma->vm_start;
+    unsigned long     pfn;
+    uint              role;
+    int               err;
+    
+    /* private mappings would not see updates done by the driver, sharded device and slot mode have no ring */
+    if (!(vma->vm_flags & VM_SHARED) || dev->shards || dev->slots) {
+        return -EINVAL;
+    }
+    
+    if (vma->vm_pgoff == CHDEV_MMAP_CTRL_PGOFF) {
+        if (size != PAGE_SIZE) {
+            return -EINVAL;
+        }
+    }
+    else if (vma->vm_pgoff < CHDEV_MMAP_BUF_PGOFF ||
+             ((vma->vm_pgoff - CHDEV_MMAP_BUF_PGOFF) << PAGE_SHIFT) + size > PAGE_ALIGN(dev->ring.buf_size)) {
+        return -EINVAL;
+    }
+    
+    /* producer writes the buffer and a mapped role its position, nobody else may write them */
+    if (chdev_lock(dev, &dev->sem)) {
+        return -ERESTARTSYS;
+    }
+    role = chdev_file_role(dev, filp);
+    if (!(role & (vma->vm_pgoff == CHDEV_MMAP_CTRL_PGOFF ? CHDEV_ROLE_MAPPED : CHDEV_ROLE_PRODUCER))) {
+        if (vma->vm_flags & VM_WRITE) {
+            up(&dev->sem);
+            return -EACCES;
+        }
+        vma->vm_flags &= ~VM_MAYWRITE;  /* nor by mprotect() */
+    }
+    
+    /* mapped buffer can not be moved to another node, and the one being moved can not be mapped */
+    if (!atomic_inc_unless_negative(&dev->mappings)) {
+        up(&dev->sem);
+        return -EBUSY;
+    }
+    if (vma->vm_flags & VM_MAYWRITE) {
+        atomic_inc(&cfile->wr_maps);
+    }
+    up(&dev->sem);
+    
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+    if (vma->vm_pgoff == CHDEV_MMAP_CTRL_PGOFF) {
+        pfn = virt_to_phys(dev->ring.ctrl) >> PAGE_SHIFT;
+        err = remap_pfn_range(vma, vma->vm_start, pfn, size, vma->vm_page_prot);
+    }
+    else if (is_vmalloc_addr(dev->ring.buf)) {
+        /* vmalloc'ed buffer is not physically contiguous, insert it page by page */
+        err = chdev_mmap_vmalloc(vma, dev->ring.buf + ((vma->vm_pgoff - CHDEV_MMAP_BUF_PGOFF) << PAGE_SHIFT));
+    }
+    else {
+        pfn = (virt_to_phys(dev->ring.buf) >> PAGE_SHIFT) + vma->vm_pgoff - CHDEV_MMAP_BUF_PGOFF;
+        err = remap_pfn_range(vma, vma->vm_start, pfn, size, vma->vm_page_prot);
+    }
+    
+    if (err) {
+        chdev_vm_close(vma);
+        return err;
+    }
+    vma->vm_ops = &chdev_vm_ops;
+    return 0;
+}
+
+/*
+ * Implementation of vm_operations_struct.open for chdev_vm_ops, called when a mapping is copied or split.
+ */
+static void chdev_vm_open(struct vm_area_struct *vma) {
+    struct chdev_file *cfile = vma->vm_file->private_data;
+    
+    atomic_inc(&cfile->dev->mappings);
+    if (vma->vm_flags & VM_MAYWRITE) {
+        atomic_inc(&cfile->wr_maps);
+    }
+}
+
+/*
+ * Implementation of vm_operations_struct.close for chdev_vm_ops.
+ */
+static void chdev_vm_close(struct vm_area_struct *vma) {
+    struct chdev_file *cfile = vma->vm_file->private_data;
+    
+    atomic_dec(&cfile->dev->mappings);
+    if (vma->vm_flags & VM_MAYWRITE) {
+        atomic_dec(&cfile->wr_maps);
+    }
+}
+
+/*
+ * Map pages of vmalloc'ed memory starting at kaddr to the whole vma.
+ */
+static int chdev_mmap_vmalloc(struct vm_area_struct *vma, char *kaddr) {
+    unsigned long addr;
+    int           err;
+    
+    for (addr = vma->vm_start; addr < vma->vm_end; addr += PAGE_SIZE, kaddr += PAGE_SIZE) {
+        if ((err = vm_insert_page(vma, addr, vmalloc_to_page(kaddr)))) {
+            return err;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Create "chdev<index>" file in /proc file system, and "chdev" link to the first device,
+ * which keeps the name the file had before several devices were supported (as /dev/chdev does).
+ */
+static void __init chdev_create_proc(struct chdev_dev *dev, int index) {
+    char name[16];
+    
+    snprintf(name, sizeof(name), "chdev%d", index);
+    proc_create_data(name, 0, NULL, &chdev_proc_ops, dev);
+    if (index == 0) {
+        proc_symlink("chdev", NULL /* parent dir */, name);
+    }
+}
+
+/*
+ * Remove "chdev<index>" file from /proc file system, and the link to it.
+ */
+static void chdev_remove_proc(int index) {
+    char name[16];
+    
+    /* no problem if it was not registered */
+    if (index == 0) {
+        remove_proc_entry("chdev", NULL /* parent dir */);
+    }
+    snprintf(name, sizeof(name), "chdev%d", index);
+    remove_proc_entry(name, NULL /* parent dir */);
+}
+
+/*
+ * Implementation of file_operations.open for chdev_proc_ops.
+ */
+static int chdev_proc_open(struct inode *inode, struct file *filp) {
+    return single_open(filp, chdev_proc_show, PDE_DATA(inode));
+}
+
+/*
+ * Implementation of show method for /proc file system
+ */
+static int chdev_proc_show(struct seq_file *s, void *v) {
+    struct chdev_dev    *dev = s->private;
+    struct chdev_stats  stats;
+    struct chdev_hist   *hist;
+    struct chdev_cursor *cursor;
+    uint                i;
+    
+    chdev_get_stats(dev, &stats);
+    
+    seq_printf(s, "%-20.20s : %10zu\n"
+    "%-20.20s : %10u\n",
+    "Buffer size",  dev->buf_size,
+    "Item counter", stats.num_item);
+    
+    seq_printf(s, "%-20.20s : %10llu\n"
+    "%-20.20s : %10llu\n"
+    "%-20.20s : %10llu\n"
+    "%-20.20s : %10llu\n"
+    "%-20.20s : %10llu\n"
+    "%-20.20s : %10llu\n"
+    "%-20.20s : %10llu\n"
+    "%-20.20s : %10llu\n"
+    "%-20.20s : %10llu\n"
+    "%-20.20s : %10llu\n"
+    "%-20.20s : %10llu\n",
+    "Enqueued",       stats.enqueued,
+    "Dequeued",       stats.dequeued,
+    "Bytes in",       stats.bytes_in,
+    "Bytes out",      stats.bytes_out,
+    "Full",           stats.full,
+    "Empty",          stats.empty,
+    "Contended",      stats.contended,
+    "Interrupted",    stats.interrupted,
+    "High watermark", stats.high_watermark,
+    "Dropped",        stats.dropped,
+    "Dropped bytes",  stats.dropped_bytes);
+    
+    /* ratio is shown in percent of the original size */
+    if (dev->lz4) {
+        seq_printf(s, "%-20.20s : %10llu\n"
+        "%-20.20s : %10llu%%\n"
+        "%-20.20s : %10llu\n"
+        "%-20.20s : %10llu\n",
+        "Compressed",     stats.compressed,
+        "Compress ratio", stats.compress_in ? stats.compress_out * 100 / stats.compress_in : 0,
+        "Compress ns",    stats.compress_ns,
+        "Decompress ns",  stats.decompress_ns);
+    }
+    
+    if (dev->slots) {
+        seq_printf(s, "%-20.20s : %10lu slots %10zu bytes\n", "Slots", dev->slots->mask + 1, dev->slots->size);
+    }
+    
+    /* percentiles are upper bounds of their buckets, within 25% of the real times */
+    if ((hist = kmalloc(sizeof(struct chdev_hist), GFP_KERNEL))) {
+        chdev_get_hist(dev, hist);
+        if (hist->count) {
+            seq_printf(s, "%-20.20s : %10llu\n"
+            "%-20.20s : %10llu ns\n"
+            "%-20.20s : %10llu ns\n"
+            "%-20.20s : %10llu ns\n"
+            "%-20.20s : %10llu ns\n"
+            "%-20.20s : %10llu ns\n",
+            "Residence count", hist->count,
+            "Residence mean",  div64_u64(hist->sum_ns, hist->count),
+            "Residence p50",   chdev_hist_quantile(hist, 500),
+            "Residence p99",   chdev_hist_quantile(hist, 990),
+            "Residence p99.9", chdev_hist_quantile(hist, 999),
+            "Residence max",   hist->max_ns);
+        }
+        kfree(hist);
+    }
+    
+    /* shards of sharded device are on the nodes of their CPUs, -1 means no node was chosen yet */
+    if (!dev->shards || dev->nprio) {
+        seq_printf(s, "%-20.20s : %10d\n", "NUMA node", dev->node);
+    }
+    
+    /* occupancy of every shard shows imbalance between CPUs, occupancy of every class shows the backlog */
+    for (i = 0; i < dev->nshards; i++) {
+        seq_printf(s, "%-5s %-14u : %10u items %10zu bytes\n", dev->nprio ? "Class" : "Shard",
+        i, chdev_ring_num_item(&dev->shards[i]), chdev_ring_used(&dev->shards[i]));
+    }
+    
+    /* lag of every subscriber shows which one holds writers back in broadcast mode */
+    if (dev->mode & CHDEV_MODE_BROADCAST) {
+        if (down_interruptible(&dev->sem)) {
+            return -ERESTARTSYS;
+        }
+        i = 0;
+        list_for_each_entry(cursor, &dev->cursors, node) {
+            seq_printf(s, "Cursor %-13u : %10llu lag   %10llu lost\n",
+            i++, dev->ring.rd_seq + chdev_ring_num_item(&dev->ring) - cursor->seq, cursor->lost);
+        }
+        up(&dev->sem);
+    }
+    return 0;
+}
+
+/*
+ * Set up the cdev structure for this device.
+ */
+static void chdev_setup_cdev(struct chdev_dev *dev, int index) {
+    int err; 
+    int devno = MKDEV(chdev_major, chdev_minor + index);
+    
+    cdev_init(&dev->cdev, &chdev_fops);
+    dev->cdev.owner = THIS_MODULE;
+    dev->cdev.ops = &chdev_fops;
+    
+    err = cdev_add(&dev->cdev, devno, 1);
+    if (err) {
+        printk(KERN_NOTICE "Error %d adding chdev%d", err, index);  
+    }
+}
+
+/*
+ * Allocate circular buffer of the given size on the given NUMA node.
+ * Buffer which fits into the largest page block (PAGE_SIZE << (MAX_ORDER - 1), 4 MB on x86) is taken from
+ * the linear mapping, which the kernel maps with huge pages, so copies to and from it cause few TLB misses.
+ * Larger buffers, or all buffers if linear_buf=0, are vmalloc'ed: they need no contiguous memory and may
+ * take gigabytes, but vmalloc maps them with base pages, so they get no TLB benefit at all.
+ */
+static char *chdev_alloc_buf(size_t size, int node) {
+    char *buf = NULL;
+    
+    /* allocate buffer memory; it is page aligned and zeroed because it is mapped to user space */
+    if (linear_buf && PAGE_ALIGN(size) <= (PAGE_SIZE << (MAX_ORDER - 1))) {
+        buf = alloc_pages_exact_nid(node, PAGE_ALIGN(size), GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN | __GFP_NORETRY);
+    }
+    if (!buf) {
+        buf = vzalloc_node(PAGE_ALIGN(size), node);
+    }
+    return buf;
+}
+
+/*
+ * Free circular buffer allocated by chdev_alloc_buf(...).
+ */
+static void chdev_free_buf(char *buf, size_t size) {
+    if (is_vmalloc_addr(buf)) {
+        vfree(buf);
+    }
+    else if (buf) {
+        free_pages_exact(buf, PAGE_ALIGN(size));
+    }
+}
+
+/*
+ * Allocate zeroed control page on the given NUMA node.
+ */
+static struct chdev_ring_ctrl *chdev_alloc_ctrl(int node) {
+    struct page *page = alloc_pages_node(node, GFP_KERNEL | __GFP_ZERO, 0);
+    
+    return page ? page_address(page) : NULL;
+}
+
+/*
+ * Allocate circular buffer of the ring on the given NUMA node.
+ */
+static int __init chdev_setup_ring(struct chdev_ring *ring, size_t size, int node) {
+    ring->buf = chdev_alloc_buf(size, node);
+    if (!(ring->buf)) {
+        return -ENOMEM;
+    }
+    ring->buf_size = size;
+    
+    /* set beg and end pointers, item and byte counters are zeroed by kcalloc */
+    ring->beg   = ring->buf;
+    ring->end   = ring->buf;
+    
+    sema_init(&(ring->sem), 1);
+    
+    return 0;
+}
+
+/*
+ * Free circular buffer of the ring.
+ */
+static void chdev_free_ring(struct chdev_ring *ring) {
+    chdev_free_buf(ring->buf, ring->buf_size);
+    free_page((unsigned long)ring->ctrl);
+}
+
+/*
+ * Move circular buffer and control page of the device to the given NUMA node, keeping its items, and fix
+ * the device on that node if fix is set. The buffer is copied without the semaphore while writers go on;
+ * the semaphore is held only to copy again the bytes they wrote meanwhile and to swap the pointers. Fails
+ * with -EBUSY if anyone uses the buffer without the semaphore: an owner of a role, a zero-copy operation
+ * in progress, or a mapping of the buffer (mapping is prevented until the move ends).
+ */
+static int chdev_move_ring(struct chdev_dev *dev, int nid, bool fix) {
+    struct chdev_ring      *ring = &dev->ring;
+    struct chdev_ring_ctrl *ctrl;
+    struct chdev_cursor    *cursor;
+    char                   *buf;
+    size_t                 off;         /* offset of ring->end when the copy started */
+    size_t                 wr_bytes;    /* ring->wr_bytes when the copy started */
+    size_t                 count;       /* bytes written during the copy */
+    int                    retval = 0;
+    
+    if (atomic_cmpxchg(&dev->mappings, 0, -1) != 0) {
+        return -EBUSY;
+    }
+    
+    buf  = chdev_alloc_buf(ring->buf_size, nid);
+    ctrl = chdev_alloc_ctrl(nid);
+    if (!buf || !ctrl) {
+        retval = -ENOMEM;
+        goto out;
+    }
+    
+    /* writers only fill the buffer after ring->end, readers and evictions never change it */
+    if (chdev_lock(dev, &dev->sem)) {
+        retval = -ERESTARTSYS;
+        goto out;
+    }
+    off      = ring->end - ring->buf;
+    wr_bytes = ring->wr_bytes;
+    up(&dev->sem);
+    
+    memcpy(buf, ring->buf, ring->buf_size);
+    
+    /* enter a critical section */
+    if (chdev_lock(dev, &dev->sem)) {
+        retval = -ERESTARTSYS;
+        goto out;
+    }
+    if (dev->producer || dev->consumer || dev->rsv_filp || dev->peek_filp) {
+        up(&dev->sem);
+        retval = -EBUSY;
+        goto out;
+    }
+    
+    /* bytes written during the copy may wrap around the end of the buffer */
+    count = ring->wr_bytes - wr_bytes;
+    if (count >= ring->buf_size) {
+        memcpy(buf, ring->buf, ring->buf_size);
+    }
+    else if (count > ring->buf_size - off) {
+        memcpy(buf + off, ring->buf + off, ring->buf_size - off);
+        memcpy(buf, ring->buf, count - (ring->buf_size - off));
+    }
+    else {
+        memcpy(buf + off, ring->buf + off, count);
+    }
+    memcpy(ctrl, ring->ctrl, sizeof(struct chdev_ring_ctrl));
+    
+    /* positions are pointers into the buffer, offsets stay the same */
+    list_for_each_entry(cursor, &dev->cursors, node) {
+        cursor->pos = buf + (cursor->pos - ring->buf);
+    }
+    ring->beg = buf + (ring->beg - ring->buf);
+    ring->end = buf + (ring->end - ring->buf);
+    
+    /* old buffer and control page are freed below */
+    swap(ring->buf, buf);
+    swap(ring->ctrl, ctrl);
+    dev->node = nid;
+    if (fix) {
+        dev->node_fixed = true;
+    }
+    
+    /* exit a critical section */
+    up(&dev->sem);
+    
+    out:
+    chdev_free_buf(buf, ring->buf_size);
+    free_page((unsigned long)ctrl);
+    atomic_set(&dev->mappings, 0);
+    return retval;
+}
+
+/*
+ * Allocate the queue of slot mode, every slot is free for its first position.
+ */
+static int __init chdev_setup_slots(struct chdev_dev *dev) {
+    struct chdev_slots *slots;
+    unsigned long      i;
+    
+    slots = kzalloc_node(sizeof(struct chdev_slots), GFP_KERNEL, dev->node);
+    if (!slots) {
+        return -ENOMEM;
+    }
+    dev->slots = slots;
+    
+    slots->stride = CHDEV_SLOT_STRIDE(slot_size);
+    slots->size   = slot_size;
+    slots->mask   = slot_count - 1;
+    slots->buf    = vzalloc_node(slot_count * slots->stride, dev->node);
+    if (!(slots->buf)) {
+        return -ENOMEM;
+    }
+    for (i = 0; i < slot_count; i++) {
+        ((struct chdev_slot *)(slots->buf + i * slots->stride))->seq = i;
+    }
+    dev->buf_size = slot_count * slots->stride;
+    
+    return 0;
+}
+
+/*
+ * Free the queue of slot mode.
+ */
+static void chdev_free_slots(struct chdev_slots *slots) {
+    if (slots) {
+        vfree(slots->buf);
+        kfree(slots);
+    }
+}
+
+/*
+ * Allocate scratch buffers of compression mode as a single area on the given NUMA node.
+ * A compressed item is stored only if it is smaller than the original, so it fits into CHDEV_LZ4_MAX bytes.
+ */
+static struct chdev_lz4 *chdev_alloc_lz4(int node) {
+    struct chdev_lz4 *lz4 = kzalloc_node(sizeof(struct chdev_lz4), GFP_KERNEL, node);
+    
+    if (!lz4) {
+        return NULL;
+    }
+    lz4->wrkmem = vmalloc_node(LZ4_MEM_COMPRESS + 2 * CHDEV_LZ4_MAX + LZ4_COMPRESSBOUND(CHDEV_LZ4_MAX), node);
+    if (!(lz4->wrkmem)) {
+        kfree(lz4);
+        return NULL;
+    }
+    lz4->wr_src = (char *)lz4->wrkmem + LZ4_MEM_COMPRESS;
+    lz4->wr_dst = lz4->wr_src + CHDEV_LZ4_MAX;
+    lz4->rd_dst = lz4->wr_dst + LZ4_COMPRESSBOUND(CHDEV_LZ4_MAX);
+    return lz4;
+}
+
+/*
+ * Free scratch buffers of compression mode.
+ */
+static void chdev_free_lz4(struct chdev_lz4 *lz4) {
+    if (lz4) {
+        vfree(lz4->wrkmem);
+        kfree(lz4);
+    }
+}
+
+/*
+ * NUMA node chosen for the device by the nodes module parameter, NUMA_NO_NODE if none or it is not online.
+ */
+static int __init chdev_node(int index) {
+    int nid = index < nnodes ? nodes[index] : NUMA_NO_NODE;
+    
+    return (nid >= 0 && nid < nr_node_ids && node_online(nid)) ? nid : NUMA_NO_NODE;
+}
+
+/*
+ * Set up chdev_dev structure for this device.
+ */
+static int __init chdev_setup(struct chdev_dev *dev, int index) {
+    size_t size = (index < nbuffers && buffers[index] > 0) ? buffers[index] : buffer;
+    int    result;
+    uint   i;
+    
+    /* half of the buffer must hold at least an empty item, and its offsets must fit into the control page */
+    if (size < CHDEV_BUF_MIN || size > CHDEV_BUF_MAX) {
+        printk(KERN_WARNING "chdev: size of buffer %d must be in range [%d, %lu]\n", index, CHDEV_BUF_MIN, CHDEV_BUF_MAX);
+        return -EINVAL;
+    }
+    size = round_down(size, CHDEV_ITEM_ALIGN);   /* records are aligned, so a header never wraps */
+    
+    /* a device has either per-CPU or per-priority buffers */
+    if (priorities > CHDEV_MAX_PRIO || (priorities && sharded)) {
+        printk(KERN_WARNING "chdev: priorities must be in range [0, %d] and can not be used with sharded\n", CHDEV_MAX_PRIO);
+        return -EINVAL;
+    }
+    
+    /* writers of several buffers do not serialize with readers, so they cannot evict items */
+    if (overwrite && (sharded || priorities)) {
+        printk(KERN_WARNING "chdev: overwrite mode is not available for sharded devices and priority classes\n");
+        return -EINVAL;
+    }
+    
+    /* slot mode replaces the ring, slots are indexed by masking */
+    if (slot_size && (sharded || priorities || overwrite || !is_power_of_2(slot_count) ||
+                      slot_size > CHDEV_ITEM_MAX || slot_count > CHDEV_BUF_MAX / CHDEV_SLOT_STRIDE(slot_size))) {
+        printk(KERN_WARNING "chdev: slot_count must be a power of two, and slot mode can not be used with sharded, priorities and overwrite\n");
+        return -EINVAL;
+    }
+    
+    /* node of the device was checked by chdev_init_module, which placed this structure there */
+    dev->buf_size     = size;
+    dev->mode         = overwrite ? CHDEV_MODE_OVERWRITE : 0;
+    dev->compress_min = compress_min;
+    dev->node         = chdev_node(index);
+    dev->node_fixed   = dev->node != NUMA_NO_NODE;
+    
+    dev->stats = alloc_percpu(struct chdev_pcpu_stats);
+    if (!(dev->stats)) {
+        return -ENOMEM;
+    }
+    
+    if (slot_size) {
+        result = chdev_setup_slots(dev);
+        if (result) {
+            return result;
+        }
+    }
+    else if (sharded || priorities) {
+        /* one shard per possible CPU, located on the node of that CPU, or one per priority class */
+        dev->nshards   = sharded ? nr_cpu_ids : priorities;
+        dev->unordered = unordered;
+        dev->shards    = kcalloc(dev->nshards, sizeof(struct chdev_ring), GFP_KERNEL);
+        if (!(dev->shards)) {
+            return -ENOMEM;
+        }
+        for (i = 0; i < dev->nshards; i++) {
+            result = chdev_setup_ring(&dev->shards[i], size, sharded ? cpu_to_node(i) : dev->node);
+            if (result) {
+                return result;
+            }
+        }
+        
+        /* higher classes are read more often in weighted mode */
+        dev->nprio = priorities;
+        for (i = 0; i < dev->nprio; i++) {
+            dev->weights[i] = ((int)i < nweights && weights[i] > 0) ? weights[i] : 1U << i;
+        }
+    }
+    else {
+        result = chdev_setup_ring(&dev->ring, size, dev->node);
+        if (result) {
+            return result;
+        }
+        
+        /* allocate control page */
+        dev->ring.ctrl = chdev_alloc_ctrl(dev->node);
+        if (!(dev->ring.ctrl)) {
+            return -ENOMEM;
+        }
+        dev->ring.ctrl->buf_size = size;
+    }
+    
+    init_waitqueue_head(&(dev->inq));
+    init_waitqueue_head(&(dev->outq));
+    sema_init(&(dev->sem), 1);
+    spin_lock_init(&(dev->map_lock));
+    INIT_LIST_HEAD(&dev->cursors);
+    
+    /* initialize device, it becomes live after this call */
+    chdev_setup_cdev(dev, index);
+    
+    /* create file in a /proc file system */
+    chdev_create_proc(dev, index);
+    
+    return 0;
+}
+
+/*
+ * Initialization function.
+ */
+static int __init chdev_init_module(void) {
+    int   result, i;
+    dev_t dev = 0; /* device number */
+    
+    if (ndevices < 1 || ndevices > CHDEV_MAX_DEVICES) {
+        printk(KERN_WARNING "chdev: ndevices must be in range [1, %d]\n", CHDEV_MAX_DEVICES);
+        return -EINVAL;
+    }
+    
+    /* asking for a dinamic major */
+    result      = alloc_chrdev_region(&dev, chdev_minor, ndevices, "chdev");
+    chdev_major = MAJOR(dev);
+    /* allocation was unsuccessful */
+    if (result < 0) {
+        printk(KERN_WARNING "chdev: can't get major %d\n", chdev_major);
+        return result;
+    }
+    
+    /* allocate devices memory */
+    chdev_devices = kcalloc(ndevices, sizeof(struct chdev_dev *), GFP_KERNEL);
+    if (!chdev_devices) {
+        result = -ENOMEM;
+        goto fail;
+    }
+    
+    /* initialize chdev fields */
+    for (i = 0; i < ndevices; i++) {
+        /* state of the device is read on every operation, so it is placed on the node of its buffer */
+        if (i < nnodes && nodes[i] != NUMA_NO_NODE && chdev_node(i) == NUMA_NO_NODE) {
+            printk(KERN_WARNING "chdev: node %d of device %d is not online\n", nodes[i], i);
+            result = -EINVAL;
+            goto fail;
+        }
+        chdev_devices[i] = kzalloc_node(sizeof(struct chdev_dev), GFP_KERNEL, chdev_node(i));
+        if (!chdev_devices[i]) {
+            result = -ENOMEM;
+            goto fail;
+        }
+        
+        result = chdev_setup(chdev_devices[i], i);
+        if (result) {
+            goto fail;
+        }
     }
-    /* initialize chdev fields */
-    result = chdev_setup();
-    /* create file in a /proc file system */
-    chdev_create_proc();
     
     printk(KERN_DEBUG "chdev_init_module: result == %d", result);  
     
-    return result;      /* succeed or failed */
+    return 0;           /* succeed */
+    
+    fail:
+    chdev_cleanup_module();
+    return result;      /* failed */
 }
 
 /*
@@ -336,18 +2131,43 @@ static int __init chdev_init_module(void) {
  */
 static void chdev_cleanup_module(void) {
     dev_t devno = MKDEV(chdev_major, chdev_minor);
+    int   i;
+    uint  j;
     
     /* free previously allocated memory */
-    cdev_del(&chdev->cdev);
-    kfree(chdev->buf);
-    kfree(chdev);
-    
-    /* remove files associated with chdev driver from /proc file system */
-    chdev_remove_proc();
+    if (chdev_devices) {
+        for (i = 0; i < ndevices; i++) {
+            struct chdev_dev *dev = chdev_devices[i];
+            
+            /* remove files associated with chdev driver from /proc file system */
+            chdev_remove_proc(i);
+            
+            if (!dev) {
+                continue;
+            }
+            
+            if (dev->cdev.ops) {
+                cdev_del(&dev->cdev);
+            }
+            chdev_free_ring(&dev->ring);
+            if (dev->shards) {
+                for (j = 0; j < dev->nshards; j++) {
+                    chdev_free_ring(&dev->shards[j]);
+                }
+                kfree(dev->shards);
+            }
+            chdev_free_notifier(rcu_dereference_protected(dev->notifier, 1));
+            chdev_free_lz4(dev->lz4);
+            chdev_free_slots(dev->slots);
+            free_percpu(dev->stats);
+            kfree(dev);
+        }
+        kfree(chdev_devices);
+    }
     
     /* cleanup_module is never called if registering failed */
-    unregister_chrdev_region(devno, 1);
+    unregister_chrdev_region(devno, ndevices);
 }
 
 module_init(chdev_init_module);
-module_exit(chdev_cleanup_module);;
\ No newline at end of file
+module_exit(chdev_cleanup_module);
\ No newline at end of file
@@ -6,206 +6,1592 @@
  * acknowledgment appears in derived source files.
  */
 
+/*
+ * State of a ring is split between the producer side (end, wr_bytes, wr_item) and the
+ * consumer side (beg, rd_bytes, rd_item). Each side writes only its own fields and publishes
+ * them with release semantics, the other side reads them with acquire semantics. So one writer
+ * and one reader may work on a ring concurrently without any lock (SPSC mode, and every shard
+ * in sharded mode); other writers and readers are serialized by dev->sem in chdev_main.c.
+ * 
+ * Positions are free-running byte and item counters, so occupancy is their difference. A record (header,
+ * stamps and payload) starts at a multiple of CHDEV_ITEM_ALIGN and never wraps around the end of the buffer:
+ * a record which does not fit there follows a padding marker and starts from the beginning, so every item
+ * is copied at once. Buffer sizes are multiples of CHDEV_ITEM_ALIGN, so a header always fits downside, and
+ * a record takes at most half of the buffer, so it fits after the padding as soon as the ring is empty.
+ */
+
+#include <linux/kernel.h>
 #include <linux/cdev.h>
 #include <linux/semaphore.h>
+#include <linux/wait.h>
+#include <linux/spinlock.h>
+#include <linux/uio.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/lz4.h>
+#include <linux/eventfd.h>
+#include <linux/hrtimer.h>
+#include <linux/rcupdate.h>
 #include <asm/uaccess.h>
 
-#include "chdev.h"
+#include "chdev.h"
+#include "chdev_common.h"
+#include "chdev_trace.h"
+
+/*
+ * Return pointer n bytes after pos, wrapping around the end of the buffer.
+ */
+static char *chdev_advance(struct chdev_ring *ring, char *pos, size_t n) {
+    size_t off = (pos - ring->buf) + n;
+    
+    return ring->buf + (off >= ring->buf_size ? off - ring->buf_size : off);
+}
+
+/*
+ * Read item header located at pos.
+ */
+static u32 chdev_get_header(const char *pos) {
+    u32 header;
+    
+    memcpy((char *)&header, pos, sizeof(u32));
+    return header;
+}
+
+/*
+ * Write item header at pos.
+ */
+static void chdev_put_header(char *pos, u32 header) {
+    memcpy(pos, (const char *)&header, sizeof(u32));
+}
+
+/*
+ * Number of bytes taken by an item after its header.
+ */
+static u32 chdev_item_size(u32 header) {
+    return header & ~(CHDEV_ITEM_LZ4 | CHDEV_ITEM_TS);
+}
+
+/*
+ * Number of bytes taken by the enqueue time of an item, which follows its header (before the sequence number).
+ */
+static size_t chdev_item_ts_len(u32 header) {
+    return (header & CHDEV_ITEM_TS) ? sizeof(u64) : 0;
+}
+
+/*
+ * Number of bytes taken by the record of an item of size bytes after its header, up to the next record.
+ */
+static size_t chdev_record_len(size_t size) {
+    return ALIGN(sizeof(u32) + size, CHDEV_ITEM_ALIGN);
+}
+
+/*
+ * Number of bytes which precede every item copied to readers with flags.
+ */
+static size_t chdev_prefix_len(uint flags) {
+    return ((flags & CHDEV_FLAG_FRAMED) ? sizeof(uint) : 0) + ((flags & CHDEV_FLAG_RESIDENCE) ? sizeof(u64) : 0);
+}
+
+/*
+ * Store the current time as the enqueue time of the stamped item with header at pos.
+ */
+static void chdev_stamp(char *pos) {
+    u64 now = ktime_get_ns();
+    
+    memcpy(pos + sizeof(u32), (char *)&now, sizeof(u64));
+}
+
+/*
+ * Time spent in the buffer by the stamped item with header at pos, in nanoseconds.
+ */
+static u64 chdev_residence(const char *pos) {
+    u64 stamp;
+    
+    memcpy((char *)&stamp, pos + sizeof(u32), sizeof(u64));
+    return ktime_get_ns() - stamp;
+}
+
+/*
+ * Bucket of the residence time in the log-linear histogram (see struct chdev_hist).
+ */
+static uint chdev_hist_bucket(u64 ns) {
+    uint e;
+    
+    if (ns < 4) {
+        return ns;
+    }
+    e = fls64(ns) - 1;
+    if (e > 40) {
+        return CHDEV_HIST_BUCKETS - 1;
+    }
+    return 4 * (e - 1) + ((ns >> (e - 2)) & 3);
+}
+
+/*
+ * Add residence time of an item which was read to the histogram of this CPU.
+ */
+static void chdev_hist_add(struct chdev_dev *dev, u64 ns) {
+    this_cpu_inc(dev->stats->residence[chdev_hist_bucket(ns)]);
+    this_cpu_add(dev->stats->residence_ns, ns);
+    if (ns > this_cpu_read(dev->stats->residence_max)) {
+        this_cpu_write(dev->stats->residence_max, ns);
+    }
+}
+
+/*
+ * Free space in the buffer as seen by the producer.
+ */
+static size_t chdev_free_space(struct chdev_ring *ring) {
+    return ring->buf_size - (ring->wr_bytes - smp_load_acquire(&ring->rd_bytes));
+}
+
+/*
+ * Publish current position of the producer in the control page shared with user space,
+ * unless user space publishes it (see chdev_map_side(...)).
+ */
+static void chdev_sync_ctrl_producer(struct chdev_ring *ring) {
+    if (ring->ctrl && !(ring->mapped & CHDEV_ROLE_PRODUCER)) {
+        ring->ctrl->end = ring->end - ring->buf;
+        smp_store_release(&ring->ctrl->wr_pos, ring->wr_bytes);
+        smp_store_release(&ring->ctrl->wr_item, ring->wr_item);
+    }
+}
+
+/*
+ * Publish current position of the consumer in the control page shared with user space,
+ * unless user space publishes it.
+ */
+static void chdev_sync_ctrl_consumer(struct chdev_ring *ring) {
+    if (ring->ctrl && !(ring->mapped & CHDEV_ROLE_CONSUMER)) {
+        ring->ctrl->beg = ring->beg - ring->buf;
+        smp_store_release(&ring->ctrl->rd_pos, ring->rd_bytes);
+        smp_store_release(&ring->ctrl->rd_item, ring->rd_item);
+    }
+}
+
+/*
+ * Remove the oldest item of size bytes after its header from the ring, padding before it must be skipped already.
+ */
+static void chdev_retire_item(struct chdev_ring *ring, u32 size) {
+    size_t len = chdev_record_len(size);
+    
+    ring->beg = chdev_advance(ring, ring->beg, len);
+    ++ring->rd_item;
+    ++ring->rd_seq;
+    smp_store_release(&ring->rd_bytes, ring->rd_bytes + len);
+}
+
+/*
+ * Number of items in the ring at the current time point.
+ */
+uint chdev_ring_num_item(struct chdev_ring *ring) {
+    return smp_load_acquire(&ring->wr_item) - READ_ONCE(ring->rd_item);
+}
+
+/*
+ * Number of bytes occupied in the ring at the current time point, including headers and padding.
+ */
+size_t chdev_ring_used(struct chdev_ring *ring) {
+    return READ_ONCE(ring->wr_bytes) - READ_ONCE(ring->rd_bytes);
+}
+
+/*
+ * Number of bytes occupied in the device at the current time point.
+ */
+size_t chdev_used(struct chdev_dev *dev) {
+    size_t used = 0;
+    uint   i;
+    
+    if (dev->slots) {
+        return (size_t)chdev_slot_num_item(dev) * dev->slots->stride;
+    }
+    if (!dev->shards) {
+        return chdev_ring_used(&dev->ring);
+    }
+    
+    for (i = 0; i < dev->nshards; i++) {
+        used += chdev_ring_used(&dev->shards[i]);
+    }
+    return used;
+}
+
+/*
+ * Check the record at pos, the first of used bytes of the ring, and store its header to *header. A writable
+ * mapping lets user space rewrite the buffer at any time, so the header is read once, and trusted only if
+ * the record lies within the used bytes, does not wrap and holds the enqueue time of a stamped item (and the
+ * original length of a compressed one). Returns number of bytes of padding before the record, or -EIO.
+ */
+static ssize_t chdev_check_item(struct chdev_ring *ring, const char *pos, size_t used, u32 *header) {
+    size_t downside = ring->buf + ring->buf_size - pos;  /* bytes downside the buffer */
+    size_t pad      = 0;                                 /* bytes skipped by padding */
+    size_t size;                                         /* bytes taken by the item after its header */
+    
+    *header = chdev_get_header(pos);
+    if (*header == CHDEV_ITEM_PAD) {
+        if (downside >= used) {
+            return -EIO;    /* padding is always followed by a record */
+        }
+        pad      = downside;
+        used    -= downside;
+        downside = ring->buf_size;
+        *header  = chdev_get_header(ring->buf);
+    }
+    size = chdev_item_size(*header);
+    if (*header == CHDEV_ITEM_PAD || chdev_record_len(size) > min(used, downside) ||
+        size < chdev_item_ts_len(*header) + ((*header & CHDEV_ITEM_LZ4) ? sizeof(u32) : 0)) {
+        return -EIO;
+    }
+    return pad;
+}
+
+/*
+ * Check the oldest item of the ring, see chdev_check_item(...), and skip padding left before it at the end
+ * of the buffer. Must be called only if there is an item in the ring. Returns 1 if padding was skipped,
+ * 0 if there was none, or -EIO with the ring left as it was.
+ */
+static int chdev_skip_pad(struct chdev_ring *ring, u32 *header) {
+    ssize_t pad = chdev_check_item(ring, ring->beg, chdev_ring_used(ring), header);
+    
+    if (pad > 0) {
+        ring->beg = ring->buf;
+        smp_store_release(&ring->rd_bytes, ring->rd_bytes + pad);
+    }
+    return pad < 0 ? pad : pad > 0;
+}
+
+/*
+ * Number of bytes taken by padding before a record of len bytes written at ring->end: the rest of the buffer
+ * if the record does not fit there, 0 otherwise.
+ */
+static size_t chdev_pad_len(struct chdev_ring *ring, size_t len) {
+    size_t downside = ring->buf + ring->buf_size - ring->end;  /* bytes downside the buffer */
+    
+    return len > downside ? downside : 0;
+}
+
+/*
+ * Header position of a new record which follows pad bytes of padding, the caller has checked that both fit.
+ */
+static char *chdev_place_item(struct chdev_ring *ring, size_t pad) {
+    if (pad) {
+        chdev_put_header(ring->end, CHDEV_ITEM_PAD);
+        return ring->buf;
+    }
+    return ring->end;
+}
+
+/*
+ * Evict the oldest items of the ring until count bytes are free, in overwrite mode only.
+ * Writers and readers of such a device are serialized by dev->sem, so the writer may move
+ * the consumer side. The oldest item is kept while it is read in place. In broadcast mode
+ * cursors which pointed to evicted items are moved to the oldest remaining one.
+ * Returns 0, or -EIO if the buffer was corrupted (items before the corrupted one are evicted).
+ */
+static int chdev_evict(struct chdev_dev *dev, struct chdev_ring *ring, size_t count) {
+    struct chdev_cursor *cursor;
+    u32                 header;
+    u32                 item_len;
+    int                 padded  = 0;
+    bool                evicted = false;
+    
+    if (!(dev->mode & CHDEV_MODE_OVERWRITE) || dev->peek_filp) {
+        return 0;
+    }
+    
+    while (count > chdev_free_space(ring) && ring->wr_item != ring->rd_item) {
+        if ((padded = chdev_skip_pad(ring, &header)) < 0) {
+            break;
+        }
+        item_len = chdev_item_size(header);
+        
+        if (trace_chdev_evict_enabled()) {
+            trace_chdev_evict(MINOR(dev->cdev.dev), item_len, chdev_ring_used(ring) - chdev_record_len(item_len),
+                              chdev_ring_num_item(ring) - 1, padded ? CHDEV_TRACE_PAD : CHDEV_TRACE_FLAT);
+        }
+        
+        chdev_retire_item(ring, item_len);
+        chdev_stat_inc(dev, dropped);
+        chdev_stat_add(dev, dropped_bytes, item_len);
+        evicted = true;
+    }
+    
+    if (!evicted) {
+        return min(padded, 0);
+    }
+    chdev_sync_ctrl_consumer(ring);
+    
+    list_for_each_entry(cursor, &dev->cursors, node) {
+        if (cursor->seq < ring->rd_seq) {
+            cursor->lost   += ring->rd_seq - cursor->seq;
+            cursor->seq     = ring->rd_seq;
+            cursor->pos     = ring->beg;
+            cursor->overrun = true;
+        }
+    }
+    return min(padded, 0);
+}
+
+/*
+ * Number of items in the device at the current time point.
+ */
+uint chdev_num_item(struct chdev_dev *dev) {
+    uint i, num_item = 0;
+    
+    if (dev->slots) {
+        return chdev_slot_num_item(dev);
+    }
+    if (!dev->shards) {
+        return chdev_ring_num_item(&dev->ring);
+    }
+    
+    for (i = 0; i < dev->nshards; i++) {
+        num_item += chdev_ring_num_item(&dev->shards[i]);
+    }
+    return num_item;
+}
+
+/*
+ * Ring which receives items of the priority class, or items written on the current CPU in sharded mode.
+ */
+static struct chdev_ring *chdev_write_ring(struct chdev_dev *dev, uint prio) {
+    if (!dev->shards) {
+        return &dev->ring;
+    }
+    
+    if (dev->nprio) {
+        return &dev->shards[min(prio, dev->nprio - 1)];
+    }
+    
+    /* migration to another CPU is harmless, the shard lock serializes writers */
+    return &dev->shards[raw_smp_processor_id() % dev->nshards];
+}
+
+/*
+ * Ring of the priority class which holds the next item to read, NULL if the device is empty.
+ * Strict order takes the highest non-empty class. Weighted order reads up to dev->weights[p]
+ * items of class p in a row, then moves to the next lower non-empty class (wrapping to the highest).
+ */
+static struct chdev_ring *chdev_prio_ring(struct chdev_dev *dev) {
+    uint i;
+    
+    if (!(dev->mode & CHDEV_MODE_WEIGHTED)) {
+        for (i = dev->nprio; i-- > 0;) {
+            if (chdev_ring_num_item(&dev->shards[i]) > 0) {
+                return &dev->shards[i];
+            }
+        }
+        return NULL;
+    }
+    
+    /* every class is visited with a fresh credit at most once */
+    for (i = 0; i <= dev->nprio; i++) {
+        if (dev->credit > 0 && chdev_ring_num_item(&dev->shards[dev->next_shard]) > 0) {
+            --dev->credit;
+            return &dev->shards[dev->next_shard];
+        }
+        dev->next_shard = (dev->next_shard ? dev->next_shard : dev->nprio) - 1;
+        dev->credit     = dev->weights[dev->next_shard];
+    }
+    return NULL;
+}
+
+/*
+ * Check if items written to the device take enqueue sequence numbers: shards of CPUs, unless they are unordered.
+ */
+static bool chdev_ordered(struct chdev_dev *dev) {
+    return dev->shards && !dev->nprio && !dev->unordered;
+}
+
+/*
+ * Number of bytes which an item written to the device takes for its enqueue sequence number. The number
+ * follows the item header and its enqueue time, and is counted in the header.
+ */
+static size_t chdev_seq_len(struct chdev_dev *dev) {
+    return chdev_ordered(dev) ? sizeof(u64) : 0;
+}
+
+/*
+ * Number of bytes which a new item takes for its enqueue time and sequence number, in the current mode.
+ */
+size_t chdev_stamp_len(struct chdev_dev *dev) {
+    return ((READ_ONCE(dev->mode) & CHDEV_MODE_TIMESTAMP) ? sizeof(u64) : 0) + chdev_seq_len(dev);
+}
+
+/*
+ * Shard whose oldest item has the lowest enqueue sequence number, NULL if the device is empty. A writer takes
+ * the number right before it publishes the item, so an item published before another one takes its number is
+ * read first. A shard whose oldest item is corrupted is taken as well, so that the read fails.
+ */
+static struct chdev_ring *chdev_oldest_ring(struct chdev_dev *dev) {
+    struct chdev_ring *ring, *oldest = NULL;
+    u64              seq, oldest_seq = 0;
+    u32              header;
+    uint             i;
+    
+    for (i = 0; i < dev->nshards; i++) {
+        ring = &dev->shards[i];
+        if (chdev_ring_num_item(ring) == 0) {
+            continue;
+        }
+        if (chdev_skip_pad(ring, &header) < 0 || chdev_item_size(header) < chdev_item_ts_len(header) + sizeof(u64)) {
+            return ring;
+        }
+        memcpy((char *)&seq, ring->beg + sizeof(u32) + chdev_item_ts_len(header), sizeof(u64));
+        if (!oldest || seq < oldest_seq) {
+            oldest     = ring;
+            oldest_seq = seq;
+        }
+    }
+    return oldest;
+}
+
+/*
+ * Ring which holds the next item to read, NULL if the device is empty.
+ * With priority classes the class is picked by chdev_prio_ring(...). In sharded mode the shard which holds
+ * the oldest item is taken, or non-empty shards are visited round-robin if they are unordered.
+ */
+static struct chdev_ring *chdev_read_ring(struct chdev_dev *dev) {
+    uint i, shard;
+    
+    if (!dev->shards) {
+        return &dev->ring;
+    }
+    if (dev->nprio) {
+        return chdev_prio_ring(dev);
+    }
+    if (chdev_ordered(dev)) {
+        return chdev_oldest_ring(dev);
+    }
+    
+    for (i = 0; i < dev->nshards; i++) {
+        shard = (dev->next_shard + i) % dev->nshards;
+        if (chdev_ring_num_item(&dev->shards[shard]) > 0) {
+            dev->next_shard = shard + 1;
+            return &dev->shards[shard];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Check if there is an item which can be read from the device.
+ */
+bool chdev_can_read(struct chdev_dev *dev) {
+    if (dev->slots) {
+        return chdev_slot_can_read(dev);
+    }
+    chdev_pull_mapped(dev);
+    if (READ_ONCE(dev->ring.mapped) == (CHDEV_ROLE_PRODUCER | CHDEV_ROLE_CONSUMER)) {
+        return chdev_ring_used(&dev->ring) > 0;  /* items are not counted while both sides are mapped */
+    }
+    return chdev_num_item(dev) > 0 && !READ_ONCE(dev->peek_filp);
+}
+
+/*
+ * Check if an item of count bytes can be written to the device with the priority class.
+ * The item takes its enqueue time and sequence number as well. In overwrite mode any item which fits into
+ * the buffer can, unless the oldest item is read in place.
+ */
+bool chdev_can_write(struct chdev_dev *dev, size_t count, uint prio) {
+    struct chdev_ring *ring;
+    size_t           len;   /* bytes taken by the record and the padding before it */
+    
+    if (dev->slots) {
+        return chdev_slot_can_write(dev);
+    }
+    chdev_pull_mapped(dev);
+    
+    ring = chdev_write_ring(dev, prio);
+    len  = chdev_record_len(chdev_stamp_len(dev) + count);
+    len += chdev_pad_len(ring, len);
+    
+    if (READ_ONCE(dev->rsv_filp)) {
+        return false;
+    }
+    if ((READ_ONCE(dev->mode) & CHDEV_MODE_OVERWRITE) && !READ_ONCE(dev->peek_filp)) {
+        return len <= ring->buf_size;
+    }
+    return len <= chdev_free_space(ring);
+}
+
+/*
+ * Largest item which can be written to the device in the current mode: its record takes at most half
+ * of a ring (see above).
+ */
+size_t chdev_item_max(struct chdev_dev *dev) {
+    size_t max;
+    
+    if (dev->slots) {
+        return dev->slots->size;
+    }
+    max = ((dev->buf_size / 2) & ~(size_t)(CHDEV_ITEM_ALIGN - 1)) - sizeof(u32) - chdev_stamp_len(dev);
+    return max < CHDEV_ITEM_MAX ? max : CHDEV_ITEM_MAX;
+}
+
+/*
+ * Signal readers if items or used bytes of the device rose from prev_items and prev_used across a watermark
+ * of the notifier, otherwise start the timer which signals them after the maximum delay, unless it is running
+ * already. A write may step over a watermark without landing on it: an eviction of overwrite mode, a batch,
+ * or concurrent writers of sharded and slot modes change the device by more than one item.
+ */
+static void chdev_notify_cross(struct chdev_dev *dev, uint prev_items, size_t prev_used) {
+    struct chdev_notifier *notifier;
+    uint                  num_item;
+    size_t                used;
+    
+    rcu_read_lock();
+    notifier = rcu_dereference(dev->notifier);
+    if (notifier && notifier->rd_ctx) {
+        num_item = chdev_num_item(dev);
+        used     = chdev_used(dev);
+        if ((notifier->rd_items && prev_items < notifier->rd_items && num_item >= notifier->rd_items) ||
+            (notifier->rd_bytes && prev_used < notifier->rd_bytes && used >= notifier->rd_bytes)) {
+            eventfd_signal(notifier->rd_ctx, 1);
+        }
+        else if (notifier->delay_ns && num_item && !hrtimer_active(&notifier->timer)) {
+            hrtimer_start(&notifier->timer, ns_to_ktime(notifier->delay_ns), HRTIMER_MODE_REL);
+        }
+    }
+    rcu_read_unlock();
+}
+
+/*
+ * Signal readers for the item which just took count bytes of the device, unless a batch of writes is in
+ * progress: then the batch signals them once it ends.
+ */
+void chdev_notify_write(struct chdev_dev *dev, size_t count) {
+    uint   num_item;
+    size_t used;
+    
+    if (atomic_read(&dev->notify_hold)) {
+        return;
+    }
+    num_item = chdev_num_item(dev);
+    used     = chdev_used(dev);
+    chdev_notify_cross(dev, num_item ? num_item - 1 : 0, used > count ? used - count : 0);
+}
+
+/*
+ * Begin a batch of writes which signals readers once, when chdev_notify_release(...) finds that the whole
+ * batch crossed a watermark. Nothing is held if no notifier is registered.
+ */
+void chdev_notify_hold(struct chdev_dev *dev, struct chdev_notify_mark *mark) {
+    mark->held = rcu_access_pointer(dev->notifier) != NULL;
+    if (mark->held) {
+        atomic_inc(&dev->notify_hold);
+        mark->items = chdev_num_item(dev);
+        mark->used  = chdev_used(dev);
+    }
+}
+
+void chdev_notify_release(struct chdev_dev *dev, struct chdev_notify_mark *mark) {
+    if (mark->held) {
+        atomic_dec(&dev->notify_hold);
+        chdev_notify_cross(dev, mark->items, mark->used);
+    }
+}
+
+/*
+ * Signal writers if the read which freed count bytes raised free space of the ring to the watermark of the notifier.
+ */
+void chdev_notify_read(struct chdev_dev *dev, size_t free, size_t count) {
+    struct chdev_notifier *notifier;
+    
+    rcu_read_lock();
+    notifier = rcu_dereference(dev->notifier);
+    if (notifier && notifier->wr_ctx && notifier->wr_free &&
+        free >= notifier->wr_free && free - count < notifier->wr_free) {
+        eventfd_signal(notifier->wr_ctx, 1);
+    }
+    rcu_read_unlock();
+}
+
+/*
+ * Timer of the notifier: items below the watermarks have waited for the maximum delay.
+ */
+enum hrtimer_restart chdev_notify_timer(struct hrtimer *timer) {
+    struct chdev_notifier *notifier = container_of(timer, struct chdev_notifier, timer);
+    
+    if (chdev_num_item(notifier->dev) > 0) {
+        eventfd_signal(notifier->rd_ctx, 1);
+    }
+    return HRTIMER_NORESTART;
+}
+
+/*
+ * Decompress the item of size bytes located at pos to the iterator, item_len bytes are expected.
+ */
+static ssize_t chdev_lz4_to_iter(struct chdev_dev *dev, struct iov_iter *to, const char *pos, size_t size, u32 item_len) {
+    struct chdev_lz4 *lz4 = dev->lz4;
+    u64              start;
+    int              len;           /* length of the decompressed item */
+    
+    start = ktime_get_ns();
+    len   = LZ4_decompress_safe(pos, lz4->rd_dst, size, CHDEV_LZ4_MAX);
+    chdev_stat_add(dev, decompress_ns, ktime_get_ns() - start);
+    
+    if (len != item_len) {
+        return -EIO;    /* buffer was corrupted through mmap */
+    }
+    return copy_to_iter(lz4->rd_dst, item_len, to) == item_len ? item_len : -EFAULT;
+}
+
+/*
+ * Copy the item at pos with the header checked by chdev_check_item(...) to the iterator, preceded by its length
+ * and residence time as flags tell. The header is followed by the enqueue time of a stamped item and seq_len bytes
+ * of the sequence number. Returns length of the item as it was written.
+ */
+static ssize_t chdev_item_to_iter(struct chdev_dev *dev, struct chdev_ring *ring, struct iov_iter *to, char *pos,
+                                  u32 header, size_t seq_len, uint flags, u64 residence) {
+    size_t           stamps   = chdev_item_ts_len(header) + seq_len;
+    u32              size     = chdev_item_size(header) - stamps;   /* bytes after the header and stamps */
+    char             *payload = pos + sizeof(u32) + stamps;
+    u32              item_len = size;                               /* length of the item as written */
+    uint             frame_len;                                     /* length prefix of a framed item */
+    
+    /* compressed item starts with its original length */
+    if (header & CHDEV_ITEM_LZ4) {
+        memcpy((char *)&item_len, payload, sizeof(u32));
+        if (item_len > CHDEV_LZ4_MAX) {
+            return -EIO;    /* buffer was corrupted through mmap */
+        }
+    }
+    
+    /* case: input buffer is smaller than item length */
+    if ((size_t)item_len + chdev_prefix_len(flags) > iov_iter_count(to)) {
+        trace_chdev_reject(MINOR(dev->cdev.dev), false, item_len, chdev_ring_used(ring), -ENOMEM);
+        return -ENOMEM;
+    }
+    
+    /* copy length prefix, residence time and item to user */
+    frame_len = item_len;
+    if ((flags & CHDEV_FLAG_FRAMED) && copy_to_iter((char *)&frame_len, sizeof(uint), to) != sizeof(uint)) {
+        return -EFAULT;
+    }
+    if ((flags & CHDEV_FLAG_RESIDENCE) && copy_to_iter((char *)&residence, sizeof(u64), to) != sizeof(u64)) {
+        return -EFAULT;
+    }
+    if (header & CHDEV_ITEM_LZ4) {
+        return chdev_lz4_to_iter(dev, to, payload + sizeof(u32), size - sizeof(u32), item_len);
+    }
+    return copy_to_iter(payload, item_len, to) == item_len ? item_len : -EFAULT;
+}
+
+/*
+ * Implementation of common part of read functions for a single ring.
+ * Item is dropped without copying if to is NULL. Returns number of bytes copied to the iterator.
+ */
+static ssize_t chdev_read_item(struct chdev_dev *dev, struct chdev_ring *ring, struct iov_iter *to, uint flags) {
+    u32              header;
+    u32              size;                             /* bytes taken by current item after its header */
+    ssize_t          item_len;                         /* length of current item as written */
+    size_t           seq_len  = ring == &dev->ring ? 0 : chdev_seq_len(dev); /* bytes of its sequence number */
+    u64              residence = 0;                    /* time the item spent in the buffer, if it is stamped */
+    int              padded;                           /* item follows padding, or the item is corrupted */
+    size_t           rd_bytes;                         /* position before the item and its padding */
+    
+    if (!ring || smp_load_acquire(&ring->wr_item) == ring->rd_item) {
+        chdev_stat_inc(dev, empty);
+        return 0; /* there is nothing to read from buffer */
+    }
+    
+    /* skip the rest of the buffer if it was padded */
+    rd_bytes = ring->rd_bytes;
+    padded   = chdev_skip_pad(ring, &header);
+    if (padded < 0 || chdev_item_size(header) < chdev_item_ts_len(header) + seq_len) {
+        return -EIO;
+    }
+    
+    /* read item length, copy the item to user */
+    size = chdev_item_size(header);
+    if (header & CHDEV_ITEM_TS) {
+        residence = chdev_residence(ring->beg);
+    }
+    item_len = to ? chdev_item_to_iter(dev, ring, to, ring->beg, header, seq_len, flags, residence) :
+                    size - chdev_item_ts_len(header) - seq_len;
+    if (item_len < 0) {
+        return item_len;
+    }
+    if (header & CHDEV_ITEM_TS) {
+        chdev_hist_add(dev, residence);
+    }
+    
+    if (trace_chdev_dequeue_enabled()) {
+        trace_chdev_dequeue(MINOR(dev->cdev.dev), item_len, chdev_ring_used(ring) - chdev_record_len(size),
+                            chdev_ring_num_item(ring) - 1, padded ? CHDEV_TRACE_PAD : CHDEV_TRACE_FLAT);
+    }
+    
+    /* update ring state, the whole record was read from buffer */
+    chdev_retire_item(ring, size);
+    chdev_stat_inc(dev, dequeued);
+    chdev_stat_add(dev, bytes_out, item_len);
+    
+    chdev_sync_ctrl_consumer(ring);
+    if (rcu_access_pointer(dev->notifier)) {
+        chdev_notify_read(dev, chdev_free_space(ring), ring->rd_bytes - rd_bytes);
+    }
+    if (wq_has_sleeper(&dev->outq)) {
+        wake_up_interruptible(&dev->outq); /* awake any writer, there is free space now */
+    }
+    
+    return item_len + (to ? chdev_prefix_len(flags) : 0);
+}
+
+/*
+ * Implementation of common part of read functions.
+ * With CHDEV_FLAG_FRAMED and CHDEV_FLAG_RESIDENCE in flags the item is preceded by its length
+ * and residence time (see chdev_common.h).
+ */
+ssize_t chdev_read_common(struct chdev_dev *dev, struct iov_iter *to, uint flags) {
+    return chdev_read_class(dev, to, flags, NULL);
+}
+
+/*
+ * Same as chdev_read_common(...), also stores priority class of the item read to prio if it is not NULL.
+ */
+ssize_t chdev_read_class(struct chdev_dev *dev, struct iov_iter *to, uint flags, uint *prio) {
+    struct chdev_ring *ring;
+    
+    if (dev->slots) {
+        if (prio) {
+            *prio = 0;  /* device of slot mode has no priority classes */
+        }
+        return chdev_slot_read(dev, to, flags);
+    }
+    if (dev->peek_filp) {
+        return -EBUSY;  /* head item is being read in place */
+    }
+    chdev_pull_mapped(dev);
+    
+    ring = chdev_read_ring(dev);
+    if (prio) {
+        *prio = (dev->nprio && ring) ? ring - dev->shards : 0;
+    }
+    return chdev_read_item(dev, ring, to, flags);
+}
+
+/*
+ * Make count bytes written after ring->end visible to readers as a new item of len bytes.
+ */
+static void chdev_publish_item(struct chdev_dev *dev, struct chdev_ring *ring, char *end, size_t count, size_t len) {
+    char   *header  = ring->end;    /* header of the item, unless it follows padding */
+    size_t used;
+    
+    ring->end       = end;
+    ring->wr_bytes += count;
+    smp_store_release(&ring->wr_item, ring->wr_item + 1); /* new item was added to ring->buf */
+    
+    chdev_stat_inc(dev, enqueued);
+    chdev_stat_add(dev, bytes_in, len);
+    used = ring->wr_bytes - READ_ONCE(ring->rd_bytes);
+    if (used > this_cpu_read(dev->stats->high_watermark)) {
+        this_cpu_write(dev->stats->high_watermark, used);
+    }
+    
+    if (trace_chdev_enqueue_enabled()) {
+        trace_chdev_enqueue(MINOR(dev->cdev.dev), len, used, chdev_ring_num_item(ring),
+                            chdev_get_header(header) == CHDEV_ITEM_PAD ? CHDEV_TRACE_PAD : CHDEV_TRACE_FLAT);
+    }
+    
+    chdev_sync_ctrl_producer(ring);
+    if (rcu_access_pointer(dev->notifier)) {
+        chdev_notify_write(dev, count);
+    }
+    if (wq_has_sleeper(&dev->inq)) {
+        wake_up_interruptible(&dev->inq);  /* awake any reader, there is an item now */
+    }
+}
+
+/*
+ * Implementation of common part of write functions for an item which may be compressed.
+ * Compressed item is stored as its original length followed by LZ4 data.
+ */
+static ssize_t chdev_write_lz4(struct chdev_dev *dev, struct chdev_ring *ring, struct iov_iter *from, size_t count,
+                               size_t ts_len) {
+    struct chdev_lz4 *lz4     = dev->lz4;
+    u32              item_len = count;      /* length of input data */
+    size_t           size     = count;      /* bytes taken by the item after its header and enqueue time */
+    u32              flags    = ts_len ? CHDEV_ITEM_TS : 0;
+    char             *header;
+    char             *payload;
+    size_t           len;                   /* bytes taken by the record */
+    size_t           pad;                   /* bytes taken by padding before the record */
+    u64              start;
+    int              clen;                  /* length of LZ4 data */
+    int              err;
+    
+    if (copy_from_iter(lz4->wr_src, count, from) != count) {
+        return -EFAULT;
+    }
+    
+    start = ktime_get_ns();
+    clen  = LZ4_compress_default(lz4->wr_src, lz4->wr_dst, count, LZ4_COMPRESSBOUND(CHDEV_LZ4_MAX), lz4->wrkmem);
+    chdev_stat_add(dev, compress_ns, ktime_get_ns() - start);
+    
+    /* item which does not get smaller is stored as is */
+    if (clen > 0 && clen + sizeof(u32) < count) {
+        size   = clen + sizeof(u32);
+        flags |= CHDEV_ITEM_LZ4;
+    }
+    
+    len = chdev_record_len(ts_len + size);
+    pad = chdev_pad_len(ring, len);
+    if (!(err = chdev_evict(dev, ring, pad + len)) && pad + len > chdev_free_space(ring)) {
+        chdev_stat_inc(dev, full);
+        trace_chdev_reject(MINOR(dev->cdev.dev), true, count, chdev_ring_used(ring), -ENOMEM);
+        err = -ENOMEM;  /* item length is greater than free space in the buffer */
+    }
+    if (err) {
+        iov_iter_revert(from, count);   /* input was taken to be compressed, the item is not written */
+        return err;
+    }
+    
+    header  = chdev_place_item(ring, pad);
+    payload = header + sizeof(u32) + ts_len;
+    chdev_put_header(header, flags | (ts_len + size));
+    if (flags & CHDEV_ITEM_LZ4) {
+        memcpy(payload, (char *)&item_len, sizeof(u32));
+        memcpy(payload + sizeof(u32), lz4->wr_dst, clen);
+        chdev_stat_inc(dev, compressed);
+        chdev_stat_add(dev, compress_in, count);
+        chdev_stat_add(dev, compress_out, size);
+    }
+    else {
+        memcpy(payload, lz4->wr_src, count);
+    }
+    if (ts_len) {
+        chdev_stamp(header);
+    }
+    
+    /* update ring state */
+    chdev_publish_item(dev, ring, chdev_advance(ring, header, len), pad + len, count);
+    
+    return item_len;
+}
 
 /*
- * Implementation of common part of read functions.
+ * Implementation of common part of write functions for a single ring.
  */
-ssize_t chdev_read_common(struct chdev_dev *dev, char __user *buf, size_t count) {
-    size_t           used_space = dev->buf_size;       /* occupied space in a dev circular buffer */
-    short            item_len = 0;                     /* length of current item in dev->buf, initially equals 0 */
+static ssize_t chdev_write_item(struct chdev_dev *dev, struct chdev_ring *ring, struct iov_iter *from, size_t count) {
+    u32              item_len   = count;                                        /* length of input data */
+    uint             mode       = smp_load_acquire(&dev->mode);
+    size_t           ts_len     = (mode & CHDEV_MODE_TIMESTAMP) ? sizeof(u64) : 0; /* bytes of its enqueue time */
+    size_t           seq_len    = ring == &dev->ring ? 0 : chdev_seq_len(dev);  /* bytes of its sequence number */
+    size_t           size       = ts_len + seq_len + count;                     /* bytes taken after its header */
+    size_t           len        = chdev_record_len(size);                       /* bytes taken by the record */
+    char             *header;                                                   /* position of item header */
+    size_t           pad;                                                       /* bytes taken by padding before the record */
+    u64              seq;
+    int              err;
     
-    if (dev->num_item == 0) {
-        return 0; /* there is nothing to read from buffer */
+    /* mode is changed under dev->sem, but the producer of SPSC mode does not take it */
+    if ((mode & CHDEV_MODE_COMPRESS) && count >= dev->compress_min && count <= CHDEV_LZ4_MAX) {
+        return chdev_write_lz4(dev, ring, from, count, ts_len);
     }
     
-    /* calculation of used space in a buffer, and reading data */   
-    #define USED_SPACE                       (dev->end - dev->beg)
-    #define USED_SPACE_INV                   (dev->buf_size - (dev->end - dev->beg))
-    #define USED_SPACE_UPSIDE                (dev->end - dev->buf)
-    #define USED_SPACE_DOWNSIDE              (dev->buf + dev->buf_size - dev->beg)
+    pad = chdev_pad_len(ring, len);
+    if ((err = chdev_evict(dev, ring, pad + len))) {
+        return err;
+    }
     
-    used_space = dev->inv ? USED_SPACE_INV : USED_SPACE;  
+    if (pad + len > chdev_free_space(ring)) {
+        chdev_stat_inc(dev, full);
+        trace_chdev_reject(MINOR(dev->cdev.dev), true, count, chdev_ring_used(ring), -ENOMEM);
+        return -ENOMEM; /* item length is greater than free space in the buffer */
+    }
     
-    /* determine the way of storing data in the buffer (depends on dev->inv value) */ 
-    if (dev->inv) {  
-        if (USED_SPACE_DOWNSIDE <= sizeof(short)) {
-            /* read item length */
-            memcpy((char *)&item_len, dev->beg, USED_SPACE_DOWNSIDE); /* bytes downside the buffer */
-            memcpy(((char *)&item_len) + USED_SPACE_DOWNSIDE, dev->buf, sizeof(short) - USED_SPACE_DOWNSIDE); /* bytes upside the buffer */
-            
-            /* case: input buffer is smaller than item length */
-            if ((size_t)item_len > count) {
-                return -ENOMEM;
-            }
-            
-            /* copy item to user */
-            if (copy_to_user(buf, dev->buf + sizeof(short) - USED_SPACE_DOWNSIDE, item_len)) {               
-                return -EFAULT;
-            }
-            
-            /* update dev state */
-            dev->beg = dev->buf + sizeof(short) - USED_SPACE_DOWNSIDE + item_len; /* item_len + sizeof(short) bytes were totally read from buffer */
-            dev->inv = false; /* dev->beg and dev->end are not inversed now */                   
-        } 
-        else {
-            /* read item length */
-            memcpy((char *)&item_len, dev->beg, sizeof(short));
-            
-            /* case: input buffer is smaller than item length */
-            if ((size_t)item_len > count) {
-                return -ENOMEM;
-            }
-            
-            if (USED_SPACE_DOWNSIDE > (item_len + sizeof(short))) {
-                /* copy item to user */
-                if (copy_to_user(buf, dev->beg + sizeof(short), item_len)) {                           
-                    return -EFAULT;
-                }
-                
-                /* update dev state */
-                dev->beg += (size_t)item_len + sizeof(short); /* item_len + sizeof(short) bytes were totally read from buffer */
-                /* dev->beg and dev->end are still inversed */ 
+    /* write item length, after padding if the record does not fit downside the buffer */
+    header = chdev_place_item(ring, pad);
+    chdev_put_header(header, (ts_len ? CHDEV_ITEM_TS : 0) | (u32)size);
+    
+    /* copy item from user */
+    if (copy_from_iter(header + sizeof(u32) + ts_len + seq_len, count, from) != count) {
+        return -EFAULT;
+    }
+    if (ts_len) {
+        chdev_stamp(header);
+    }
+    
+    /* writers of a shard hold its lock, so sequence numbers of the items of a shard grow */
+    if (seq_len) {
+        seq = atomic64_inc_return(&dev->seq);
+        memcpy(header + sizeof(u32) + ts_len, (char *)&seq, sizeof(u64));
+    }
+    
+    /* update ring state */
+    chdev_publish_item(dev, ring, chdev_advance(ring, header, len), pad + len, count);
+    
+    return item_len;
+}
+
+/*
+ * Implementation of common part of write functions, count bytes of the iterator become a new item
+ * of the priority class. In sharded mode and with priority classes the ring of the item is locked here,
+ * or the write fails with -EAGAIN if it is taken and nowait is set; slot mode needs no lock, otherwise
+ * the caller serializes writers.
+ */
+ssize_t chdev_write_common(struct chdev_dev *dev, struct iov_iter *from, size_t count, uint prio, bool nowait) {
+    struct chdev_ring *ring = chdev_write_ring(dev, prio);
+    ssize_t          retval;
+    
+    if (count > CHDEV_ITEM_MAX) {
+        return -EINVAL; /* item length does not fit into the item header */
+    }
+    if (count > chdev_item_max(dev)) {
+        return -ENOMEM; /* item never fits into the buffer */
+    }
+    
+    if (dev->slots) {
+        return chdev_slot_write(dev, from, count);
+    }
+    if (dev->rsv_filp) {
+        return -EBUSY;  /* space after ring->end is reserved for a zero-copy producer */
+    }
+    
+    if (!dev->shards) {
+        chdev_pull_mapped(dev);
+        return chdev_write_item(dev, ring, from, count);
+    }
+    
+    if (nowait && down_trylock(&ring->sem)) {
+        chdev_stat_inc(dev, contended);
+        return -EAGAIN;
+    }
+    if (!nowait && (retval = chdev_lock(dev, &ring->sem))) {
+        return retval;
+    }
+    retval = chdev_write_item(dev, ring, from, count);
+    up(&ring->sem);
+    
+    return retval;
+}
+
+/*
+ * Reserve contiguous space for an item of count bytes which will be written in place through mmap.
+ * Item header (and padding, if the record does not fit downside the buffer) is written immediately,
+ * but the item becomes visible to readers only after chdev_commit_common(...).
+ * Returns pointer to the item payload inside dev->ring.buf. Not available in sharded mode.
+ */
+char *chdev_reserve_common(struct chdev_dev *dev, size_t count) {
+    struct chdev_ring *ring   = &dev->ring;
+    char             *header;                                           /* position of item header */
+    size_t           ts_len   = (dev->mode & CHDEV_MODE_TIMESTAMP) ? sizeof(u64) : 0;
+    size_t           size     = ts_len + count;                         /* bytes taken after the header */
+    size_t           len      = chdev_record_len(size);                 /* bytes taken by the record */
+    size_t           pad;                                               /* bytes skipped by padding */
+    int              err;
+    
+    if (count > CHDEV_ITEM_MAX) {
+        return ERR_PTR(-EINVAL);
+    }
+    if (count > chdev_item_max(dev)) {
+        return ERR_PTR(-ENOMEM);
+    }
+    
+    pad = chdev_pad_len(ring, len);
+    if ((err = chdev_evict(dev, ring, pad + len))) {
+        return ERR_PTR(err);
+    }
+    
+    if (pad + len > chdev_free_space(ring)) {
+        chdev_stat_inc(dev, full);
+        trace_chdev_reject(MINOR(dev->cdev.dev), true, count, chdev_ring_used(ring), -ENOMEM);
+        return ERR_PTR(-ENOMEM);
+    }
+    
+    header = chdev_place_item(ring, pad);
+    chdev_put_header(header, (ts_len ? CHDEV_ITEM_TS : 0) | (u32)size);
+    
+    ring->rsv_end   = chdev_advance(ring, header, len);
+    ring->rsv_bytes = pad + len;
+    ring->rsv_len   = count;
+    ring->rsv_ts    = ts_len ? header : NULL;
+    
+    return header + sizeof(u32) + ts_len;
+}
+
+/*
+ * Make the item reserved by chdev_reserve_common(...) visible to readers, stamped when it is committed.
+ */
+void chdev_commit_common(struct chdev_dev *dev) {
+    if (dev->ring.rsv_ts) {
+        chdev_stamp(dev->ring.rsv_ts);
+    }
+    chdev_publish_item(dev, &dev->ring, dev->ring.rsv_end, dev->ring.rsv_bytes, dev->ring.rsv_len);
+}
+
+/*
+ * Find the oldest item without removing it from the buffer.
+ * Returns pointer to the item payload inside dev->ring.buf, NULL if the buffer is empty, or ERR_PTR(-EIO)
+ * if its header was corrupted (see chdev_check_item(...)). Not available in sharded mode.
+ */
+char *chdev_peek_common(struct chdev_dev *dev, size_t *count) {
+    struct chdev_ring *ring = &dev->ring;
+    u32              header;
+    
+    if (smp_load_acquire(&ring->wr_item) == ring->rd_item) {
+        return NULL;
+    }
+    
+    /* skip the rest of the buffer if it was padded */
+    if (chdev_skip_pad(ring, &header) < 0) {
+        return ERR_PTR(-EIO);
+    }
+    if (header & CHDEV_ITEM_LZ4) {
+        return ERR_PTR(-EINVAL);   /* compressed item must be read with read() */
+    }
+    
+    *count = chdev_item_size(header) - chdev_item_ts_len(header);
+    return ring->beg + sizeof(u32) + chdev_item_ts_len(header);
+}
+
+/*
+ * Remove the oldest item from the buffer without copying it.
+ * Returns 0, or -EIO if its header was corrupted.
+ */
+int chdev_drop_common(struct chdev_dev *dev) {
+    ssize_t retval = chdev_read_item(dev, &dev->ring, NULL, 0);
+    
+    return retval < 0 ? (int)retval : 0;
+}
+
+/*
+ * Number of bytes taken by the record written through the mapping at pos, and the padding before it, if they
+ * end within len bytes and the record does not wrap around the end of the buffer; 0 otherwise. Such item has
+ * no flags of the driver, so it is read as it was written. Its length is stored to item_len. The producer may
+ * still rewrite it, so readers check it again (see chdev_check_item(...)).
+ */
+static size_t chdev_mapped_item(struct chdev_ring *ring, char *pos, size_t len, u32 *item_len) {
+    ssize_t pad = chdev_check_item(ring, pos, len, item_len);
+    
+    if (pad < 0 || *item_len > CHDEV_ITEM_MAX) {
+        return 0;
+    }
+    return pad + chdev_record_len(*item_len);
+}
+
+/*
+ * Take the items which the mapped producer published since the previous call, so readers never see
+ * a partial or forged item. Returns -EINVAL if the position runs past the consumer or into an item,
+ * items before it are taken.
+ */
+static int chdev_pull_producer(struct chdev_dev *dev, struct chdev_ring *ring) {
+    size_t len = smp_load_acquire(&ring->ctrl->wr_pos) - ring->wr_bytes;  /* bytes published since the previous call */
+    size_t count;                                                           /* bytes taken by the next item */
+    u32    item_len;
+    
+    if (len > chdev_free_space(ring)) {
+        return -EINVAL;
+    }
+    
+    while (len) {
+        if (!(count = chdev_mapped_item(ring, ring->end, len, &item_len))) {
+            return -EINVAL;
+        }
+        chdev_publish_item(dev, ring, chdev_advance(ring, ring->end, count), count, item_len);
+        len -= count;
+    }
+    return 0;
+}
+
+/*
+ * Remove the items which the mapped consumer published as read since the previous call. Returns -EINVAL
+ * if the position runs past the producer or into an item, or -EIO if the buffer was corrupted; items before
+ * it are removed.
+ */
+static int chdev_pull_consumer(struct chdev_dev *dev, struct chdev_ring *ring) {
+    size_t  len = smp_load_acquire(&ring->ctrl->rd_pos) - ring->rd_bytes;  /* bytes published since the previous call */
+    size_t  rd_bytes;                                                        /* position before the next item */
+    ssize_t count;                                                           /* bytes taken by the next item */
+    u32     header;
+    
+    if (len > chdev_ring_used(ring)) {
+        return -EINVAL;
+    }
+    
+    while (len) {
+        if (chdev_ring_num_item(ring) == 0) {
+            return -EINVAL;
+        }
+        if ((count = chdev_check_item(ring, ring->beg, chdev_ring_used(ring), &header)) < 0) {
+            return count;
+        }
+        count += chdev_record_len(chdev_item_size(header));
+        if (count > len) {
+            return -EINVAL;
+        }
+        rd_bytes = ring->rd_bytes;
+        if (chdev_read_item(dev, ring, NULL, 0) < 0 || ring->rd_bytes - rd_bytes != count) {
+            return -EIO;    /* the item was rewritten meanwhile */
+        }
+        len -= count;
+    }
+    return 0;
+}
+
+/*
+ * Take both positions while both sides of the ring are mapped. Neither side waits for the driver before it
+ * reuses what the other one published, so the driver can not look into the items: it checks the positions
+ * only, and counts the items again when it takes a side back (see chdev_recount(...)).
+ */
+static int chdev_pull_positions(struct chdev_dev *dev, struct chdev_ring *ring) {
+    size_t rd = smp_load_acquire(&ring->ctrl->rd_pos);   /* read first, so it does not run past wr */
+    size_t wr = smp_load_acquire(&ring->ctrl->wr_pos);
+    
+    /* the consumer may have moved on after rd was read, and the producer after it */
+    if (wr - rd > ring->buf_size && (ssize_t)(wr - rd) > 0) {
+        rd = smp_load_acquire(&ring->ctrl->rd_pos);
+        if ((ssize_t)(wr - rd) < 0) {
+            rd = wr;    /* the consumer went through wr, which is the end of an item */
+        }
+    }
+    
+    /* positions may run any number of buffers ahead between calls, but never backwards or past each other */
+    if ((ssize_t)(wr - ring->wr_bytes) < 0 || (ssize_t)(rd - ring->rd_bytes) < 0 || wr - rd > ring->buf_size ||
+        (wr | rd) % CHDEV_ITEM_ALIGN) {
+        return -EINVAL;
+    }
+    
+    if (wr != ring->wr_bytes) {
+        ring->end      = chdev_advance(ring, ring->end, wr - ring->wr_bytes);
+        ring->wr_bytes = wr;
+        if (wq_has_sleeper(&dev->inq)) {
+            wake_up_interruptible(&dev->inq);
+        }
+    }
+    if (rd != ring->rd_bytes) {
+        ring->beg = chdev_advance(ring, ring->beg, rd - ring->rd_bytes);
+        smp_store_release(&ring->rd_bytes, rd);
+        if (wq_has_sleeper(&dev->outq)) {
+            wake_up_interruptible(&dev->outq);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Count the items between the positions of the consumer and the producer when the driver takes a side back
+ * from a ring whose both sides were mapped. The producer position is moved back to the end of the last whole
+ * item, so whatever follows it is never read.
+ */
+static void chdev_recount(struct chdev_ring *ring) {
+    size_t len = ring->wr_bytes - ring->rd_bytes;   /* bytes left to count */
+    char   *pos = ring->beg;
+    size_t count;                                   /* bytes taken by the next item */
+    uint   num_item = 0;
+    u32    item_len;
+    
+    while (len && (count = chdev_mapped_item(ring, pos, len, &item_len))) {
+        pos  = chdev_advance(ring, pos, count);
+        len -= count;
+        ++num_item;
+    }
+    
+    ring->end       = pos;
+    ring->wr_bytes -= len;
+    smp_store_release(&ring->wr_item, ring->rd_item + num_item);
+}
+
+/*
+ * Take the positions which owners of mapped roles published in the control page (see CHDEV_ROLE_MAPPED):
+ * items they wrote become visible to readers and items they read are removed, waiters are awoken.
+ * Returns 0, or -EINVAL if a position was invalid.
+ */
+int chdev_pull_mapped(struct chdev_dev *dev) {
+    struct chdev_ring *ring = &dev->ring;
+    int              err    = 0;
+    
+    if (!READ_ONCE(ring->mapped)) {
+        return 0;
+    }
+    
+    spin_lock(&dev->map_lock);
+    if (ring->mapped == (CHDEV_ROLE_PRODUCER | CHDEV_ROLE_CONSUMER)) {
+        err = chdev_pull_positions(dev, ring);
+    }
+    else if (ring->mapped & CHDEV_ROLE_PRODUCER) {
+        err = chdev_pull_producer(dev, ring);
+    }
+    else if (ring->mapped & CHDEV_ROLE_CONSUMER) {
+        err = chdev_pull_consumer(dev, ring);
+    }
+    spin_unlock(&dev->map_lock);
+    return err;
+}
+
+/*
+ * Hand the position of a side of the ring (CHDEV_ROLE_PRODUCER or CHDEV_ROLE_CONSUMER) over to user space,
+ * or take it back, in which case the position user space published last is taken first. Both sides may be
+ * mapped only while the ring is empty, so it holds nothing but items written through the mapping then.
+ * Returns 0, or -EBUSY if the ring is not empty.
+ */
+int chdev_map_side(struct chdev_dev *dev, uint side, bool mapped) {
+    struct chdev_ring *ring = &dev->ring;
+    int              err    = 0;
+    
+    spin_lock(&dev->map_lock);
+    if (mapped) {
+        /* position of the other mapped side is taken first */
+        if (ring->mapped & ~side) {
+            if ((ring->mapped & CHDEV_ROLE_PRODUCER) ? chdev_pull_producer(dev, ring) : chdev_pull_consumer(dev, ring)) {
+                err = -EBUSY;
             }
-            else {
-                /* copy item to user */
-                if (copy_to_user(buf, dev->beg + sizeof(short), USED_SPACE_DOWNSIDE - sizeof(short))) { 
-                    return -EFAULT;
-                }
-                if (copy_to_user(buf + USED_SPACE_DOWNSIDE - sizeof(short), dev->buf, (size_t)item_len - USED_SPACE_DOWNSIDE + sizeof(short))) {
-                    return -EFAULT;
-                }
-                
-                /* update dev state */
-                dev->beg = dev->buf + (size_t)item_len - USED_SPACE_DOWNSIDE + sizeof(short); /* item_len + sizeof(short) bytes */
-                /* were totally read from buffer  */
-                dev->inv = false;   /* dev->beg and dev-> end are not inversed now */
+            else if (chdev_ring_used(ring)) {
+                err = -EBUSY;
             }
         }
+        if (!err) {
+            WRITE_ONCE(ring->mapped, ring->mapped | side);
+        }
     }
-    else {
-        /* read item length */
-        memcpy((char *)&item_len, dev->beg, sizeof(short));
-        
-        /* case: input buffer is smaller than item length */
-        if ((size_t)item_len > count) {
-            return -ENOMEM;
+    else if (ring->mapped & side) {
+        if (ring->mapped == (CHDEV_ROLE_PRODUCER | CHDEV_ROLE_CONSUMER)) {
+            chdev_pull_positions(dev, ring);
+            chdev_recount(ring);
         }
-        
-        /* copy item to user */
-        if (copy_to_user(buf, dev->beg + sizeof(short), item_len)) { 
-            return -EFAULT;
+        else if (side == CHDEV_ROLE_PRODUCER) {
+            chdev_pull_producer(dev, ring);
+        }
+        else {
+            chdev_pull_consumer(dev, ring);
         }
+        WRITE_ONCE(ring->mapped, ring->mapped & ~side);
         
-        /* update dev state */
-        dev->beg += item_len + sizeof(short);
+        /* position of the driver replaces the one which was not taken */
+        chdev_sync_ctrl_producer(ring);
+        chdev_sync_ctrl_consumer(ring);
+    }
+    spin_unlock(&dev->map_lock);
+    return err;
+}
+
+/*
+ * Sequence number of the item which will be written to the ring next.
+ */
+static u64 chdev_ring_head(struct chdev_ring *ring) {
+    return READ_ONCE(ring->rd_seq) + chdev_ring_num_item(ring);
+}
+
+/*
+ * Subscribe the cursor in broadcast mode, it starts from the oldest item in the buffer.
+ */
+static void chdev_cursor_attach(struct chdev_dev *dev, struct chdev_cursor *cursor) {
+    if (list_empty(&cursor->node)) {
+        cursor->pos     = dev->ring.beg;
+        cursor->seq     = dev->ring.rd_seq;
+        cursor->overrun = false;
+        list_add_tail(&cursor->node, &dev->cursors);
+    }
+}
+
+/*
+ * Remove items which were read through every cursor from the ring, in broadcast mode.
+ * Returns 0, or -EIO if the buffer was corrupted (items before the corrupted one are removed).
+ */
+static int chdev_reclaim(struct chdev_dev *dev, struct chdev_ring *ring) {
+    struct chdev_cursor *cursor;
+    u64                 min = chdev_ring_head(ring);  /* sequence number of the slowest cursor */
+    u32                 header;
+    size_t              used = chdev_ring_used(ring);
+    u32                 item_len;
+    int                 err = 0;
+    
+    if (list_empty(&dev->cursors)) {
+        return 0; /* items are kept for the next subscriber */
     }
-    --dev->num_item; /* one item was read from dev->buf */
     
-    /* reset beg and end pointers to default in case num_item == 0 */
-    if (dev->num_item == 0) {
-        dev->beg = dev->buf;
-        dev->end = dev->buf;
-        /* dev->inv is already equals false */
+    list_for_each_entry(cursor, &dev->cursors, node) {
+        if (cursor->seq < min) {
+            min = cursor->seq;
+        }
+    }
+    if (ring->rd_seq == min) {
+        return 0;
     }
     
-    #undef  USED_SPACE
-    #undef  USED_SPACE_INV
-    #undef  USED_SPACE_UPSIDE
-    #undef  USED_SPACE_DOWNSIDE 
+    while (ring->rd_seq < min && (err = chdev_skip_pad(ring, &header)) >= 0) {
+        item_len = chdev_item_size(header);
+        chdev_retire_item(ring, item_len);
+        chdev_stat_inc(dev, dequeued);
+        chdev_stat_add(dev, bytes_out, item_len);
+    }
     
-    return item_len;
+    chdev_sync_ctrl_consumer(ring);
+    if (rcu_access_pointer(dev->notifier)) {
+        chdev_notify_read(dev, chdev_free_space(ring), used - chdev_ring_used(ring));
+    }
+    if (wq_has_sleeper(&dev->outq)) {
+        wake_up_interruptible(&dev->outq); /* awake any writer, there is free space now */
+    }
+    return min(err, 0);
 }
 
+/*
+ * Check if there is an item which can be read through the cursor, in broadcast mode.
+ */
+bool chdev_cursor_can_read(struct chdev_dev *dev, struct chdev_cursor *cursor) {
+    if (list_empty(&cursor->node)) {
+        return chdev_ring_num_item(&dev->ring) > 0;
+    }
+    return READ_ONCE(cursor->overrun) || READ_ONCE(cursor->seq) < chdev_ring_head(&dev->ring);
+}
 
 /*
- * Implementation of common part of write functions.
+ * Implementation of common part of read functions in broadcast mode: the item at the cursor is copied
+ * to the iterator and the cursor moves to the next one. Returns number of bytes copied to the iterator,
+ * or -EPIPE once after items were evicted before the cursor reached them.
  */
-ssize_t chdev_write_common(struct chdev_dev *dev, const char __user *buf, size_t count) {
-    size_t           free_space = 0;            /* free space in a dev circular buffer */
-    short            item_len   = (short)count; /* length of input data */
+ssize_t chdev_cursor_read(struct chdev_dev *dev, struct chdev_cursor *cursor, struct iov_iter *to, uint flags) {
+    struct chdev_ring *ring    = &dev->ring;
+    char             *pos;                             /* header of the item */
+    u32              header;
+    u32              size;                             /* bytes taken by the item after its header */
+    ssize_t          item_len;                         /* length of the item as written */
+    u64              residence = 0;                    /* time the item spent in the buffer, if it is stamped */
+    ssize_t          pad;                              /* bytes of padding before the item */
+    size_t           used;                             /* bytes from the cursor to the producer */
+    bool             slowest;                          /* no other cursor is behind this one */
+    int              err;
+    
+    chdev_cursor_attach(dev, cursor);
+    
+    if (cursor->overrun) {
+        cursor->overrun = false;
+        return -EPIPE;
+    }
+    if (cursor->seq == chdev_ring_head(ring)) {
+        chdev_stat_inc(dev, empty);
+        return 0; /* there is nothing to read from buffer */
+    }
     
-    /* calculation of a free space in a buffer, and writing data */
-    #define FREE_SPACE                       (dev->buf_size - (dev->end - dev->beg))
-    #define FREE_SPACE_INV                   (dev->beg - dev->end)
-    #define FREE_SPACE_UPSIDE                (dev->beg - dev->buf)
-    #define FREE_SPACE_DOWNSIDE              (dev->buf + dev->buf_size - dev->end)
+    /* skip the rest of the buffer if it was padded, the cursor is behind the producer */
+    used = ring->end > cursor->pos ? ring->end - cursor->pos : ring->end - cursor->pos + ring->buf_size;
+    if ((pad = chdev_check_item(ring, cursor->pos, used, &header)) < 0) {
+        return pad;
+    }
+    pos  = chdev_advance(ring, cursor->pos, pad);
+    size = chdev_item_size(header);
+    if (header & CHDEV_ITEM_TS) {
+        residence = chdev_residence(pos);
+    }
+    item_len = chdev_item_to_iter(dev, ring, to, pos, header, 0, flags, residence);
+    if (item_len < 0) {
+        return item_len;
+    }
+    if (header & CHDEV_ITEM_TS) {
+        chdev_hist_add(dev, residence);
+    }
     
-    free_space = dev->inv ? FREE_SPACE_INV : FREE_SPACE;
+    if (trace_chdev_dequeue_enabled()) {
+        trace_chdev_dequeue(MINOR(dev->cdev.dev), item_len, chdev_ring_used(ring),
+                            chdev_ring_head(ring) - cursor->seq - 1, pos != cursor->pos ? CHDEV_TRACE_PAD : CHDEV_TRACE_FLAT);
+    }
     
-    if (count + sizeof(short) > free_space) {
-        return -ENOMEM; /* item length is greater than free space in the buffer */
+    /* move the cursor, the item is removed once the slowest cursor has passed it */
+    slowest     = (cursor->seq == ring->rd_seq);
+    cursor->pos = chdev_advance(ring, pos, chdev_record_len(size));
+    ++cursor->seq;
+    if (slowest && (err = chdev_reclaim(dev, ring))) {
+        return err;
     }
     
-    /* determine the way of storing data in the buffer (depends on dev->inv value) */    
-    if (dev->inv) {
-        /* write item length */
-        memcpy(dev->end, (const char *)&item_len, sizeof(short));
-        
-        /* copy item from user */
-        if (copy_from_user(dev->end + sizeof(short), buf, count)) {
-            return -EFAULT;
+    return item_len + chdev_prefix_len(flags);
+}
+
+/*
+ * Unsubscribe the cursor, items which only it has not read yet are removed.
+ */
+void chdev_cursor_detach(struct chdev_dev *dev, struct chdev_cursor *cursor) {
+    if (!list_empty(&cursor->node)) {
+        list_del_init(&cursor->node);
+        chdev_reclaim(dev, &dev->ring);
+    }
+    cursor->overrun = false;
+}
+
+/*
+ * Copy all items of the ring to dst as they are stored, oldest first: each one is its header followed by
+ * the payload, padding and alignment are skipped. The ring is not changed, the caller holds the locks of both
+ * sides and dst has room for buf_size bytes. Every header is checked against the bytes of the ring left
+ * (see chdev_check_item(...)), so at most the used bytes are copied. Returns number of bytes copied, or -EIO
+ * if the buffer was corrupted; number of items in *num_item.
+ */
+ssize_t chdev_snapshot(struct chdev_dev *dev, char *dst, uint *num_item) {
+    struct chdev_ring *ring = &dev->ring;
+    char             *pos  = ring->beg;                 /* header of the current item */
+    size_t           used  = chdev_ring_used(ring);     /* bytes of the ring left */
+    size_t           len   = 0;                         /* bytes copied to dst */
+    ssize_t          pad;                               /* bytes of padding before the item */
+    u32              header, size;
+    uint             i;
+    
+    *num_item = chdev_ring_num_item(ring);
+    for (i = 0; i < *num_item; i++) {
+        if ((pad = chdev_check_item(ring, pos, used, &header)) < 0) {
+            return pad;
         }
-        
-        /* update dev state */
-        dev->end += count + sizeof(short); /* update end of buffer position */
+        pos  = chdev_advance(ring, pos, pad);
+        size = chdev_item_size(header);
+        memcpy(dst + len, (char *)&header, sizeof(u32));
+        memcpy(dst + len + sizeof(u32), pos + sizeof(u32), size);
+        len  += sizeof(u32) + size;
+        used -= pad + chdev_record_len(size);
+        pos   = chdev_advance(ring, pos, chdev_record_len(size));
     }
-    else {
-        if (count + sizeof(short) <= FREE_SPACE_DOWNSIDE) {
-            /* write item length */
-            memcpy(dev->end, (const char *)&item_len, sizeof(short)); 
-            
-            /* copy item from user */            
-            if (copy_from_user(dev->end + sizeof(short), buf, count)) {
+    return len;
+}
+
+/*
+ * Copy items taken by chdev_snapshot(...) to the iterator, every one preceded by its length as uint.
+ * Compressed items are decompressed through scratch of CHDEV_LZ4_MAX bytes and enqueue times of stamped
+ * items are skipped; runs of other items are already framed and copied at once. Copying stops at the first
+ * item which does not fit. Returns number of bytes copied to the iterator, or -EIO if an item runs past len
+ * bytes of src; number of copied items in *num_item.
+ */
+ssize_t chdev_snapshot_to_iter(struct chdev_dev *dev, const char *src, size_t len, struct iov_iter *to,
+                               char *scratch, uint *num_item) {
+    const char       *run   = src;  /* beginning of the run of raw items not copied yet */
+    const char       *pos   = src;  /* header of the current item */
+    size_t           room   = iov_iter_count(to);
+    size_t           copied = 0;
+    const char       *payload;      /* item after its header and enqueue time */
+    u32              header, size;
+    u32              orig_len;      /* length of a compressed item as written */
+    int              item_len;      /* length of the decompressed item */
+    
+    *num_item = 0;
+    while (pos < src + len) {
+        if ((size_t)(src + len - pos) < sizeof(u32)) {
+            return -EIO;
+        }
+        memcpy(&header, pos, sizeof(u32));
+        size = chdev_item_size(header);
+        if (size > (size_t)(src + len - pos) - sizeof(u32) ||
+            size < chdev_item_ts_len(header) + ((header & CHDEV_ITEM_LZ4) ? sizeof(u32) : 0)) {
+            return -EIO;    /* item runs past the copied bytes, or has no room for its stamp or length */
+        }
+        
+        if (header & (CHDEV_ITEM_LZ4 | CHDEV_ITEM_TS)) {
+            /* flush the run, the frame of such an item differs from its header */
+            if (copy_to_iter(run, pos - run, to) != (size_t)(pos - run)) {
                 return -EFAULT;
             }
+            copied += pos - run;
             
-            /* update dev state */
-            dev->end += count + sizeof(short); /* update end of buffer position */
-        }
-        else {
-            if (sizeof(short) >= FREE_SPACE_DOWNSIDE) {
-                /* write item length */
-                memcpy(dev->end, (const char *)&item_len, FREE_SPACE_DOWNSIDE);
-                memcpy(dev->buf, (const char *)&item_len + FREE_SPACE_DOWNSIDE, sizeof(short) - FREE_SPACE_DOWNSIDE);
-                
-                /* copy item from user */ 
-                if (copy_from_user(dev->buf + sizeof(short) - FREE_SPACE_DOWNSIDE, buf, count)) {
-                    return -EFAULT;
-                }
-                
-                /* update dev state */
-                dev->inv = true;                                                     /* positions of dev->beg and dev->end are now inversed */
-                dev->end = dev->buf + sizeof(short) - FREE_SPACE_DOWNSIDE + count;   /* update end of buffer position */
+            payload  = pos + sizeof(u32) + chdev_item_ts_len(header);
+            item_len = size - chdev_item_ts_len(header);
+            orig_len = item_len;
+            if (header & CHDEV_ITEM_LZ4) {
+                memcpy(&orig_len, payload, sizeof(u32));
+                item_len = LZ4_decompress_safe(payload + sizeof(u32), scratch, item_len - sizeof(u32), CHDEV_LZ4_MAX);
+                payload  = scratch;
+            }
+            if (item_len != orig_len) {
+                return -EIO;    /* buffer was corrupted through mmap */
             }
-            else {
-                /* write item length */
-                memcpy(dev->end, (const char *)&item_len, sizeof(short));
-                
-                /* copy item from user */ 
-                if (copy_from_user(dev->end + sizeof(short), buf, FREE_SPACE_DOWNSIDE - sizeof(short))) {
-                    return -EFAULT;
-                }
-                if (copy_from_user(dev->buf, buf + FREE_SPACE_DOWNSIDE - sizeof(short), count - FREE_SPACE_DOWNSIDE + sizeof(short))) {
-                    return -EFAULT;
-                }
-                
-                /* update dev state */
-                dev->inv = true;                            /* data was splitted */
-                dev->end = dev->buf + count - FREE_SPACE;   /* update end of buffer position */           
+            if (copied + item_len + sizeof(uint) > room) {
+                return copied;
+            }
+            if (copy_to_iter((char *)&orig_len, sizeof(uint), to) != sizeof(uint) ||
+                copy_to_iter(payload, item_len, to) != item_len) {
+                return -EFAULT;
             }
+            copied += item_len + sizeof(uint);
+            run     = pos + size + sizeof(u32);
         }
+        else if (copied + (pos - run) + size + sizeof(uint) > room) {
+            break;
+        }
+        pos += size + sizeof(u32);
+        ++*num_item;
+    }
+    
+    if (copy_to_iter(run, pos - run, to) != (size_t)(pos - run)) {
+        return -EFAULT;
     }
-    ++dev->num_item; /* new item was added to dev->buf */        
+    return copied + (pos - run);
+}
+
+/*
+ * Take the semaphore, counting contended acquisitions and interrupted waits.
+ */
+int chdev_lock(struct chdev_dev *dev, struct semaphore *sem) {
+    u64 start;  /* beginning of the wait, only if it is traced */
     
-    #undef  FREE_SPACE
-    #undef  FREE_SPACE_INV
-    #undef  FREE_SPACE_UPSIDE
-    #undef  FREE_SPACE_DOWNSIDE
+    if (!down_trylock(sem)) {
+        trace_chdev_lock(MINOR(dev->cdev.dev), 0, false);
+        return 0;
+    }
     
-    return item_len;
+    chdev_stat_inc(dev, contended);
+    start = trace_chdev_lock_enabled() ? ktime_get_ns() : 0;
+    if (down_interruptible(sem)) {
+        chdev_stat_inc(dev, interrupted);
+        if (trace_chdev_lock_enabled()) {
+            trace_chdev_lock(MINOR(dev->cdev.dev), ktime_get_ns() - start, true);
+        }
+        return -ERESTARTSYS;
+    }
+    if (trace_chdev_lock_enabled()) {
+        trace_chdev_lock(MINOR(dev->cdev.dev), ktime_get_ns() - start, false);
+    }
+    return 0;
+}
+
+/*
+ * Sum per-CPU counters of the device into stats; the result is not an atomic snapshot.
+ */
+void chdev_get_stats(struct chdev_dev *dev, struct chdev_stats *stats) {
+    struct chdev_pcpu_stats *pcpu;
+    int                     cpu;
+    
+    memset(stats, 0, sizeof(struct chdev_stats));
+    stats->version  = CHDEV_STATS_VERSION;
+    stats->size     = sizeof(struct chdev_stats);
+    stats->buf_size = dev->buf_size;
+    stats->num_item = chdev_num_item(dev);
+    
+    for_each_possible_cpu(cpu) {
+        pcpu = per_cpu_ptr(dev->stats, cpu);
+        stats->enqueued    += pcpu->enqueued;
+        stats->dequeued    += pcpu->dequeued;
+        stats->bytes_in    += pcpu->bytes_in;
+        stats->bytes_out   += pcpu->bytes_out;
+        stats->full        += pcpu->full;
+        stats->empty       += pcpu->empty;
+        stats->contended   += pcpu->contended;
+        stats->interrupted += pcpu->interrupted;
+        stats->dropped     += pcpu->dropped;
+        stats->dropped_bytes += pcpu->dropped_bytes;
+        stats->compressed    += pcpu->compressed;
+        stats->compress_in   += pcpu->compress_in;
+        stats->compress_out  += pcpu->compress_out;
+        stats->compress_ns   += pcpu->compress_ns;
+        stats->decompress_ns += pcpu->decompress_ns;
+        if (pcpu->high_watermark > stats->high_watermark) {
+            stats->high_watermark = pcpu->high_watermark;
+        }
+    }
+}
+
+/*
+ * Sum per-CPU histograms of residence times into hist; the result is not an atomic snapshot.
+ */
+void chdev_get_hist(struct chdev_dev *dev, struct chdev_hist *hist) {
+    struct chdev_pcpu_stats *pcpu;
+    int                     cpu;
+    uint                    i;
+    
+    memset(hist, 0, sizeof(struct chdev_hist));
+    for_each_possible_cpu(cpu) {
+        pcpu = per_cpu_ptr(dev->stats, cpu);
+        for (i = 0; i < CHDEV_HIST_BUCKETS; i++) {
+            hist->buckets[i] += pcpu->residence[i];
+            hist->count      += pcpu->residence[i];
+        }
+        hist->sum_ns += pcpu->residence_ns;
+        if (pcpu->residence_max > hist->max_ns) {
+            hist->max_ns = pcpu->residence_max;
+        }
+    }
 }
@@ -0,0 +1,215 @@
+/* 
+ * Copyright (C) 2014 Sergey Morozov
+ * 
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.
+ */
+
+/*
+ * Slot mode: items of at most slots->size bytes are stored in a bounded queue of fixed-size,
+ * cache line aligned slots, position pos of the queue being slot (pos & mask). Every slot carries
+ * a sequence number which tells writers and readers whether the slot is free for position pos
+ * (seq == pos) or holds the item written at it (seq == pos + 1). A writer claims a position by
+ * moving slots->enq with cmpxchg, copies the item and publishes it by storing pos + 1 to seq;
+ * a reader claims it by moving slots->deq and frees the slot for the next lap by storing
+ * pos + mask + 1. So any number of writers and readers work without dev->sem, and only contend
+ * on the cache line of their own side.
+ */
+
+#include <linux/kernel.h>
+#include <linux/cdev.h>
+#include <linux/semaphore.h>
+#include <linux/wait.h>
+#include <linux/uio.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
+#include <asm/uaccess.h>
+
+#include "chdev.h"
+#include "chdev_common.h"
+#include "chdev_trace.h"
+
+/*
+ * Slot of the queue position.
+ */
+static struct chdev_slot *chdev_slot_at(struct chdev_slots *slots, unsigned long pos) {
+    return (struct chdev_slot *)(slots->buf + (pos & slots->mask) * slots->stride);
+}
+
+/*
+ * Number of items in the device at the current time point, including items which are being copied.
+ */
+uint chdev_slot_num_item(struct chdev_dev *dev) {
+    unsigned long deq = READ_ONCE(dev->slots->deq);
+    
+    return READ_ONCE(dev->slots->enq) - deq;
+}
+
+/*
+ * Check if the oldest item is published, so a reader would not find the queue empty.
+ */
+bool chdev_slot_can_read(struct chdev_dev *dev) {
+    unsigned long pos = READ_ONCE(dev->slots->deq);
+    
+    return smp_load_acquire(&chdev_slot_at(dev->slots, pos)->seq) == pos + 1;
+}
+
+/*
+ * Check if the slot of the next position is free, so a writer would not find the queue full.
+ */
+bool chdev_slot_can_write(struct chdev_dev *dev) {
+    unsigned long pos = READ_ONCE(dev->slots->enq);
+    
+    return smp_load_acquire(&chdev_slot_at(dev->slots, pos)->seq) == pos;
+}
+
+/*
+ * Claim the oldest published item for the reader. Returns its slot and position, or NULL if the queue is empty.
+ * Item which does not fit into room bytes after hdr_len is not claimed, its length is stored to len either way.
+ */
+static struct chdev_slot *chdev_slot_claim_read(struct chdev_slots *slots, unsigned long *pos, size_t room, size_t hdr_len, u32 *len) {
+    struct chdev_slot *slot;
+    unsigned long     seq, prev;
+    
+    *pos = READ_ONCE(slots->deq);
+    for (;;) {
+        slot = chdev_slot_at(slots, *pos);
+        seq  = smp_load_acquire(&slot->seq);
+    
+        if (seq == *pos + 1) {
+            *len = READ_ONCE(slot->len);
+            if (*len != CHDEV_SLOT_FAULT && (size_t)*len + hdr_len > room) {
+                return ERR_PTR(-ENOMEM);
+            }
+            prev = cmpxchg(&slots->deq, *pos, *pos + 1);
+            if (prev == *pos) {
+                return slot;
+            }
+            *pos = prev;    /* another reader took the item */
+        }
+        else if ((long)(seq - (*pos + 1)) < 0) {
+            return NULL;    /* the item at pos is not published yet */
+        }
+        else {
+            *pos = READ_ONCE(slots->deq);
+        }
+    }
+}
+
+/*
+ * Implementation of common part of read functions in slot mode. Returns number of bytes copied
+ * to the iterator, or -EAGAIN if there is nothing to read: unlike other modes readers are not
+ * serialized, so another one may take the item after chdev_slot_can_read(...) returned true.
+ */
+ssize_t chdev_slot_read(struct chdev_dev *dev, struct iov_iter *to, uint flags) {
+    struct chdev_slots *slots   = dev->slots;
+    size_t             hdr_len  = (flags & CHDEV_FLAG_FRAMED) ? sizeof(uint) : 0;
+    struct chdev_slot  *slot;
+    unsigned long      pos;
+    uint               frame_len;      /* length prefix of a framed item */
+    u32                len;
+    ssize_t            retval;
+    
+    do {
+        slot = chdev_slot_claim_read(slots, &pos, iov_iter_count(to), hdr_len, &len);
+        if (!slot) {
+            chdev_stat_inc(dev, empty);
+            return -EAGAIN;
+        }
+        if (IS_ERR(slot)) {
+            trace_chdev_reject(MINOR(dev->cdev.dev), false, len, chdev_slot_num_item(dev) * slots->stride, -ENOMEM);
+            return -ENOMEM;
+        }
+    
+        /* copy length prefix and item to user, the slot is freed even if that fails */
+        frame_len = len;
+        retval    = len;
+        if (len != CHDEV_SLOT_FAULT &&
+            ((hdr_len && copy_to_iter((char *)&frame_len, hdr_len, to) != hdr_len) ||
+             copy_to_iter((char *)(slot + 1), len, to) != len)) {
+            retval = -EFAULT;
+        }
+        smp_store_release(&slot->seq, pos + slots->mask + 1);
+    } while (len == CHDEV_SLOT_FAULT);
+    
+    chdev_stat_inc(dev, dequeued);
+    chdev_stat_add(dev, bytes_out, len);
+    if (trace_chdev_dequeue_enabled()) {
+        trace_chdev_dequeue(MINOR(dev->cdev.dev), len, chdev_slot_num_item(dev) * slots->stride,
+                            chdev_slot_num_item(dev), CHDEV_TRACE_FLAT);
+    }
+    
+    if (rcu_access_pointer(dev->notifier)) {
+        chdev_notify_read(dev, (slots->mask + 1 - chdev_slot_num_item(dev)) * slots->stride, slots->stride);
+    }
+    if (wq_has_sleeper(&dev->outq)) {
+        wake_up_interruptible(&dev->outq); /* awake any writer, there is a free slot now */
+    }
+    
+    return retval < 0 ? retval : retval + hdr_len;
+}
+
+/*
+ * Implementation of common part of write functions in slot mode.
+ */
+ssize_t chdev_slot_write(struct chdev_dev *dev, struct iov_iter *from, size_t count) {
+    struct chdev_slots *slots = dev->slots;
+    struct chdev_slot  *slot;
+    unsigned long      pos, seq, prev;
+    u64                used;
+    bool               fault;          /* item was not copied */
+    
+    if (count > slots->size) {
+        return -ENOMEM; /* item never fits into a slot */
+    }
+    
+    pos = READ_ONCE(slots->enq);
+    for (;;) {
+        slot = chdev_slot_at(slots, pos);
+        seq  = smp_load_acquire(&slot->seq);
+    
+        if (seq == pos) {
+            prev = cmpxchg(&slots->enq, pos, pos + 1);
+            if (prev == pos) {
+                break;
+            }
+            pos = prev;     /* another writer took the slot */
+        }
+        else if ((long)(seq - pos) < 0) {
+            chdev_stat_inc(dev, full);
+            trace_chdev_reject(MINOR(dev->cdev.dev), true, count, chdev_slot_num_item(dev) * slots->stride, -ENOMEM);
+            return -ENOMEM; /* the slot still holds the item of the previous lap */
+        }
+        else {
+            pos = READ_ONCE(slots->enq);
+        }
+    }
+    
+    /* the position is taken, so the slot is published even if the copy fails; readers skip it */
+    fault     = copy_from_iter((char *)(slot + 1), count, from) != count;
+    slot->len = fault ? CHDEV_SLOT_FAULT : count;
+    smp_store_release(&slot->seq, pos + 1);
+    if (fault) {
+        return -EFAULT;
+    }
+    
+    chdev_stat_inc(dev, enqueued);
+    chdev_stat_add(dev, bytes_in, count);
+    used = (u64)chdev_slot_num_item(dev) * slots->stride;
+    if (used > this_cpu_read(dev->stats->high_watermark)) {
+        this_cpu_write(dev->stats->high_watermark, used);
+    }
+    if (trace_chdev_enqueue_enabled()) {
+        trace_chdev_enqueue(MINOR(dev->cdev.dev), count, used, chdev_slot_num_item(dev), CHDEV_TRACE_FLAT);
+    }
+    
+    if (rcu_access_pointer(dev->notifier)) {
+        chdev_notify_write(dev, slots->stride);
+    }
+    if (wq_has_sleeper(&dev->inq)) {
+        wake_up_interruptible(&dev->inq);  /* awake any reader, there is an item now */
+    }
+    
+    return count;
+}
@@ -10,11 +10,20 @@
  */
 
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <string.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <errno.h>
+#include <unistd.h>
 
 #include "chdev_common.h"
+#include "libchdev.h"
 
 #define ITEM_SIZE 100
 
@@ -36,7 +45,7 @@ int write_test(string &msg, int &fd) {
     item.buf  = const_cast<char *>(msg.c_str());
     item.size = msg.size() + 1; /* +1 because character with code 0 */
     
-    status = ioctl(fd, CHDEV_IOCTL_SET_ITEM, &item); /* send write request */
+    status = ioctl(fd, CHDEV_IOCTL_SET_ITEM, &item) ? -errno : 0; /* send write request, errors come in errno */
     switch (status) {
         case -ENOMEM:
             cerr << "ERROR: Write request returns -ENOMEM. Occured due to item \"" << msg << "\".";
@@ -63,7 +72,7 @@ int read_test(int &fd) {
         
     item.size = ITEM_SIZE;
     
-    status = ioctl(fd, CHDEV_IOCTL_GET_ITEM, &item); /* send write request */
+    status = ioctl(fd, CHDEV_IOCTL_GET_ITEM, &item) ? -errno : 0; /* send read request, errors come in errno */
     switch (status) {
         case -ENOMEM:
             cerr << "ERROR: Read request returns -ENOMEM.";
@@ -149,6 +158,911 @@ void ioctl_test(int &fd) {
     cout << endl;
 }
 
+void batch_test(int &fd) {
+    struct chdev_item  items[5];            /* item descriptors for batch requests */
+    struct chdev_items vec;                 /* vector of item descriptors */
+    string             msgs[5];             /* messages (items) for chdev */
+    char               bufs[5][ITEM_SIZE];  /* buffers for batch read request */
+    int                status;              /* that is what ioctl returns */
+    
+    cout << "--ioctl(...) batch--" << endl;
+    
+    /* Batch write request for /dev/chdev */
+    for (int i = 0; i < 5; i++) {
+        msgs[i]        = "Batch message #" + to_string(i + 1);
+        items[i].buf   = const_cast<char *>(msgs[i].c_str());
+        items[i].size  = msgs[i].size() + 1; /* +1 because character with code 0 */
+    }
+    vec.items = items;
+    vec.count = 5;
+    
+    status = ioctl(fd, CHDEV_IOCTL_SET_ITEMS, &vec);
+    cout << "WRITE   { " << vec.count << " items";
+    if (status) {
+        cerr << " ERROR: Batch write request failed.";
+    }
+    cout << " }" << endl;
+    
+    number_items_test(fd);
+    
+    /* Batch read request for /dev/chdev */
+    for (int i = 0; i < 5; i++) {
+        items[i].buf  = bufs[i];
+        items[i].size = ITEM_SIZE;
+    }
+    vec.count = 5;
+    
+    status = ioctl(fd, CHDEV_IOCTL_GET_ITEMS, &vec);
+    if (status) {
+        cerr << "ERROR: Batch read request failed." << endl;
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned int i = 0; i < vec.count; i++) {
+        cout << "READ    { ---> " << items[i].buf << " (" << items[i].size << " B) <--- }" << endl;
+    }
+    
+    number_items_test(fd);
+    
+    cout << endl;
+}
+
+void mmap_test(int &fd) {
+    struct chdev_mmap_item item;            /* item in the mapped buffer */
+    struct chdev_ring_ctrl *ctrl;           /* mapped control page */
+    char                   *ring;           /* mapped buffer */
+    unsigned int           buf_size = 0;    /* size of chdev buffer */
+    long                   page = sysconf(_SC_PAGESIZE);
+    string                 msg = "Zero-copy message";
+    
+    cout << "--mmap(...)--" << endl;
+    
+    if (ioctl(fd, CHDEV_IOCTL_GET_BUF_SIZE, &buf_size)) {
+        cerr << "ERROR: Buffer size request failed." << endl;
+        exit(EXIT_FAILURE);
+    }
+    
+    /* only the producer writes the buffer */
+    if (mmap(NULL, buf_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, CHDEV_MMAP_BUF_PGOFF * page) != MAP_FAILED ||
+        errno != EACCES) {
+        cerr << "ERROR: Buffer was mapped writable without the producer role." << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (ioctl(fd, CHDEV_IOCTL_SET_ROLE, CHDEV_ROLE_PRODUCER)) {
+        cerr << "ERROR: Producer role request failed." << endl;
+        exit(EXIT_FAILURE);
+    }
+    ctrl = (struct chdev_ring_ctrl *)mmap(NULL, page, PROT_READ, MAP_SHARED, fd, CHDEV_MMAP_CTRL_PGOFF * page);
+    ring = (char *)mmap(NULL, buf_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, CHDEV_MMAP_BUF_PGOFF * page);
+    if (ctrl == MAP_FAILED || ring == MAP_FAILED) {
+        cerr << "ERROR: mmap(...) failed." << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (ioctl(fd, CHDEV_IOCTL_SET_ROLE, CHDEV_ROLE_NONE) != -1 || errno != EBUSY) {
+        cerr << "ERROR: Producer role was dropped while the buffer is mapped writable." << endl;
+        exit(EXIT_FAILURE);
+    }
+    
+    /* Reserve, write in place and commit */
+    item.size = msg.size() + 1; /* +1 because character with code 0 */
+    if (ioctl(fd, CHDEV_IOCTL_RESERVE, &item)) {
+        cerr << "ERROR: Reserve request failed." << endl;
+        exit(EXIT_FAILURE);
+    }
+    memcpy(ring + item.off, msg.c_str(), item.size);
+    if (ioctl(fd, CHDEV_IOCTL_COMMIT)) {
+        cerr << "ERROR: Commit request failed." << endl;
+        exit(EXIT_FAILURE);
+    }
+    cout << "WRITE   { <--- " << msg << " ---> }" << endl;
+    cout << "NUMITEM { " << ctrl->wr_item - ctrl->rd_item << " }" << endl;
+    
+    /* Peek, read in place and release */
+    if (ioctl(fd, CHDEV_IOCTL_PEEK, &item)) {
+        cerr << "ERROR: Peek request failed." << endl;
+        exit(EXIT_FAILURE);
+    }
+    msg.assign(ring + item.off, item.size - 1);
+    if (ioctl(fd, CHDEV_IOCTL_RELEASE)) {
+        cerr << "ERROR: Release request failed." << endl;
+        exit(EXIT_FAILURE);
+    }
+    cout << "READ    { ---> " << msg << " <--- }" << endl;
+    cout << "NUMITEM { " << ctrl->wr_item - ctrl->rd_item << " }" << endl;
+    
+    munmap(ring, buf_size);
+    munmap(ctrl, page);
+    if (ioctl(fd, CHDEV_IOCTL_SET_ROLE, CHDEV_ROLE_NONE)) {
+        cerr << "ERROR: Role request failed." << endl;
+        exit(EXIT_FAILURE);
+    }
+    
+    cout << endl;
+}
+
+/*
+ * Items move through the mapped buffer, owners of mapped roles publish their positions in the control page
+ * and call the driver only when the buffer is full or empty.
+ */
+void mapped_test() {
+    struct chdev_ring_ctrl *ctrl;           /* mapped control page */
+    char                   *ring;           /* mapped buffer */
+    unsigned int           buf_size = 0;    /* size of chdev buffer */
+    unsigned int           header;          /* header of the item in the buffer */
+    unsigned int           len, pad;        /* aligned record of the item and padding before it */
+    unsigned int           syncs = 0;       /* system calls while items moved */
+    unsigned long long     wr, rd;          /* positions of the producer and the consumer */
+    long                   page = sysconf(_SC_PAGESIZE);
+    int                    producer, consumer;
+    unsigned int           num_item = 0;
+    string                 msg;
+    
+    cout << "--Mapped roles--" << endl;
+    
+    producer = open("/dev/chdev", O_RDWR);
+    consumer = open("/dev/chdev", O_RDWR);
+    if (producer == -1 || consumer == -1) {
+        cerr << "ERROR: /dev/chdev file not found." << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (ioctl(producer, CHDEV_IOCTL_GET_BUF_SIZE, &buf_size)) {
+        cerr << "ERROR: Buffer size request failed." << endl;
+        exit(EXIT_FAILURE);
+    }
+    
+    /* roles are taken first, they allow writable mappings */
+    if (ioctl(producer, CHDEV_IOCTL_SET_ROLE, CHDEV_ROLE_PRODUCER | CHDEV_ROLE_MAPPED) ||
+        ioctl(consumer, CHDEV_IOCTL_SET_ROLE, CHDEV_ROLE_CONSUMER | CHDEV_ROLE_MAPPED)) {
+        cerr << "ERROR: Mapped role request failed." << endl;
+        exit(EXIT_FAILURE);
+    }
+    ctrl = (struct chdev_ring_ctrl *)mmap(NULL, page, PROT_READ | PROT_WRITE, MAP_SHARED, producer, CHDEV_MMAP_CTRL_PGOFF * page);
+    ring = (char *)mmap(NULL, buf_size, PROT_READ | PROT_WRITE, MAP_SHARED, producer, CHDEV_MMAP_BUF_PGOFF * page);
+    if (ctrl == MAP_FAILED || ring == MAP_FAILED) {
+        cerr << "ERROR: mmap(...) failed." << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (write(producer, "item", 4) != -1 || errno != EINVAL) {
+        cerr << "ERROR: Mapped producer wrote by write()." << endl;
+        exit(EXIT_FAILURE);
+    }
+    
+    /* Fill the buffer, then drain it, 1000 items */
+    wr = ctrl->wr_pos;
+    rd = ctrl->rd_pos;
+    for (int i = 0; i < 1000; ) {
+        for (; i < 1000; i++) {
+            msg = "Mapped message #" + to_string(i);
+            header = msg.size();
+            len = (sizeof(header) + header + CHDEV_ITEM_ALIGN - 1) & ~(CHDEV_ITEM_ALIGN - 1);
+            pad = len > buf_size - wr % buf_size ? buf_size - wr % buf_size : 0;
+            if (wr - __atomic_load_n(&ctrl->rd_pos, __ATOMIC_ACQUIRE) + pad + len > buf_size) {
+                break;
+            }
+            if (pad) {
+                memset(ring + wr % buf_size, 0xff, sizeof(header));   /* records never wrap, rest is padded */
+                wr += pad;
+            }
+            memcpy(ring + wr % buf_size, &header, sizeof(header));
+            memcpy(ring + wr % buf_size + sizeof(header), msg.data(), header);
+            wr += len;
+            __atomic_store_n(&ctrl->wr_pos, wr, __ATOMIC_RELEASE);
+        }
+        while (rd != __atomic_load_n(&ctrl->wr_pos, __ATOMIC_ACQUIRE)) {
+            memcpy(&header, ring + rd % buf_size, sizeof(header));
+            if (header == ~0U) {
+                rd += buf_size - rd % buf_size;
+                memcpy(&header, ring, sizeof(header));
+            }
+            msg.assign(ring + rd % buf_size + sizeof(header), header);
+            if (msg != "Mapped message #" + to_string(num_item++)) {
+                cerr << "ERROR: Mapped consumer read a wrong item." << endl;
+                exit(EXIT_FAILURE);
+            }
+            rd += (sizeof(header) + header + CHDEV_ITEM_ALIGN - 1) & ~(CHDEV_ITEM_ALIGN - 1);
+            __atomic_store_n(&ctrl->rd_pos, rd, __ATOMIC_RELEASE);
+        }
+        
+        /* the buffer was full and it is empty now: the driver takes both positions */
+        if (ioctl(consumer, CHDEV_IOCTL_SYNC)) {
+            cerr << "ERROR: Sync request failed." << endl;
+            exit(EXIT_FAILURE);
+        }
+        ++syncs;
+    }
+    cout << "MAPPED  { " << num_item << " items, " << syncs << " system calls }" << endl;
+    
+    /* Item left by the mapped producer is read by read() when the roles are dropped */
+    msg = "Left message";
+    header = msg.size();
+    len = (sizeof(header) + header + CHDEV_ITEM_ALIGN - 1) & ~(CHDEV_ITEM_ALIGN - 1);
+    pad = len > buf_size - wr % buf_size ? buf_size - wr % buf_size : 0;
+    if (pad) {
+        memset(ring + wr % buf_size, 0xff, sizeof(header));
+        wr += pad;
+    }
+    memcpy(ring + wr % buf_size, &header, sizeof(header));
+    memcpy(ring + wr % buf_size + sizeof(header), msg.data(), header);
+    __atomic_store_n(&ctrl->wr_pos, wr + len, __ATOMIC_RELEASE);
+    munmap(ring, buf_size);
+    munmap(ctrl, page);
+    close(producer);
+    close(consumer);
+    
+    consumer = open("/dev/chdev", O_RDONLY);
+    num_item = 0;
+    if (ioctl(consumer, CHDEV_IOCTL_GET_NUM_ITEM, &num_item) || num_item != 1 ||
+        read(consumer, buf, ITEM_SIZE) != (ssize_t)msg.size()) {
+        cerr << "ERROR: Item left by the mapped producer was lost." << endl;
+        exit(EXIT_FAILURE);
+    }
+    cout << "READ    { ---> " << string(buf, msg.size()) << " <--- }" << endl;
+    close(consumer);
+    
+    cout << endl;
+}
+
+void poll_test() {
+    struct pollfd pfd;                  /* descriptor to poll */
+    char          buf[ITEM_SIZE];       /* buffer for read request */
+    string        msg = "Polled message";
+    
+    cout << "--poll(...)--" << endl;
+    
+    pfd.fd     = open("/dev/chdev", O_RDWR | O_NONBLOCK);
+    pfd.events = POLLIN | POLLOUT;
+    if (pfd.fd == -1) {
+        cerr << "ERROR: /dev/chdev file not found." << endl;
+        exit(EXIT_FAILURE);
+    }
+    
+    /* Empty buffer: writable, not readable, read does not block */
+    if (poll(&pfd, 1, 0) != 1 || (pfd.revents & POLLIN) || !(pfd.revents & POLLOUT)) {
+        cerr << "ERROR: Empty buffer is reported as readable or not writable." << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (read(pfd.fd, buf, ITEM_SIZE) != -1 || errno != EAGAIN) {
+        cerr << "ERROR: Non-blocking read from empty buffer does not return EAGAIN." << endl;
+        exit(EXIT_FAILURE);
+    }
+    cout << "EMPTY   { POLLOUT }" << endl;
+    
+    /* One item: readable */
+    if (write(pfd.fd, msg.c_str(), msg.size() + 1) != (ssize_t)msg.size() + 1) {
+        cerr << "ERROR: Write request failed." << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (poll(&pfd, 1, 0) != 1 || !(pfd.revents & POLLIN)) {
+        cerr << "ERROR: Non-empty buffer is not reported as readable." << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (read(pfd.fd, buf, ITEM_SIZE) != (ssize_t)msg.size() + 1) {
+        cerr << "ERROR: Read request failed." << endl;
+        exit(EXIT_FAILURE);
+    }
+    cout << "READY   { POLLIN ---> " << buf << " <--- }" << endl;
+    
+    close(pfd.fd);
+    
+    cout << endl;
+}
+
+void spsc_test() {
+    int    producer, consumer;   /* file descriptors owning SPSC roles */
+    char   buf[ITEM_SIZE];       /* buffer for read request */
+    string msg;                  /* message (item) for chdev */
+    
+    cout << "--SPSC mode--" << endl;
+    
+    producer = open("/dev/chdev", O_WRONLY);
+    consumer = open("/dev/chdev", O_RDONLY);
+    if (producer == -1 || consumer == -1) {
+        cerr << "ERROR: /dev/chdev file not found." << endl;
+        exit(EXIT_FAILURE);
+    }
+    
+    if (ioctl(producer, CHDEV_IOCTL_SET_ROLE, CHDEV_ROLE_PRODUCER) ||
+        ioctl(consumer, CHDEV_IOCTL_SET_ROLE, CHDEV_ROLE_CONSUMER)) {
+        cerr << "ERROR: Role request failed." << endl;
+        exit(EXIT_FAILURE);
+    }
+    
+    for (int i = 1; i <= 3; i++) {
+        msg = "SPSC message #" + to_string(i);
+        if (write(producer, msg.c_str(), msg.size() + 1) != (ssize_t)msg.size() + 1) {
+            cerr << "ERROR: Write request failed." << endl;
+            exit(EXIT_FAILURE);
+        }
+        if (read(consumer, buf, ITEM_SIZE) != (ssize_t)msg.size() + 1) {
+            cerr << "ERROR: Read request failed." << endl;
+            exit(EXIT_FAILURE);
+        }
+        cout << "READ    { ---> " << buf << " <--- }" << endl;
+    }
+    
+    /* roles are dropped on close */
+    close(producer);
+    close(consumer);
+    
+    cout << endl;
+}
+
+/*
+ * Whole content of a /proc file, empty if it cannot be read.
+ */
+string read_proc(const char *path) {
+    ifstream     file(path);
+    stringstream content;
+    
+    content << file.rdbuf();
+    return content.str();
+}
+
+void devices_test(int &fd) {
+    char         buf[ITEM_SIZE];            /* buffer for read requests */
+    string       msg = "Second device message";
+    unsigned int ndevices = 0, num_item = 0, before = 0;
+    int          fd1;                       /* /dev/chdev1 descriptor */
+    
+    cout << "--Devices--" << endl;
+    
+    /* /proc/chdev keeps showing the first device */
+    if (read_proc("/proc/chdev").empty() || read_proc("/proc/chdev") != read_proc("/proc/chdev0")) {
+        cerr << "ERROR: /proc/chdev does not show the first device." << endl;
+        exit(EXIT_FAILURE);
+    }
+    
+    istringstream(read_proc("/sys/module/chdev/parameters/ndevices")) >> ndevices;
+    if (ndevices < 2) {
+        cout << "SKIPPED { load the driver with ndevices=2 to test the second device }" << endl << endl;
+        return;
+    }
+    
+    /* item written to the second device is not seen by the first one */
+    fd1 = open("/dev/chdev1", O_RDWR | O_NONBLOCK);
+    if (fd1 == -1) {
+        cerr << "ERROR: /dev/chdev1 file not found." << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (ioctl(fd, CHDEV_IOCTL_GET_NUM_ITEM, &before) || write(fd1, msg.c_str(), msg.size()) != (ssize_t)msg.size()) {
+        cerr << "ERROR: Write request to /dev/chdev1 failed." << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (ioctl(fd, CHDEV_IOCTL_GET_NUM_ITEM, &num_item) || num_item != before) {
+        cerr << "ERROR: Item written to /dev/chdev1 appeared in /dev/chdev." << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (read_proc("/proc/chdev1").find("Item counter") == string::npos || read_proc("/proc/chdev1") == read_proc("/proc/chdev0")) {
+        cerr << "ERROR: /proc/chdev1 does not show the second device." << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (read(fd1, buf, sizeof(buf)) != (ssize_t)msg.size() || msg.compare(0, msg.size(), buf, msg.size())) {
+        cerr << "ERROR: Read request from /dev/chdev1 returned wrong item." << endl;
+        exit(EXIT_FAILURE);
+    }
+    close(fd1);
+    cout << "/dev/chdev1 { " << msg << " }" << endl;
+    
+    cout << endl;
+}
+
+void splice_test() {
+    int    fd;                   /* framed /dev/chdev descriptor */
+    int    pipefd[2];            /* pipe which receives spliced items */
+    char   buf[ITEM_SIZE];       /* buffer for read from pipe */
+    uint   len;                  /* length prefix of a framed item */
+    string msg;                  /* message (item) for chdev */
+    
+    cout << "--splice(...)--" << endl;
+    
+    fd = open("/dev/chdev", O_RDWR | O_NONBLOCK);
+    if (fd == -1 || pipe(pipefd)) {
+        cerr << "ERROR: /dev/chdev file not found." << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (ioctl(fd, CHDEV_IOCTL_SET_FLAGS, CHDEV_FLAG_FRAMED)) {
+        cerr << "ERROR: Flags request failed." << endl;
+        exit(EXIT_FAILURE);
+    }
+    
+    for (int i = 1; i <= 3; i++) {
+        /* framed write: length prefix followed by the item */
+        msg = "Spliced message #" + to_string(i);
+        len = msg.size() + 1;
+        memcpy(buf, &len, sizeof(uint));
+        memcpy(buf + sizeof(uint), msg.c_str(), len);
+        if (write(fd, buf, sizeof(uint) + len) != (ssize_t)(sizeof(uint) + len)) {
+            cerr << "ERROR: Framed write request failed." << endl;
+            exit(EXIT_FAILURE);
+        }
+        
+        /* item goes to the pipe with its length prefix, without a copy through user space */
+        memset(buf, 0, ITEM_SIZE);
+        if (splice(fd, NULL, pipefd[1], NULL, ITEM_SIZE, 0) != (ssize_t)(sizeof(uint) + len) ||
+            read(pipefd[0], buf, ITEM_SIZE) != (ssize_t)(sizeof(uint) + len) ||
+            memcmp(buf, &len, sizeof(uint)) || strcmp(buf + sizeof(uint), msg.c_str())) {
+            cerr << "ERROR: Splice request failed." << endl;
+            exit(EXIT_FAILURE);
+        }
+        cout << "SPLICED { " << len << " ---> " << buf + sizeof(uint) << " <--- }" << endl;
+    }
+    
+    close(pipefd[0]);
+    close(pipefd[1]);
+    close(fd);
+    
+    cout << endl;
+}
+
+void overwrite_test(int &fd) {
+    struct chdev_stats before, after;   /* statistics around the test */
+    uint               buf_size;        /* size of the device buffer */
+    string             msg = "Overwritten message";
+    
+    cout << "--Overwrite mode--" << endl;
+    
+    before.size = after.size = sizeof(struct chdev_stats);
+    if (ioctl(fd, CHDEV_IOCTL_GET_BUF_SIZE, &buf_size) || ioctl(fd, CHDEV_IOCTL_GET_STATS, &before) ||
+        ioctl(fd, CHDEV_IOCTL_SET_MODE, CHDEV_MODE_OVERWRITE)) {
+        cerr << "ERROR: Mode request failed." << endl;
+        exit(EXIT_FAILURE);
+    }
+    
+    /* twice the buffer: writes never fail, the oldest items are evicted */
+    for (uint i = 0; i < 2 * buf_size / (msg.size() + sizeof(uint)); i++) {
+        if (write(fd, msg.c_str(), msg.size()) != (ssize_t)msg.size()) {
+            cerr << "ERROR: Write request failed in overwrite mode." << endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (ioctl(fd, CHDEV_IOCTL_GET_STATS, &after) || after.dropped == before.dropped) {
+        cerr << "ERROR: No item was evicted." << endl;
+        exit(EXIT_FAILURE);
+    }
+    cout << "DROPPED { " << after.dropped - before.dropped << " items, "
+         << after.dropped_bytes - before.dropped_bytes << " bytes }" << endl;
+    
+    /* drain the buffer and restore the default mode */
+    while (after.num_item--) {
+        item.size = ITEM_SIZE;
+        ioctl(fd, CHDEV_IOCTL_GET_ITEM, &item);
+    }
+    if (ioctl(fd, CHDEV_IOCTL_SET_MODE, 0)) {
+        cerr << "ERROR: Mode request failed." << endl;
+        exit(EXIT_FAILURE);
+    }
+    
+    cout << endl;
+}
+
+void broadcast_test(int &fd) {
+    int                      readers[2];     /* subscribed /dev/chdev descriptors */
+    struct chdev_cursor_info info;           /* cursor of a reader */
+    char                     buf[ITEM_SIZE]; /* buffer for read request */
+    string                   msg;            /* message (item) for chdev */
+    
+    cout << "--Broadcast mode--" << endl;
+    
+    readers[0] = open("/dev/chdev", O_RDONLY | O_NONBLOCK);
+    readers[1] = open("/dev/chdev", O_RDONLY | O_NONBLOCK);
+    if (readers[0] == -1 || readers[1] == -1 || ioctl(fd, CHDEV_IOCTL_SET_MODE, CHDEV_MODE_BROADCAST)) {
+        cerr << "ERROR: Mode request failed." << endl;
+        exit(EXIT_FAILURE);
+    }
+    
+    /* both readers subscribe before anything is written */
+    for (int r = 0; r < 2; r++) {
+        if (read(readers[r], buf, ITEM_SIZE) != -1 || errno != EAGAIN) {
+            cerr << "ERROR: Read from empty device succeeded." << endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    for (int i = 1; i <= 3; i++) {
+        msg = "Broadcast message #" + to_string(i);
+        if (write(fd, msg.c_str(), msg.size() + 1) != (ssize_t)(msg.size() + 1)) {
+            cerr << "ERROR: Write request failed." << endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    /* every reader gets every item */
+    for (int r = 0; r < 2; r++) {
+        for (int i = 1; i <= 3; i++) {
+            msg = "Broadcast message #" + to_string(i);
+            if (read(readers[r], buf, ITEM_SIZE) != (ssize_t)(msg.size() + 1) || strcmp(buf, msg.c_str())) {
+                cerr << "ERROR: Reader " << r << " missed an item." << endl;
+                exit(EXIT_FAILURE);
+            }
+            cout << "READER " << r << " { " << buf << " }" << endl;
+        }
+        if (ioctl(readers[r], CHDEV_IOCTL_GET_CURSOR, &info) || info.num_item != 0 || info.lost != 0) {
+            cerr << "ERROR: Cursor request failed." << endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    close(readers[0]);
+    close(readers[1]);
+    if (ioctl(fd, CHDEV_IOCTL_SET_MODE, 0)) {
+        cerr << "ERROR: Mode request failed." << endl;
+        exit(EXIT_FAILURE);
+    }
+    
+    cout << endl;
+}
+
+void priority_test(int &fd) {
+    struct chdev_prio_item pitem;           /* item with its priority class */
+    char                   buf[ITEM_SIZE];  /* buffer for read request */
+    string                 msg = "Prioritized message";
+    
+    cout << "--Priority classes--" << endl;
+    
+    /* class 0 exists on every device */
+    pitem.buf      = const_cast<char *>(msg.c_str());
+    pitem.size     = msg.size() + 1;
+    pitem.priority = 0;
+    if (ioctl(fd, CHDEV_IOCTL_SET_PRIO_ITEM, &pitem)) {
+        cerr << "ERROR: ioctl(fd, CHDEV_IOCTL_SET_PRIO_ITEM, &pitem) returns non zero." << endl;
+        exit(EXIT_FAILURE);
+    }
+    
+    pitem.buf      = buf;
+    pitem.size     = ITEM_SIZE;
+    pitem.priority = 0xff;
+    if (ioctl(fd, CHDEV_IOCTL_GET_PRIO_ITEM, &pitem) || pitem.priority != 0 || strcmp(buf, msg.c_str())) {
+        cerr << "ERROR: ioctl(fd, CHDEV_IOCTL_GET_PRIO_ITEM, &pitem) returned wrong item." << endl;
+        exit(EXIT_FAILURE);
+    }
+    cout << "CLASS " << (int)pitem.priority << " { " << buf << " }" << endl;
+    
+    /* classes above the highest one are rejected */
+    if (ioctl(fd, CHDEV_IOCTL_SET_PRIORITY, 255) != -1 || errno != EINVAL) {
+        cerr << "ERROR: Priority request for a missing class succeeded." << endl;
+        exit(EXIT_FAILURE);
+    }
+    
+    cout << endl;
+}
+
+void compress_test(int &fd) {
+    struct chdev_stats     before, after;   /* statistics around the test */
+    struct chdev_mmap_item mitem;           /* item read in place */
+    char                   buf[1024];       /* buffer for read request */
+    string                 msg(sizeof(buf), 'c');
+    
+    cout << "--Compression mode--" << endl;
+    
+    before.size = after.size = sizeof(struct chdev_stats);
+    if (ioctl(fd, CHDEV_IOCTL_GET_STATS, &before) || ioctl(fd, CHDEV_IOCTL_SET_MODE, CHDEV_MODE_COMPRESS)) {
+        cerr << "ERROR: Mode request failed." << endl;
+        exit(EXIT_FAILURE);
+    }
+    
+    /* a compressed item can not be read in place, but read() returns it unchanged */
+    if (write(fd, msg.c_str(), msg.size()) != (ssize_t)msg.size()) {
+        cerr << "ERROR: Write request failed in compression mode." << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (ioctl(fd, CHDEV_IOCTL_PEEK, &mitem) != -1 || errno != EINVAL) {
+        cerr << "ERROR: Compressed item was exposed in place." << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (read(fd, buf, sizeof(buf)) != (ssize_t)msg.size() || memcmp(buf, msg.c_str(), msg.size())) {
+        cerr << "ERROR: Read request returned wrong item in compression mode." << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (ioctl(fd, CHDEV_IOCTL_GET_STATS, &after) || after.compressed == before.compressed) {
+        cerr << "ERROR: No item was compressed." << endl;
+        exit(EXIT_FAILURE);
+    }
+    cout << "COMPRESSED { " << after.compress_in - before.compress_in << " bytes to "
+         << after.compress_out - before.compress_out << " bytes }" << endl;
+    
+    if (ioctl(fd, CHDEV_IOCTL_SET_MODE, 0)) {
+        cerr << "ERROR: Mode request failed." << endl;
+        exit(EXIT_FAILURE);
+    }
+    
+    cout << endl;
+}
+
+void snapshot_test(int &fd) {
+    struct chdev_snapshot snap;             /* copy of the buffer */
+    char                  buf[ITEM_SIZE];   /* buffer for snapshot and read requests */
+    uint                  num_item;         /* number of items in the buffer */
+    string                msg = "Snapshot message";
+    
+    cout << "--Snapshot--" << endl;
+    
+    if (write(fd, msg.c_str(), msg.size()) != (ssize_t)msg.size()) {
+        cerr << "ERROR: Write request failed." << endl;
+        exit(EXIT_FAILURE);
+    }
+    
+    /* the item is framed and stays in the buffer */
+    snap.buf  = buf;
+    snap.size = sizeof(buf);
+    if (ioctl(fd, CHDEV_IOCTL_SNAPSHOT, &snap) || ioctl(fd, CHDEV_IOCTL_GET_NUM_ITEM, &num_item) ||
+        snap.num_item != snap.total || num_item != snap.total || snap.size < msg.size() + sizeof(uint)) {
+        cerr << "ERROR: ioctl(fd, CHDEV_IOCTL_SNAPSHOT, &snap) returned wrong items." << endl;
+        exit(EXIT_FAILURE);
+    }
+    cout << "SNAPSHOT { " << snap.num_item << " items, " << snap.size << " bytes }" << endl;
+    
+    /* drain the buffer */
+    while (num_item--) {
+        read(fd, buf, sizeof(buf));
+    }
+    
+    cout << endl;
+}
+
+void node_test(int &fd) {
+    char   buf[ITEM_SIZE];                  /* buffer for read requests */
+    long   page = sysconf(_SC_PAGESIZE);
+    void   *ctrl;                           /* mapped control page */
+    string msg  = "NUMA message";
+    
+    cout << "--NUMA node--" << endl;
+    
+    if (write(fd, msg.c_str(), msg.size()) != (ssize_t)msg.size()) {
+        cerr << "ERROR: Write request failed." << endl;
+        exit(EXIT_FAILURE);
+    }
+    
+    /* mapped buffer stays where it is */
+    ctrl = mmap(NULL, page, PROT_READ, MAP_SHARED, fd, CHDEV_MMAP_CTRL_PGOFF * page);
+    if (ctrl == MAP_FAILED) {
+        cerr << "ERROR: mmap(...) of control page failed." << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (ioctl(fd, CHDEV_IOCTL_SET_NODE, CHDEV_NODE_LOCAL) != -1 || errno != EBUSY) {
+        cerr << "ERROR: ioctl(fd, CHDEV_IOCTL_SET_NODE, ...) moved a mapped buffer." << endl;
+        exit(EXIT_FAILURE);
+    }
+    munmap(ctrl, page);
+    
+    /* the item is moved with the buffer */
+    if (ioctl(fd, CHDEV_IOCTL_SET_NODE, CHDEV_NODE_LOCAL) ||
+        read(fd, buf, sizeof(buf)) != (ssize_t)msg.size() || msg.compare(0, msg.size(), buf, msg.size())) {
+        cerr << "ERROR: Item was not kept when the buffer moved to the local node." << endl;
+        exit(EXIT_FAILURE);
+    }
+    cout << "SET_NODE { local }" << endl;
+    
+    cout << endl;
+}
+
+void nowait_test(int &fd) {
+    char         buf[ITEM_SIZE];            /* buffer for read requests */
+    string       msg = "NOWAIT message";
+    struct iovec iov;
+    
+    cout << "--RWF_NOWAIT--" << endl;
+    
+    /* empty buffer fails instead of blocking, although the file is blocking */
+    iov.iov_base = buf;
+    iov.iov_len  = sizeof(buf);
+    if (preadv2(fd, &iov, 1, -1, RWF_NOWAIT) != -1 || errno != EAGAIN) {
+        cerr << "ERROR: preadv2(..., RWF_NOWAIT) did not fail with EAGAIN on an empty buffer." << endl;
+        exit(EXIT_FAILURE);
+    }
+    
+    iov.iov_base = (void *)msg.c_str();
+    iov.iov_len  = msg.size();
+    if (pwritev2(fd, &iov, 1, -1, RWF_NOWAIT) != (ssize_t)msg.size()) {
+        cerr << "ERROR: pwritev2(..., RWF_NOWAIT) failed." << endl;
+        exit(EXIT_FAILURE);
+    }
+    iov.iov_base = buf;
+    iov.iov_len  = sizeof(buf);
+    if (preadv2(fd, &iov, 1, -1, RWF_NOWAIT) != (ssize_t)msg.size() || msg.compare(0, msg.size(), buf, msg.size())) {
+        cerr << "ERROR: preadv2(..., RWF_NOWAIT) returned wrong item." << endl;
+        exit(EXIT_FAILURE);
+    }
+    cout << "RWF_NOWAIT { " << msg << " }" << endl;
+    
+    cout << endl;
+}
+
+void notify_test(int &fd) {
+    char                buf[ITEM_SIZE];     /* buffer for read requests */
+    struct chdev_notify notify;
+    eventfd_t           signals;
+    int                 efd = eventfd(0, EFD_NONBLOCK);
+    string              msg = "Notify message";
+    
+    cout << "--Notify--" << endl;
+    
+    /* readers are signaled by the second item only */
+    memset(&notify, 0, sizeof(struct chdev_notify));
+    notify.rd_fd    = efd;
+    notify.rd_items = 2;
+    notify.wr_fd    = -1;
+    if (efd < 0 || ioctl(fd, CHDEV_IOCTL_SET_NOTIFY, &notify)) {
+        cerr << "ERROR: ioctl(fd, CHDEV_IOCTL_SET_NOTIFY, &notify) failed." << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (write(fd, msg.c_str(), msg.size()) != (ssize_t)msg.size() || eventfd_read(efd, &signals) != -1 ||
+        write(fd, msg.c_str(), msg.size()) != (ssize_t)msg.size() || eventfd_read(efd, &signals) || signals != 1) {
+        cerr << "ERROR: eventfd was not signaled at the watermark." << endl;
+        exit(EXIT_FAILURE);
+    }
+    cout << "NOTIFY { " << signals << " signal at " << notify.rd_items << " items }" << endl;
+    
+    /* remove the notification and drain the buffer */
+    notify.rd_fd = -1;
+    ioctl(fd, CHDEV_IOCTL_SET_NOTIFY, &notify);
+    close(efd);
+    read(fd, buf, sizeof(buf));
+    read(fd, buf, sizeof(buf));
+    
+    cout << endl;
+}
+
+void residence_test(int &fd) {
+    char               buf[ITEM_SIZE];      /* buffer for read requests */
+    struct chdev_hist  hist;
+    unsigned long long residence;           /* time the item spent in the buffer */
+    string             msg = "Timestamp message";
+    
+    cout << "--Residence time--" << endl;
+    
+    if (ioctl(fd, CHDEV_IOCTL_SET_MODE, CHDEV_MODE_TIMESTAMP) || ioctl(fd, CHDEV_IOCTL_SET_FLAGS, CHDEV_FLAG_RESIDENCE)) {
+        cerr << "ERROR: Mode or flags request failed." << endl;
+        exit(EXIT_FAILURE);
+    }
+    
+    /* the item is preceded by its residence time, which is counted by the histogram */
+    if (write(fd, msg.c_str(), msg.size()) != (ssize_t)msg.size()) {
+        cerr << "ERROR: Write request failed in timestamp mode." << endl;
+        exit(EXIT_FAILURE);
+    }
+    usleep(1000);
+    if (read(fd, buf, sizeof(buf)) != (ssize_t)(msg.size() + sizeof(residence)) ||
+        memcmp(buf + sizeof(residence), msg.c_str(), msg.size())) {
+        cerr << "ERROR: Read request returned wrong item with residence time." << endl;
+        exit(EXIT_FAILURE);
+    }
+    memcpy(&residence, buf, sizeof(residence));
+    if (residence < 1000000 || ioctl(fd, CHDEV_IOCTL_GET_HIST, &hist) || !hist.count || hist.max_ns < residence) {
+        cerr << "ERROR: Residence time was not measured." << endl;
+        exit(EXIT_FAILURE);
+    }
+    cout << "RESIDENCE { " << residence << " ns, " << hist.count << " items in the histogram }" << endl;
+    
+    if (ioctl(fd, CHDEV_IOCTL_SET_FLAGS, 0) || ioctl(fd, CHDEV_IOCTL_SET_MODE, 0)) {
+        cerr << "ERROR: Mode or flags request failed." << endl;
+        exit(EXIT_FAILURE);
+    }
+    
+    cout << endl;
+}
+
+void stream_test(int &fd) {
+    char         records[3 * ITEM_SIZE];    /* framed records to write */
+    char         buf[3 * ITEM_SIZE];        /* buffer for read requests */
+    struct iovec iov[2];
+    size_t       len = 0;                   /* bytes of records */
+    uint         num_item;                  /* number of items in the buffer */
+    string       msgs[3] = { "Stream message #1", "Stream message #2", "Stream message #3" };
+    
+    cout << "--Stream mode--" << endl;
+    
+    for (int i = 0; i < 3; i++) {
+        uint frame_len = msgs[i].size();
+        
+        memcpy(records + len, &frame_len, sizeof(uint));
+        memcpy(records + len + sizeof(uint), msgs[i].c_str(), frame_len);
+        len += sizeof(uint) + frame_len;
+    }
+    if (ioctl(fd, CHDEV_IOCTL_SET_FLAGS, CHDEV_FLAG_STREAM)) {
+        cerr << "ERROR: ioctl(fd, CHDEV_IOCTL_SET_FLAGS, CHDEV_FLAG_STREAM) failed." << endl;
+        exit(EXIT_FAILURE);
+    }
+    
+    /* records split across the vector are written by a single call */
+    iov[0].iov_base = records;
+    iov[0].iov_len  = 10;
+    iov[1].iov_base = records + 10;
+    iov[1].iov_len  = len - 10;
+    if (writev(fd, iov, 2) != (ssize_t)len || ioctl(fd, CHDEV_IOCTL_GET_NUM_ITEM, &num_item) || num_item != 3) {
+        cerr << "ERROR: Stream write did not enqueue all records." << endl;
+        exit(EXIT_FAILURE);
+    }
+    
+    /* a buffer too small for the last record gets the first two, then the last one */
+    if (read(fd, buf, len - 1) != (ssize_t)(len - sizeof(uint) - msgs[2].size()) ||
+        memcmp(buf, records, len - sizeof(uint) - msgs[2].size()) ||
+        read(fd, buf, sizeof(buf)) != (ssize_t)(sizeof(uint) + msgs[2].size()) ||
+        memcmp(buf + sizeof(uint), msgs[2].c_str(), msgs[2].size())) {
+        cerr << "ERROR: Stream read returned wrong records." << endl;
+        exit(EXIT_FAILURE);
+    }
+    cout << "STREAM  { 3 records in 1 write, 2 reads }" << endl;
+    
+    if (ioctl(fd, CHDEV_IOCTL_SET_FLAGS, 0)) {
+        cerr << "ERROR: Flags request failed." << endl;
+        exit(EXIT_FAILURE);
+    }
+    
+    cout << endl;
+}
+
+void library_test() {
+    chdev::Device dev, moved;
+    chdev::Buffer buffer;
+    string        msg = "Library message #";
+    int           received = 0;             /* items passed to the callback */
+    bool          ordered  = true;          /* items came in the order they were pushed */
+    
+    cout << "--Client library--" << endl;
+    
+    if (dev.open("/dev/chdev", O_RDWR | O_NONBLOCK) || dev.set_coalescing(8, 1024)) {
+        cerr << "ERROR: Device of the library was not opened." << endl;
+        exit(EXIT_FAILURE);
+    }
+    moved = std::move(dev);
+    
+    /* ten items go to the driver in two batches */
+    for (int i = 0; i < 10; i++) {
+        string item = msg + to_string(i);
+        
+        if (moved.push(item) != (ssize_t)item.size()) {
+            cerr << "ERROR: Push of the library failed." << endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (moved.flush()) {
+        cerr << "ERROR: Flush of the library failed." << endl;
+        exit(EXIT_FAILURE);
+    }
+    
+    /* the first item to a pooled buffer, the rest by the consumer loop until it times out */
+    if (moved.pop(buffer) != (ssize_t)(msg.size() + 1) || buffer.bytes().str() != msg + "0") {
+        cerr << "ERROR: Pop of the library returned wrong item." << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (moved.consume([&](chdev::Bytes item) {
+            ordered = ordered && item.str() == msg + to_string(++received);
+            return true;
+        }, 10) != -ETIMEDOUT || !ordered || received != 9) {
+        cerr << "ERROR: Consumer loop of the library returned wrong items." << endl;
+        exit(EXIT_FAILURE);
+    }
+    cout << "LIBRARY { " << received + 1 << " items, consumer loop on "
+         << (moved.interface() == chdev::Interface::Poll ? "poll" : "batches") << " }" << endl;
+    
+    cout << endl;
+}
+
+void stats_test(int &fd) {
+    struct chdev_stats stats;   /* device statistics */
+    
+    cout << "--Statistics--" << endl;
+    
+    stats.size = sizeof(struct chdev_stats);
+    if (ioctl(fd, CHDEV_IOCTL_GET_STATS, &stats) || stats.version != CHDEV_STATS_VERSION) {
+        cerr << "ERROR: Statistics request failed." << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (stats.enqueued - stats.dequeued - stats.dropped != stats.num_item || stats.bytes_out > stats.bytes_in) {
+        cerr << "ERROR: Statistics are inconsistent." << endl;
+        exit(EXIT_FAILURE);
+    }
+    cout << "ITEMS   { in " << stats.enqueued << ", out " << stats.dequeued << ", full " << stats.full
+         << ", empty " << stats.empty << " }" << endl;
+    cout << "BYTES   { in " << stats.bytes_in << ", out " << stats.bytes_out
+         << ", high watermark " << stats.high_watermark << " }" << endl;
+    cout << "LOCK    { contended " << stats.contended << ", interrupted " << stats.interrupted << " }" << endl;
+    cout << "DROPPED { items " << stats.dropped << ", bytes " << stats.dropped_bytes << " }" << endl;
+    cout << "LZ4     { items " << stats.compressed << ", in " << stats.compress_in << ", out " << stats.compress_out
+         << ", ns " << stats.compress_ns << "/" << stats.decompress_ns << " }" << endl;
+    
+    cout << endl;
+}
+
 void buffer_test(int &fd) {
     struct chdev_item item;         /* used in read and write requests */
     char              buf[100];     /* buffer for read request */
@@ -231,6 +1145,25 @@ int main() {
     
     /* Tests */
     ioctl_test(fd);
+    batch_test(fd);
+    mmap_test(fd);
+    poll_test();
+    spsc_test();
+    mapped_test();
+    devices_test(fd);
+    splice_test();
+    overwrite_test(fd);
+    broadcast_test(fd);
+    priority_test(fd);
+    compress_test(fd);
+    snapshot_test(fd);
+    node_test(fd);
+    nowait_test(fd);
+    notify_test(fd);
+    residence_test(fd);
+    stream_test(fd);
+    library_test();
+    stats_test(fd);
     //buffer_test(fd);
     
     cout << "ALL TESTS PASSED SUCCESSFULLY" << endl;
@@ -0,0 +1,369 @@
+/* 
+ * Copyright (C) 2014 Sergey Morozov
+ * 
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.
+ */
+
+#include <algorithm>
+#include <utility>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "libchdev.h"
+
+using namespace std;
+
+namespace chdev {
+
+static ssize_t errno_result(ssize_t retval) {
+    return retval >= 0 ? retval : -errno;
+}
+
+char *BufferPool::acquire() {
+    char *buf;
+    
+    if (!spare.empty()) {
+        buf = spare.back();
+        spare.pop_back();
+        return buf;
+    }
+    
+    /* release() never allocates: there is room for every buffer */
+    all.emplace_back(new char[size]);
+    spare.reserve(all.size());
+    return all.back().get();
+}
+
+void BufferPool::release(char *buf) {
+    spare.push_back(buf);
+}
+
+Buffer::Buffer(Buffer &&other) : pool(other.pool), buf(other.buf), len(other.len) {
+    other.pool = NULL;
+    other.buf  = NULL;
+    other.len  = 0;
+}
+
+Buffer &Buffer::operator=(Buffer &&other) {
+    if (this != &other) {
+        reset();
+        swap(pool, other.pool);
+        swap(buf, other.buf);
+        swap(len, other.len);
+    }
+    return *this;
+}
+
+void Buffer::reset() {
+    if (buf) {
+        pool->release(buf);
+    }
+    pool = NULL;
+    buf  = NULL;
+    len  = 0;
+}
+
+Device::Device(Device &&other) : Device() {
+    *this = move(other);
+}
+
+/*
+ * Descriptors of coalesced and received items point to vectors which keep their storage when moved.
+ */
+Device &Device::operator=(Device &&other) {
+    if (this != &other) {
+        close();
+        fd        = other.fd;
+        item_max  = other.item_max;
+        nonblock  = other.nonblock;
+        batches   = other.batches;
+        iface     = other.iface;
+        max_items = other.max_items;
+        max_bytes = other.max_bytes;
+        batch     = move(other.batch);
+        batch_len = other.batch_len;
+        pending   = move(other.pending);
+        submitted = other.submitted;
+        pool      = move(other.pool);
+        rx_buf    = move(other.rx_buf);
+        items     = move(other.items);
+        received  = other.received;
+        delivered = other.delivered;
+        
+        /* moved-from device is closed, and writes every item at once if it is opened again */
+        other.fd        = -1;
+        other.max_items = 0;
+        other.max_bytes = 0;
+        other.pending.clear();
+        other.submitted = other.batch_len = 0;
+        other.received  = other.delivered = 0;
+    }
+    return *this;
+}
+
+/*
+ * Open the device file and choose the interface of consume(...). Returns 0 or -errno.
+ */
+int Device::open(const string &path, int flags) {
+    struct chdev_items probe = { NULL, 0 };     /* batch of no item */
+    uint               size;
+    int                err;
+    
+    close();
+    if ((fd = ::open(path.c_str(), flags)) == -1) {
+        return -errno;
+    }
+    /* a driver without CHDEV_IOCTL_GET_ITEM_MAX takes items as large as its buffer */
+    if (ioctl(fd, CHDEV_IOCTL_GET_ITEM_MAX, &size) && (errno != ENOTTY || ioctl(fd, CHDEV_IOCTL_GET_BUF_SIZE, &size))) {
+        err = -errno;
+        close();
+        return err;
+    }
+    
+    /* a driver without batches does not know the command at all */
+    item_max = size;
+    nonblock = flags & O_NONBLOCK;
+    batches  = !ioctl(fd, CHDEV_IOCTL_GET_ITEMS, &probe) || errno != ENOTTY;
+    iface    = nonblock ? Interface::Poll : batches ? Interface::Batched : Interface::Blocking;
+    
+    /* receive buffers are allocated once: a batch, and room for the largest item */
+    pool.reset(new BufferPool(item_max));
+    rx_buf.resize(CHDEV_LIB_BATCH * min(item_max, (size_t)CHDEV_LIB_ITEM_MAX) + item_max);
+    items.resize(CHDEV_LIB_BATCH);
+    received = delivered = 0;
+    return 0;
+}
+
+/*
+ * Close the file, coalesced items are written first (a blocking file waits for free space for them).
+ */
+void Device::close() {
+    if (fd == -1) {
+        return;
+    }
+    flush();
+    ::close(fd);
+    fd = -1;
+    pending.clear();
+    submitted = batch_len = 0;
+    received  = delivered = 0;
+}
+
+/*
+ * Coalesced items are flushed before the batch is changed. Returns 0 or error of flush().
+ */
+int Device::set_coalescing(uint count, size_t bytes) {
+    int err;
+    
+    if ((err = flush())) {
+        return err;
+    }
+    
+    /* descriptors point to the batch, so it is never reallocated */
+    max_items = count;
+    max_bytes = min(bytes, (size_t)CHDEV_LIB_ITEM_MAX);
+    batch.assign(count ? max_bytes : 0, 0);
+    pending.reserve(count);
+    return 0;
+}
+
+ssize_t Device::write_item(Bytes item) {
+    return errno_result(write(fd, item.data, item.size));
+}
+
+/*
+ * Write the item, or add it to the batch. Items which do not fit into the batch are written at once
+ * after the batch, so the order of items is kept. Returns size of the item or -errno, the item was
+ * not taken in that case.
+ */
+ssize_t Device::push(Bytes item) {
+    int err;
+    
+    if (!max_items || item.size > max_bytes) {
+        if ((err = flush())) {
+            return err;
+        }
+        return write_item(item);
+    }
+    
+    if ((pending.size() == max_items || batch_len + item.size > max_bytes) && (err = flush())) {
+        return err;
+    }
+    
+    memcpy(batch.data() + batch_len, item.data, item.size);
+    pending.push_back(chdev_item());
+    pending.back().buf  = batch.data() + batch_len;
+    pending.back().size = (short)item.size;
+    batch_len += item.size;
+    return item.size;
+}
+
+/*
+ * Write coalesced items by CHDEV_IOCTL_SET_ITEMS. The ioctl does not wait for free space, so on a blocking
+ * file the item which does not fit is written by write(), which does. Items which were not written stay
+ * in the batch. Returns 0, -EAGAIN if a non-blocking file is full, or -errno.
+ */
+int Device::flush() {
+    struct chdev_items vec;
+    ssize_t            retval;
+    
+    while (submitted < pending.size()) {
+        vec.items = pending.data() + submitted;
+        vec.count = pending.size() - submitted;
+        if (ioctl(fd, CHDEV_IOCTL_SET_ITEMS, &vec)) {
+            if (errno != ENOMEM) {
+                return -errno;
+            }
+            vec.count = 0;
+        }
+        submitted += vec.count;
+        
+        if (!vec.count) {
+            if (nonblock) {
+                return -EAGAIN;
+            }
+            if ((retval = write_item(Bytes(pending[submitted].buf, pending[submitted].size))) < 0) {
+                return retval;
+            }
+            ++submitted;
+        }
+    }
+    
+    pending.clear();
+    submitted = batch_len = 0;
+    return 0;
+}
+
+/*
+ * Next item which was received, from the batch of the previous call or from the device. Waits for it only
+ * if wait is true and the file is blocking. Returns size of the item, -EAGAIN if there is none, or -errno.
+ */
+ssize_t Device::next(Bytes &item, bool wait) {
+    struct chdev_items vec;
+    size_t             room = min(item_max, (size_t)CHDEV_LIB_ITEM_MAX);    /* size of a buffer of the batch */
+    char               *large = rx_buf.data() + CHDEV_LIB_BATCH * room;     /* buffer for the largest item */
+    ssize_t            retval;
+    
+    if (delivered < received) {
+        item = Bytes(items[delivered].buf, items[delivered].size);
+        ++delivered;
+        return item.size;
+    }
+    
+    if (batches && !wait) {
+        for (uint i = 0; i < CHDEV_LIB_BATCH; i++) {
+            items[i].buf  = rx_buf.data() + i * room;
+            items[i].size = (short)room;
+        }
+        vec.items = items.data();
+        vec.count = CHDEV_LIB_BATCH;
+        
+        if (!ioctl(fd, CHDEV_IOCTL_GET_ITEMS, &vec)) {
+            if (!vec.count) {
+                return -EAGAIN;
+            }
+            received  = vec.count;
+            delivered = 1;
+            item      = Bytes(items[0].buf, items[0].size);
+            return item.size;
+        }
+        
+        /* only an item larger than a buffer of the batch is read by read() */
+        if (errno != ENOMEM) {
+            return -errno;
+        }
+    }
+    
+    if ((retval = errno_result(read(fd, large, item_max))) >= 0) {
+        item = Bytes(large, retval);
+    }
+    return retval;
+}
+
+/*
+ * Copy the next item to buf. Returns its size, -ENOMEM if it does not fit (it is kept then), or -errno.
+ */
+ssize_t Device::pop(char *buf, size_t size) {
+    const chdev_item *item;
+    
+    if (delivered == received) {
+        return errno_result(read(fd, buf, size));
+    }
+    
+    item = &items[delivered];
+    if ((size_t)item->size > size) {
+        return -ENOMEM;
+    }
+    memcpy(buf, item->buf, item->size);
+    ++delivered;
+    return item->size;
+}
+
+/*
+ * Receive the next item to a buffer of the pool, which fits any item. Returns its size or -errno.
+ */
+ssize_t Device::pop(Buffer &out) {
+    ssize_t retval;
+    
+    out.reset();
+    if (!pool) {
+        return -EBADF;  /* the device was never opened, or it was moved */
+    }
+    out.pool = pool.get();
+    out.buf  = pool->acquire();
+    
+    if ((retval = pop(out.buf, pool->buf_size())) < 0) {
+        out.reset();
+        return retval;
+    }
+    out.len = retval;
+    return retval;
+}
+
+/*
+ * Items are received by batches while there are any; then a blocking file waits in read() for the next one,
+ * and a non-blocking one in poll().
+ */
+int Device::consume(const function<bool(Bytes)> &callback, int timeout_ms) {
+    struct pollfd pfd;
+    Bytes         item;
+    ssize_t       retval;
+    bool          wait = iface == Interface::Blocking;   /* next item is waited for */
+    
+    pfd.fd     = fd;
+    pfd.events = POLLIN;
+    
+    for (;;) {
+        retval = next(item, wait);
+        wait   = iface == Interface::Blocking;
+        
+        if (retval >= 0) {
+            if (!callback(item)) {
+                return 0;
+            }
+            continue;
+        }
+        if (retval != -EAGAIN) {
+            return retval;
+        }
+        
+        /* the device is empty */
+        if (iface == Interface::Batched) {
+            wait = true;
+            continue;
+        }
+        retval = poll(&pfd, 1, timeout_ms);
+        if (retval == 0) {
+            return -ETIMEDOUT;
+        }
+        if (retval < 0) {
+            return -errno;
+        }
+    }
+}
+
+} /* namespace chdev */
@@ -0,0 +1,230 @@
+/* 
+ * Copyright (C) 2014 Sergey Morozov
+ * 
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.
+ * 
+ * Microbenchmarks of the ring engine (src/chdev_shared.c) built in userspace, run them with:
+ *     make engine-bench
+ */
+
+#include <iostream>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+
+extern "C" {
+#include "chdev.h"
+}
+#include "chdev_common.h"
+
+#define BUF_SIZE     (1 << 20)
+#define MIN_TIME_NS  200000000.0   /* every benchmark runs at least 0.2 s */
+#define MPMC_THREADS 4
+
+using namespace std;
+
+int chdev_shim_cpu = 0;
+
+static char item_buf[1 << 16];      /* source of written and destination of read items */
+
+struct chdev_dev *make_dev(size_t size) {
+    struct chdev_dev *dev;
+    
+    if (posix_memalign((void **)&dev, 64, sizeof(struct chdev_dev))) {
+        exit(EXIT_FAILURE);
+    }
+    memset(dev, 0, sizeof(struct chdev_dev));
+    dev->ring.buf      = (char *)calloc(1, size);
+    dev->ring.buf_size = size;
+    dev->ring.beg      = dev->ring.buf;
+    dev->ring.end      = dev->ring.buf;
+    dev->buf_size      = size;
+    INIT_LIST_HEAD(&dev->cursors);
+    dev->stats         = (struct chdev_pcpu_stats *)calloc(1, sizeof(struct chdev_pcpu_stats));
+    return dev;
+}
+
+/*
+ * Device of slot mode for items of the given size, with as many slots as fit into BUF_SIZE.
+ */
+struct chdev_dev *make_slot_dev(size_t size) {
+    struct chdev_dev   *dev   = make_dev(CHDEV_ITEM_ALIGN);
+    struct chdev_slots *slots;
+    unsigned long      count  = 1;
+    
+    if (posix_memalign((void **)&slots, 64, sizeof(struct chdev_slots))) {
+        exit(EXIT_FAILURE);
+    }
+    memset(slots, 0, sizeof(struct chdev_slots));
+    slots->stride = CHDEV_SLOT_STRIDE(size);
+    slots->size   = size;
+    while (count * 2 * slots->stride <= BUF_SIZE) {
+        count *= 2;
+    }
+    slots->mask = count - 1;
+    slots->buf  = (char *)calloc(count, slots->stride);
+    for (unsigned long i = 0; i < count; i++) {
+        ((struct chdev_slot *)(slots->buf + i * slots->stride))->seq = i;
+    }
+    dev->slots = slots;
+    return dev;
+}
+
+void free_dev(struct chdev_dev *dev) {
+    if (dev->slots) {
+        free(dev->slots->buf);
+        free(dev->slots);
+    }
+    free(dev->ring.buf);
+    free(dev->stats);
+    free(dev);
+}
+
+static inline ssize_t write_item(struct chdev_dev *dev, size_t count) {
+    struct iov_iter iter;
+    
+    chdev_shim_iter(&iter, item_buf, count);
+    return chdev_write_common(dev, &iter, count, 0, false);
+}
+
+static inline ssize_t read_item(struct chdev_dev *dev) {
+    struct iov_iter iter;
+    
+    chdev_shim_iter(&iter, item_buf, sizeof(item_buf));
+    return chdev_read_common(dev, &iter, 0);
+}
+
+/*
+ * Run body(dev, size, iterations) with growing number of iterations until it takes MIN_TIME_NS,
+ * then report time and throughput per item in the style of Google Benchmark.
+ */
+template <typename Body>
+void run(const string &name, size_t size, Body body, bool slots = false) {
+    double elapsed = 0;
+    long   iters   = 1000;
+    
+    for (;;) {
+        struct chdev_dev *dev  = slots ? make_slot_dev(size) : make_dev(BUF_SIZE);
+        auto             start = chrono::steady_clock::now();
+        
+        body(dev, size, iters);
+        elapsed = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+        free_dev(dev);
+        
+        if (elapsed >= MIN_TIME_NS) {
+            break;
+        }
+        iters *= elapsed > MIN_TIME_NS / 100 ? MIN_TIME_NS * 1.2 / elapsed : 10;
+    }
+    
+    printf("%-28s %12.1f ns/op %12.1f MB/s %12ld iterations\n", (name + "/" + to_string(size)).c_str(),
+           elapsed / iters, size * iters / elapsed * 1e3, iters);
+    fflush(stdout);
+}
+
+/*
+ * Write and immediately read back one item: latency of the uncontended path.
+ */
+void bm_write_read(struct chdev_dev *dev, size_t size, long iters) {
+    for (long i = 0; i < iters; i++) {
+        if (write_item(dev, size) < 0 || read_item(dev) < 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/*
+ * Fill the buffer up and drain it: the rest of the buffer is padded where an item does not fit.
+ */
+void bm_fill_drain(struct chdev_dev *dev, size_t size, long iters) {
+    long done = 0;
+    
+    while (done < iters) {
+        long n = 0;
+        
+        while (done + n < iters && write_item(dev, size) >= 0) {
+            ++n;
+        }
+        for (long i = 0; i < n; i++) {
+            read_item(dev);
+        }
+        done += n;
+    }
+}
+
+/*
+ * Producer and consumer threads on the lock-free SPSC path, time per transferred item.
+ */
+void bm_spsc(struct chdev_dev *dev, size_t size, long iters) {
+    thread producer([dev, size, iters]() {
+        for (long i = 0; i < iters; i++) {
+            while (write_item(dev, size) == -ENOMEM) {
+                this_thread::yield();
+            }
+        }
+    });
+    
+    for (long i = 0; i < iters; i++) {
+        while (!chdev_can_read(dev)) {
+            this_thread::yield();   /* empty items are read as 0 bytes too */
+        }
+        read_item(dev);
+    }
+    producer.join();
+}
+
+/*
+ * MPMC_THREADS writers and as many readers on the lock-free slot mode, time per transferred item.
+ */
+void bm_slot_mpmc(struct chdev_dev *dev, size_t size, long iters) {
+    vector<thread> threads;
+    long           per_thread = iters / MPMC_THREADS;
+    
+    for (int i = 0; i < MPMC_THREADS; i++) {
+        threads.emplace_back([dev, size, per_thread]() {
+            for (long n = 0; n < per_thread; n++) {
+                while (write_item(dev, size) == -ENOMEM) {
+                    this_thread::yield();
+                }
+            }
+        });
+        threads.emplace_back([dev, per_thread]() {
+            static thread_local char buf[1 << 16];
+            struct iov_iter          iter;
+            
+            for (long n = 0; n < per_thread; n++) {
+                chdev_shim_iter(&iter, buf, sizeof(buf));
+                while (chdev_read_common(dev, &iter, 0) == -EAGAIN) {
+                    this_thread::yield();
+                }
+            }
+        });
+    }
+    for (thread &t : threads) {
+        t.join();
+    }
+}
+
+int main() {
+    const size_t sizes[] = { 0, 16, 64, 256, 1024, 4096, 16384 };
+    
+    for (size_t size : sizes) {
+        run("BM_WriteRead", size, bm_write_read);
+    }
+    for (size_t size : sizes) {
+        run("BM_FillDrain", size, bm_fill_drain);
+    }
+    for (size_t size : sizes) {
+        run("BM_SPSC", size, bm_spsc);
+    }
+    for (size_t size : sizes) {
+        run("BM_SlotMPMC", size, bm_slot_mpmc, true);
+    }
+    
+    return EXIT_SUCCESS;
+}
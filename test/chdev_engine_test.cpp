@@ -0,0 +1,1599 @@
+/* 
+ * Copyright (C) 2014 Sergey Morozov
+ * 
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.
+ * 
+ * Differential test of the ring engine (src/chdev_shared.c) built in userspace, run it with:
+ *     make check
+ */
+
+#include <iostream>
+#include <deque>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <map>
+#include <thread>
+#include <atomic>
+#include <stdlib.h>
+
+extern "C" {
+#include "chdev.h"
+#include "linux/lz4.h"
+}
+#include "chdev_common.h"
+
+#define OPS_PER_SEED 20000
+#define SEEDS        64
+#define SPSC_ITEMS   200000
+#define MPMC_THREADS 4
+
+using namespace std;
+
+int chdev_shim_cpu = 0;
+
+/*
+ * Allocate a device as chdev_setup(...) does, with nshards shards if nshards > 0.
+ * Size of the buffer is rounded down to a multiple of CHDEV_ITEM_ALIGN.
+ */
+struct chdev_dev *make_dev(size_t size, uint nshards) {
+    struct chdev_dev  *dev;
+    struct chdev_ring *ring;
+    uint              n = nshards ? nshards : 1;
+    
+    size &= ~(size_t)(CHDEV_ITEM_ALIGN - 1);
+    if (posix_memalign((void **)&dev, 64, sizeof(struct chdev_dev)) ||
+        posix_memalign((void **)&ring, 64, n * sizeof(struct chdev_ring))) {
+        cerr << "ERROR: Out of memory." << endl;
+        exit(EXIT_FAILURE);
+    }
+    memset(dev, 0, sizeof(struct chdev_dev));
+    memset(ring, 0, n * sizeof(struct chdev_ring));
+    
+    if (nshards) {
+        dev->shards  = ring;
+        dev->nshards = nshards;
+    }
+    else {
+        free(ring);
+        ring = &dev->ring;
+    }
+    
+    for (uint i = 0; i < n; i++) {
+        ring[i].buf      = (char *)calloc(1, size);
+        ring[i].buf_size = size;
+        ring[i].beg      = ring[i].buf;
+        ring[i].end      = ring[i].buf;
+        sema_init(&ring[i].sem, 1);
+    }
+    dev->buf_size = size;
+    dev->stats    = (struct chdev_pcpu_stats *)calloc(1, sizeof(struct chdev_pcpu_stats));
+    sema_init(&dev->sem, 1);
+    spin_lock_init(&dev->map_lock);
+    INIT_LIST_HEAD(&dev->cursors);
+    
+    return dev;
+}
+
+void free_dev(struct chdev_dev *dev) {
+    if (dev->shards) {
+        for (uint i = 0; i < dev->nshards; i++) {
+            free(dev->shards[i].buf);
+        }
+        free(dev->shards);
+    }
+    else {
+        free(dev->ring.buf);
+        free(dev->ring.ctrl);
+    }
+    if (dev->lz4) {
+        free(dev->lz4->wrkmem);
+        free(dev->lz4);
+    }
+    if (dev->slots) {
+        free(dev->slots->buf);
+        free(dev->slots);
+    }
+    free(dev->stats);
+    free(dev);
+}
+
+/*
+ * Allocate a device of slot mode as chdev_setup_slots(...) does.
+ */
+struct chdev_dev *make_slot_dev(size_t size, unsigned long count) {
+    struct chdev_dev   *dev = make_dev(CHDEV_ITEM_ALIGN, 0);
+    struct chdev_slots *slots;
+    
+    if (posix_memalign((void **)&slots, 64, sizeof(struct chdev_slots))) {
+        cerr << "ERROR: Out of memory." << endl;
+        exit(EXIT_FAILURE);
+    }
+    memset(slots, 0, sizeof(struct chdev_slots));
+    slots->stride = CHDEV_SLOT_STRIDE(size);
+    slots->size   = size;
+    slots->mask   = count - 1;
+    slots->buf    = (char *)calloc(count, slots->stride);
+    for (unsigned long i = 0; i < count; i++) {
+        ((struct chdev_slot *)(slots->buf + i * slots->stride))->seq = i;
+    }
+    dev->slots    = slots;
+    dev->buf_size = count * slots->stride;
+    
+    return dev;
+}
+
+/*
+ * Scratch buffers of compression mode laid out as chdev_alloc_lz4(...) does.
+ */
+void alloc_lz4(struct chdev_dev *dev) {
+    dev->lz4         = (struct chdev_lz4 *)calloc(1, sizeof(struct chdev_lz4));
+    dev->lz4->wrkmem = calloc(1, LZ4_MEM_COMPRESS + 2 * CHDEV_LZ4_MAX + LZ4_COMPRESSBOUND(CHDEV_LZ4_MAX));
+    dev->lz4->wr_src = (char *)dev->lz4->wrkmem + LZ4_MEM_COMPRESS;
+    dev->lz4->wr_dst = dev->lz4->wr_src + CHDEV_LZ4_MAX;
+    dev->lz4->rd_dst = dev->lz4->wr_dst + LZ4_COMPRESSBOUND(CHDEV_LZ4_MAX);
+}
+
+/*
+ * Wrappers which pass plain buffers to the engine.
+ */
+ssize_t write_item(struct chdev_dev *dev, const string &item, uint prio = 0) {
+    struct iov_iter iter;
+    
+    chdev_shim_iter(&iter, (void *)item.data(), item.size());
+    return chdev_write_common(dev, &iter, item.size(), prio, false);
+}
+
+ssize_t read_item(struct chdev_dev *dev, char *buf, size_t count, uint flags) {
+    struct iov_iter iter;
+    
+    chdev_shim_iter(&iter, buf, count);
+    return chdev_read_common(dev, &iter, flags);
+}
+
+/*
+ * Number of bytes taken by the record of an item of size bytes after its header.
+ */
+size_t record_len(size_t size) {
+    return ALIGN(sizeof(u32) + size, CHDEV_ITEM_ALIGN);
+}
+
+string random_item(size_t max) {
+    string item(rand() % (max + 1), '\0');
+    
+    for (size_t i = 0; i < item.size(); i++) {
+        item[i] = (char)rand();
+    }
+    return item;
+}
+
+void fail(const char *what, int seed, int op) {
+    cerr << "ERROR: " << what << " (seed " << seed << ", operation " << op << ")." << endl;
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Random mix of all operations on a single ring compared with a reference FIFO.
+ * Small buffer sizes make records meet the end of the buffer, and padding before them, often.
+ */
+void differential_test() {
+    vector<char> buf;
+    
+    cout << "--Differential test--" << endl;
+    
+    for (int seed = 1; seed <= SEEDS; seed++) {
+        struct chdev_dev  *dev = make_dev(CHDEV_BUF_MIN + seed * 13 % 301, 0);
+        struct chdev_ring *ring = &dev->ring;
+        size_t            size = ring->buf_size;
+        deque<string>     fifo;
+        size_t            used = 0;   /* bytes taken by items in fifo, including headers */
+        
+        srand(seed);
+        buf.resize(size + sizeof(uint));
+        
+        for (int op = 0; op < OPS_PER_SEED; op++) {
+            int     action = rand() % 8;
+            ssize_t retval;
+            
+            if (action < 3) {
+                /* write(), items up to half of the buffer and a bit more */
+                string item     = random_item(size / 2);
+                size_t downside = ring->buf + ring->buf_size - ring->end;
+                size_t record   = record_len(item.size());
+                size_t pad      = record > downside ? downside : 0;
+                bool   fits;
+                
+                used   = chdev_ring_used(ring);  /* a read into a small buffer may have skipped padding */
+                fits   = item.size() <= chdev_item_max(dev) && used + pad + record <= size;
+                retval = write_item(dev, item);
+                if (!fits) {
+                    if (retval != -ENOMEM) {
+                        fail("Write did not fail while the item does not fit", seed, op);
+                    }
+                    continue;
+                }
+                if (retval != (ssize_t)item.size()) {
+                    fail("Write failed while the item fits", seed, op);
+                }
+                /* record which does not fit downside the buffer always follows padding */
+                if (chdev_ring_used(ring) - used != pad + record) {
+                    fail("Write did not pad a record which does not fit downside", seed, op);
+                }
+                fifo.push_back(item);
+                used += pad + record;
+            }
+            else if (action == 3) {
+                /* zero-copy write */
+                string item = random_item(size / 2);
+                char   *payload = chdev_reserve_common(dev, item.size());
+                
+                if (IS_ERR(payload)) {
+                    if (PTR_ERR(payload) != -ENOMEM) {
+                        fail("Reserve failed", seed, op);
+                    }
+                    continue;
+                }
+                if (payload + item.size() > ring->buf + ring->buf_size) {
+                    fail("Reserved space wraps around the end of the buffer", seed, op);
+                }
+                memcpy(payload, item.data(), item.size());
+                chdev_commit_common(dev);
+                fifo.push_back(item);
+                used = chdev_ring_used(ring);
+            }
+            else if (action < 6) {
+                /* read(), sometimes framed, sometimes into a too small buffer */
+                uint   flags  = rand() % 2 ? CHDEV_FLAG_FRAMED : 0;
+                size_t hdr    = flags ? sizeof(uint) : 0;
+                size_t count  = rand() % 4 ? buf.size() : rand() % buf.size();
+                
+                retval = read_item(dev, buf.data(), count, flags);
+                if (fifo.empty()) {
+                    if (retval != 0) {
+                        fail("Read from empty buffer returned an item", seed, op);
+                    }
+                    continue;
+                }
+                if (fifo.front().size() + hdr > count) {
+                    if (retval != -ENOMEM) {
+                        fail("Read into a small buffer did not return -ENOMEM", seed, op);
+                    }
+                    continue;
+                }
+                if ((size_t)retval != fifo.front().size() + hdr ||
+                    (flags && *(uint *)buf.data() != fifo.front().size()) ||
+                    memcmp(buf.data() + hdr, fifo.front().data(), fifo.front().size())) {
+                    fail("Read returned wrong item", seed, op);
+                }
+                fifo.pop_front();
+                used = chdev_ring_used(ring);
+            }
+            else if (action == 6) {
+                /* zero-copy read */
+                size_t count;
+                char   *payload = chdev_peek_common(dev, &count);
+                
+                if (fifo.empty()) {
+                    if (payload) {
+                        fail("Peek into empty buffer returned an item", seed, op);
+                    }
+                    continue;
+                }
+                if (!payload || count != fifo.front().size() || payload + count > ring->buf + ring->buf_size) {
+                    fail("Peek returned wrong item", seed, op);
+                }
+                if (memcmp(payload, fifo.front().data(), count)) {
+                    fail("Peek returned wrong payload", seed, op);
+                }
+                if (chdev_drop_common(dev)) {
+                    fail("Release of the peeked item failed", seed, op);
+                }
+                fifo.pop_front();
+                used = chdev_ring_used(ring);
+            }
+            
+            /* counters always agree with the reference */
+            if (chdev_num_item(dev) != fifo.size() || chdev_can_read(dev) != !fifo.empty()) {
+                fail("Item counter differs from the reference", seed, op);
+            }
+            if (chdev_ring_used(ring) > size) {
+                fail("Buffer is overfilled", seed, op);
+            }
+            if ((ring->wr_bytes | ring->rd_bytes) % CHDEV_ITEM_ALIGN) {
+                fail("Record is not aligned", seed, op);
+            }
+        }
+        
+        /* counters agree with the reference as well */
+        struct chdev_stats stats;
+        chdev_get_stats(dev, &stats);
+        if (stats.enqueued - stats.dequeued != fifo.size() || stats.high_watermark > size || stats.num_item != fifo.size()) {
+            fail("Statistics differ from the reference", seed, OPS_PER_SEED);
+        }
+        free_dev(dev);
+    }
+    
+    cout << SEEDS << " seeds x " << OPS_PER_SEED << " operations" << endl << endl;
+}
+
+/*
+ * In overwrite mode writes always succeed and evict the oldest items of the reference as well.
+ */
+void overwrite_test() {
+    struct chdev_dev   *dev = make_dev(211, 0);
+    struct chdev_file  peeker;
+    deque<string>      fifo;
+    deque<size_t>      pads;    /* padding before each item of fifo */
+    size_t             used = 0, dropped = 0;
+    vector<char>       buf(211);
+    struct chdev_stats stats;
+    
+    cout << "--Overwrite test--" << endl;
+    
+    dev->mode = CHDEV_MODE_OVERWRITE;
+    srand(1);
+    for (int op = 0; op < OPS_PER_SEED; op++) {
+        if (rand() % 3) {
+            string item     = random_item(chdev_item_max(dev));
+            size_t record   = record_len(item.size());
+            size_t downside = dev->ring.buf + dev->ring.buf_size - dev->ring.end;
+            
+            /* record which does not fit downside the buffer follows padding */
+            if (write_item(dev, item) != (ssize_t)item.size()) {
+                fail("Write failed in overwrite mode", 1, op);
+            }
+            pads.push_back(record > downside ? downside : 0);
+            while (used + pads.back() + record > dev->buf_size) {
+                used -= pads.front() + record_len(fifo.front().size());
+                fifo.pop_front();
+                pads.pop_front();
+                ++dropped;
+            }
+            fifo.push_back(item);
+            used += pads.back() + record;
+        }
+        else {
+            ssize_t retval = read_item(dev, buf.data(), buf.size(), 0);
+            
+            if (fifo.empty() ? retval != 0 :
+                (size_t)retval != fifo.front().size() || memcmp(buf.data(), fifo.front().data(), retval)) {
+                fail("Read returned wrong item", 1, op);
+            }
+            if (!fifo.empty()) {
+                used -= pads.front() + record_len(fifo.front().size());
+                fifo.pop_front();
+                pads.pop_front();
+            }
+        }
+        if (chdev_num_item(dev) != fifo.size() || chdev_ring_used(&dev->ring) != used) {
+            fail("Buffer differs from the reference", 1, op);
+        }
+    }
+    
+    chdev_get_stats(dev, &stats);
+    if (stats.dropped != dropped || stats.enqueued - stats.dequeued - stats.dropped != fifo.size()) {
+        fail("Dropped items are miscounted", 1, OPS_PER_SEED);
+    }
+    
+    /* the oldest item is not evicted while it is read in place */
+    while (read_item(dev, buf.data(), buf.size(), 0) > 0 || chdev_num_item(dev)) {
+        /* drain the buffer */
+    }
+    write_item(dev, string(60, 'x'));
+    write_item(dev, string(60, 'x'));
+    dev->peek_filp = (struct file *)&peeker;
+    if (write_item(dev, string(90, 'y')) != -ENOMEM || chdev_can_write(dev, 90, 0)) {
+        fail("Item read in place was evicted", 1, OPS_PER_SEED);
+    }
+    free_dev(dev);
+    
+    cout << OPS_PER_SEED << " operations, " << dropped << " items evicted" << endl << endl;
+}
+
+/*
+ * Every cursor of broadcast mode reads every item; space is reclaimed behind the slowest one,
+ * and in overwrite mode cursors behind evicted items are moved forward with -EPIPE.
+ */
+void broadcast_test() {
+    const int           ncursors = 3;
+    struct chdev_dev    *dev     = make_dev(257, 0);
+    struct chdev_cursor cursors[ncursors];
+    u64                 expected[ncursors] = { 0 };     /* sequence number each cursor reads next */
+    bool                overrun[ncursors]  = { false };
+    map<u64, string>    items;                          /* items in the buffer by sequence number */
+    u64                 head = 0;
+    vector<char>        buf(257);
+    
+    cout << "--Broadcast test--" << endl;
+    
+    dev->mode = CHDEV_MODE_BROADCAST;
+    for (int i = 0; i < ncursors; i++) {
+        memset(&cursors[i], 0, sizeof(struct chdev_cursor));
+        INIT_LIST_HEAD(&cursors[i].node);
+    }
+    
+    srand(1);
+    for (int op = 0; op < OPS_PER_SEED; op++) {
+        /* second half of the test runs in overwrite mode */
+        if (op == OPS_PER_SEED / 2) {
+            dev->mode |= CHDEV_MODE_OVERWRITE;
+        }
+        
+        if (rand() % 2) {
+            string  item   = random_item(60);
+            ssize_t retval = write_item(dev, item);
+            
+            if (retval >= 0) {
+                items[head++] = item;
+            }
+            else if (retval != -ENOMEM || (dev->mode & CHDEV_MODE_OVERWRITE)) {
+                fail("Write failed", 1, op);
+            }
+        }
+        else {
+            int             i        = rand() % ncursors;
+            bool            readable = chdev_cursor_can_read(dev, &cursors[i]);
+            ssize_t         retval;
+            struct iov_iter iter;
+            
+            chdev_shim_iter(&iter, buf.data(), buf.size());
+            if (list_empty(&cursors[i].node)) {
+                expected[i] = dev->ring.rd_seq;  /* subscribes with the first read */
+            }
+            if (overrun[i]) {
+                if (!readable || chdev_cursor_read(dev, &cursors[i], &iter, 0) != -EPIPE) {
+                    fail("Overrun was not reported", 1, op);
+                }
+                overrun[i] = false;
+                continue;
+            }
+            retval = chdev_cursor_read(dev, &cursors[i], &iter, 0);
+            if (expected[i] == head ? retval != 0 :
+                (size_t)retval != items[expected[i]].size() || memcmp(buf.data(), items[expected[i]].data(), retval)) {
+                fail("Cursor read wrong item", 1, op);
+            }
+            if (retval || expected[i] < head) {
+                ++expected[i];
+            }
+        }
+        
+        /* items before the slowest cursor are removed, evicted items move cursors forward */
+        u64 min = head;
+        for (int i = 0; i < ncursors; i++) {
+            if (!list_empty(&cursors[i].node) && expected[i] < dev->ring.rd_seq) {
+                overrun[i]  = true;
+                expected[i] = dev->ring.rd_seq;
+            }
+            min = list_empty(&cursors[i].node) ? min : std::min(min, expected[i]);
+        }
+        while (!items.empty() && items.begin()->first < dev->ring.rd_seq) {
+            items.erase(items.begin());
+        }
+        if (dev->ring.rd_seq > min || (!(dev->mode & CHDEV_MODE_OVERWRITE) && dev->ring.rd_seq != min && min != head) ||
+            chdev_num_item(dev) != head - dev->ring.rd_seq) {
+            fail("Buffer is not reclaimed behind the slowest cursor", 1, op);
+        }
+    }
+    
+    /* a detached cursor does not hold the buffer back */
+    for (int i = 0; i < ncursors; i++) {
+        chdev_cursor_detach(dev, &cursors[i]);
+    }
+    if (!list_empty(&dev->cursors)) {
+        fail("Cursors were not detached", 1, OPS_PER_SEED);
+    }
+    
+    cout << OPS_PER_SEED << " operations, " << head << " items, " << cursors[0].lost << " lost by cursor 0" << endl << endl;
+    free_dev(dev);
+}
+
+/*
+ * Compressible and incompressible items of compression mode read back unchanged, also framed
+ * and after padding; compressed items can not be read in place.
+ */
+void compress_test() {
+    struct chdev_dev   *dev = make_dev(997, 0);
+    deque<string>      fifo;
+    vector<char>       buf(997);
+    struct chdev_stats stats;
+    size_t             size;
+    char               *payload;
+    
+    cout << "--Compress test--" << endl;
+    
+    alloc_lz4(dev);
+    dev->compress_min = 64;
+    dev->mode         = CHDEV_MODE_COMPRESS;
+    
+    srand(1);
+    for (int op = 0; op < OPS_PER_SEED; op++) {
+        if (rand() % 2) {
+            string item = random_item(400);
+            
+            /* half of items are runs of a few bytes */
+            if (rand() % 2) {
+                for (size_t i = 0; i < item.size(); i++) {
+                    item[i] = 'a' + i / 50;
+                }
+            }
+            struct iov_iter iter;
+            ssize_t         retval;
+            
+            /* item which does not fit is left in the iterator for the next attempt */
+            chdev_shim_iter(&iter, (void *)item.data(), item.size());
+            retval = chdev_write_common(dev, &iter, item.size(), 0, false);
+            if (retval >= 0) {
+                fifo.push_back(item);
+            }
+            else if (retval != -ENOMEM || iov_iter_count(&iter) != item.size()) {
+                fail("Write failed in compression mode", 1, op);
+            }
+        }
+        else {
+            uint    flags   = rand() % 2 ? CHDEV_FLAG_FRAMED : 0;
+            size_t  hdr_len = flags ? sizeof(uint) : 0;
+            ssize_t retval;
+            
+            /* compressed item is never exposed in place, raw item is exposed unchanged */
+            payload = chdev_peek_common(dev, &size);
+            if (fifo.empty() ? payload != NULL : !payload ||
+                (IS_ERR(payload) ? fifo.front().size() < dev->compress_min :
+                 size != fifo.front().size() || (size && payload[0] != fifo.front()[0]))) {
+                fail("Peek exposed wrong item", 1, op);
+            }
+            
+            retval = read_item(dev, buf.data(), buf.size(), flags);
+            if (fifo.empty() ? retval != 0 :
+                (size_t)retval != fifo.front().size() + hdr_len ||
+                (hdr_len && *(uint *)buf.data() != fifo.front().size()) ||
+                memcmp(buf.data() + hdr_len, fifo.front().data(), fifo.front().size())) {
+                fail("Read returned wrong item", 1, op);
+            }
+            if (!fifo.empty()) {
+                fifo.pop_front();
+            }
+        }
+        if (chdev_num_item(dev) != fifo.size()) {
+            fail("Buffer differs from the reference", 1, op);
+        }
+    }
+    
+    chdev_get_stats(dev, &stats);
+    if (!stats.compressed || stats.compress_out >= stats.compress_in) {
+        fail("Compressed items are miscounted", 1, OPS_PER_SEED);
+    }
+    
+    /* corrupted item is not consumed */
+    while (read_item(dev, buf.data(), buf.size(), 0) > 0 || chdev_num_item(dev)) {
+        /* drain the buffer */
+    }
+    write_item(dev, string(200, 'z'));
+    payload = *(u32 *)dev->ring.beg == CHDEV_ITEM_PAD ? dev->ring.buf : dev->ring.beg;
+    payload[2 * sizeof(u32)] = 0;
+    if (read_item(dev, buf.data(), buf.size(), 0) != -EIO || chdev_num_item(dev) != 1) {
+        fail("Corrupted item was read", 1, OPS_PER_SEED);
+    }
+    
+    cout << OPS_PER_SEED << " operations, " << stats.compressed << " items compressed to "
+         << stats.compress_out * 100 / stats.compress_in << "%" << endl << endl;
+    free_dev(dev);
+}
+
+/*
+ * Snapshot returns the framed items of the reference FIFO oldest first, whole items only,
+ * and leaves the ring as it was; items are padded at the end of the buffer and by reservations, stamped
+ * and compressed.
+ */
+void snapshot_test() {
+    struct chdev_dev *dev = make_dev(509, 0);
+    deque<string>    fifo;
+    vector<char>     copy(509 + CHDEV_LZ4_MAX), out(1024);
+    size_t           snapshots = 0;
+    
+    cout << "--Snapshot test--" << endl;
+    
+    alloc_lz4(dev);
+    dev->compress_min = 32;
+    
+    srand(1);
+    for (int op = 0; op < OPS_PER_SEED; op++) {
+        int action = rand() % 6;
+        
+        if (op == OPS_PER_SEED / 4) {
+            dev->mode = CHDEV_MODE_TIMESTAMP;
+        }
+        if (op == OPS_PER_SEED / 2) {
+            dev->mode = CHDEV_MODE_COMPRESS;
+        }
+        if (op == 3 * OPS_PER_SEED / 4) {
+            dev->mode = CHDEV_MODE_COMPRESS | CHDEV_MODE_TIMESTAMP;
+        }
+        
+        if (action < 2) {
+            string item = random_item(120);
+            
+            if (rand() % 2) {
+                for (size_t i = 0; i < item.size(); i++) {
+                    item[i] = 'a' + i / 40;
+                }
+            }
+            if (write_item(dev, item) >= 0) {
+                fifo.push_back(item);
+            }
+        }
+        else if (action < 3) {
+            string item    = random_item(120);
+            char   *payload = chdev_reserve_common(dev, item.size());
+            
+            if (!IS_ERR(payload)) {
+                memcpy(payload, item.data(), item.size());
+                chdev_commit_common(dev);
+                fifo.push_back(item);
+            }
+        }
+        else if (action < 4) {
+            if (read_item(dev, out.data(), out.size(), 0) >= 0 && !fifo.empty()) {
+                fifo.pop_front();
+            }
+        }
+        else {
+            /* output buffer is sometimes too small for all items */
+            size_t          room = rand() % 2 ? out.size() : rand() % out.size();
+            char            *beg = dev->ring.beg;
+            uint            total, num_item, i;
+            size_t          pos = 0;
+            ssize_t         len, retval;
+            struct iov_iter iter;
+            
+            len = chdev_snapshot(dev, copy.data(), &total);
+            chdev_shim_iter(&iter, out.data(), room);
+            retval = chdev_snapshot_to_iter(dev, copy.data(), len, &iter, copy.data() + 509, &num_item);
+            if (len < 0 || retval < 0 || total != fifo.size() || num_item > total || dev->ring.beg != beg ||
+                chdev_num_item(dev) != fifo.size()) {
+                fail("Snapshot changed the ring or miscounted items", 1, op);
+            }
+            for (i = 0; i < num_item; i++) {
+                if (*(uint *)(out.data() + pos) != fifo[i].size() ||
+                    memcmp(out.data() + pos + sizeof(uint), fifo[i].data(), fifo[i].size())) {
+                    fail("Snapshot returned wrong item", 1, op);
+                }
+                pos += fifo[i].size() + sizeof(uint);
+            }
+            if (pos != (size_t)retval || (num_item < total && pos + fifo[num_item].size() + sizeof(uint) <= room)) {
+                fail("Snapshot stopped before the last item which fits", 1, op);
+            }
+            ++snapshots;
+        }
+    }
+    free_dev(dev);
+    
+    cout << OPS_PER_SEED << " operations, " << snapshots << " snapshots" << endl << endl;
+}
+
+/*
+ * Readers and writers are signaled once per watermark crossing, also by a write which steps over
+ * the watermark, items below it by the timer.
+ */
+void notify_test() {
+    struct chdev_dev      *dev = make_dev(1024, 0);
+    struct chdev_notifier notifier;
+    struct eventfd_ctx    rd_ctx = { 0 }, wr_ctx = { 0 };
+    char                  buf[128];
+    int                   written = 0;
+    
+    cout << "--Notify test--" << endl;
+    
+    memset(&notifier, 0, sizeof(struct chdev_notifier));
+    notifier.dev            = dev;
+    notifier.rd_ctx         = &rd_ctx;
+    notifier.wr_ctx         = &wr_ctx;
+    notifier.rd_items       = 4;
+    notifier.wr_free        = 512;
+    notifier.delay_ns       = 1000;
+    notifier.timer.function = chdev_notify_timer;
+    dev->notifier           = &notifier;
+    
+    /* items below the watermark are delivered by the timer */
+    for (int i = 0; i < 3; i++) {
+        write_item(dev, string(10, 'a'));
+    }
+    if (rd_ctx.count != 0 || !notifier.timer.active) {
+        fail("Items below the watermark signaled readers or did not start the timer", 0, 0);
+    }
+    notifier.timer.active = false;
+    notifier.timer.function(&notifier.timer);
+    if (rd_ctx.count != 1) {
+        fail("Timer did not signal readers", 0, 0);
+    }
+    
+    /* only the write which reaches the watermark signals */
+    write_item(dev, string(10, 'a'));
+    write_item(dev, string(10, 'a'));
+    if (rd_ctx.count != 2) {
+        fail("Watermark of items signaled readers not exactly once", 0, 0);
+    }
+    while (read_item(dev, buf, sizeof(buf), 0) > 0);
+    notifier.timer.active = false;
+    notifier.timer.function(&notifier.timer);
+    if (rd_ctx.count != 2) {
+        fail("Timer signaled readers of an empty buffer", 0, 0);
+    }
+    
+    /* batch which steps over the watermark signals once at its end, a batch above it does not */
+    for (int n = 0; n < 2; n++) {
+        struct chdev_notify_mark mark;
+        
+        chdev_notify_hold(dev, &mark);
+        for (int i = 0; i < 5; i++) {
+            write_item(dev, string(10, 'a'));
+        }
+        if (rd_ctx.count != 2U + n) {
+            fail("Write of a batch signaled readers before its end", 0, n);
+        }
+        chdev_notify_release(dev, &mark);
+        if (rd_ctx.count != 3) {
+            fail("Batch which crossed the watermark signaled readers not exactly once", 0, n);
+        }
+    }
+    while (read_item(dev, buf, sizeof(buf), 0) > 0);
+    
+    /* watermark of bytes, the header of every item counts */
+    notifier.rd_items = 0;
+    notifier.rd_bytes = 100;
+    for (int i = 0; i < 5; i++) {
+        write_item(dev, string(26, 'b'));
+    }
+    if (rd_ctx.count != 4) {
+        fail("Watermark of bytes signaled readers not exactly once", 0, 0);
+    }
+    while (read_item(dev, buf, sizeof(buf), 0) > 0);
+    
+    /* writers are signaled once when free space rises to their watermark */
+    while (write_item(dev, string(96, 'c')) >= 0) {
+        ++written;
+    }
+    for (int i = 0; i < written; i++) {
+        read_item(dev, buf, sizeof(buf), 0);
+        if (wr_ctx.count != (chdev_ring_used(&dev->ring) <= 1024 - 512 ? 1U : 0U)) {
+            fail("Watermark of free space signaled writers not exactly once", 0, i);
+        }
+    }
+    
+    dev->notifier = NULL;
+    free_dev(dev);
+    
+    cout << rd_ctx.count << " signals to readers, " << wr_ctx.count << " to writers" << endl << endl;
+}
+
+/*
+ * Items written, reserved and compressed in timestamp mode are read with their residence time,
+ * items written before it with 0, and every stamped item read is counted by the histogram once.
+ */
+void timestamp_test() {
+    struct chdev_dev      *dev = make_dev(613, 0);
+    deque<pair<string, bool>> fifo;    /* items with a flag telling if they are stamped */
+    vector<char>          buf(613);
+    struct chdev_hist     hist;
+    unsigned long long    stamped = 0, bucketed = 0;
+    size_t                size;
+    char                  *payload;
+    
+    cout << "--Timestamp test--" << endl;
+    
+    alloc_lz4(dev);
+    dev->compress_min = 64;
+    
+    srand(1);
+    for (int op = 0; op < OPS_PER_SEED; op++) {
+        int action = rand() % 5;
+        
+        if (op == OPS_PER_SEED / 3) {
+            dev->mode = CHDEV_MODE_TIMESTAMP;
+        }
+        if (op == 2 * OPS_PER_SEED / 3) {
+            dev->mode = CHDEV_MODE_TIMESTAMP | CHDEV_MODE_COMPRESS;
+        }
+        
+        if (action < 2) {
+            string item = random_item(150);
+            
+            if (rand() % 2) {
+                for (size_t i = 0; i < item.size(); i++) {
+                    item[i] = 'a' + i / 50;
+                }
+            }
+            if (write_item(dev, item) >= 0) {
+                fifo.push_back(make_pair(item, (dev->mode & CHDEV_MODE_TIMESTAMP) != 0));
+            }
+        }
+        else if (action < 3) {
+            string item = random_item(150);
+            
+            payload = chdev_reserve_common(dev, item.size());
+            if (!IS_ERR(payload)) {
+                memcpy(payload, item.data(), item.size());
+                chdev_commit_common(dev);
+                fifo.push_back(make_pair(item, (dev->mode & CHDEV_MODE_TIMESTAMP) != 0));
+            }
+        }
+        else {
+            uint               flags   = CHDEV_FLAG_RESIDENCE | (rand() % 2 ? CHDEV_FLAG_FRAMED : 0);
+            size_t             hdr_len = (flags & CHDEV_FLAG_FRAMED) ? sizeof(uint) : 0;
+            unsigned long long residence;
+            ssize_t            retval;
+            
+            /* enqueue time is not exposed in place */
+            payload = chdev_peek_common(dev, &size);
+            if (payload && !IS_ERR(payload) && size != fifo.front().first.size()) {
+                fail("Peek exposed wrong item", 1, op);
+            }
+            
+            retval = read_item(dev, buf.data(), buf.size(), flags);
+            if (fifo.empty()) {
+                if (retval != 0) {
+                    fail("Read returned an item of an empty buffer", 1, op);
+                }
+                continue;
+            }
+            memcpy(&residence, buf.data() + hdr_len, sizeof(residence));
+            if ((size_t)retval != fifo.front().first.size() + hdr_len + sizeof(residence) ||
+                (hdr_len && *(uint *)buf.data() != fifo.front().first.size()) ||
+                memcmp(buf.data() + hdr_len + sizeof(residence), fifo.front().first.data(), fifo.front().first.size()) ||
+                (fifo.front().second ? residence > 1000000000ULL : residence != 0)) {
+                fail("Read returned wrong item or residence time", 1, op);
+            }
+            stamped += fifo.front().second;
+            fifo.pop_front();
+        }
+        if (chdev_num_item(dev) != fifo.size()) {
+            fail("Buffer differs from the reference", 1, op);
+        }
+    }
+    
+    chdev_get_hist(dev, &hist);
+    for (uint i = 0; i < CHDEV_HIST_BUCKETS; i++) {
+        bucketed += hist.buckets[i];
+    }
+    if (hist.count != stamped || bucketed != stamped || hist.max_ns > 1000000000ULL || hist.sum_ns > stamped * hist.max_ns) {
+        fail("Histogram miscounted residence times", 1, OPS_PER_SEED);
+    }
+    free_dev(dev);
+    
+    cout << OPS_PER_SEED << " operations, " << hist.count << " residence times, mean "
+         << (hist.count ? hist.sum_ns / hist.count : 0) << " ns" << endl << endl;
+}
+
+/*
+ * Slot mode keeps FIFO order and rejects items which do not fit; then several writers and readers
+ * run concurrently: every item is read once, and every reader sees items of a writer in order.
+ */
+void slot_test() {
+    struct chdev_dev   *dev = make_slot_dev(60, 8);
+    vector<char>       buf(128);
+    struct chdev_stats stats;
+    
+    cout << "--Slot test--" << endl;
+    
+    for (int i = 0; i < 8; i++) {
+        if (write_item(dev, string(i * 8, 'a' + i)) != i * 8) {
+            fail("Write to a free slot failed", 0, i);
+        }
+    }
+    if (chdev_can_write(dev, 0, 0) || write_item(dev, "x") != -ENOMEM || write_item(dev, string(61, 'x')) != -ENOMEM) {
+        fail("Full queue or too large item was accepted", 0, 8);
+    }
+    if (read_item(dev, buf.data(), 3, CHDEV_FLAG_FRAMED) != -ENOMEM || read_item(dev, buf.data(), 4, CHDEV_FLAG_FRAMED) != 4 || *(uint *)buf.data() != 0) {
+        fail("Framed empty item was not read", 0, 0);
+    }
+    if (read_item(dev, buf.data(), 7, 0) != -ENOMEM || read_item(dev, buf.data(), 8, 0) != 8 || buf[0] != 'b') {
+        fail("Item was read into a too small buffer", 0, 1);
+    }
+    for (int i = 2; i < 8; i++) {
+        if (read_item(dev, buf.data(), buf.size(), 0) != i * 8 || buf[i * 8 - 1] != 'a' + i) {
+            fail("Slot read wrong item", 0, i);
+        }
+    }
+    if (chdev_can_read(dev) || read_item(dev, buf.data(), buf.size(), 0) != -EAGAIN) {
+        fail("Empty queue returned an item", 0, 8);
+    }
+    free_dev(dev);
+    
+    /* item is its writer and sequence number, padded to a length which depends on both */
+    dev = make_slot_dev(64, 64);
+    vector<thread>               threads;
+    vector<vector<unsigned int>> seen(MPMC_THREADS, vector<unsigned int>(MPMC_THREADS, 0));
+    unsigned int                 total = 0;
+    
+    for (unsigned int w = 0; w < MPMC_THREADS; w++) {
+        threads.emplace_back([dev, w]() {
+            for (unsigned int seq = 0; seq < SPSC_ITEMS / MPMC_THREADS; seq++) {
+                unsigned int head[2] = { w, seq };
+                string       item((char *)head, sizeof(head));
+                
+                item.append((w + seq) % 57, (char)seq);
+                while (write_item(dev, item) == -ENOMEM) {
+                    this_thread::yield();
+                }
+            }
+        });
+    }
+    for (unsigned int r = 0; r < MPMC_THREADS; r++) {
+        threads.emplace_back([dev, r, &seen, &total]() {
+            char buf[128];
+            
+            while (__atomic_load_n(&total, __ATOMIC_RELAXED) < SPSC_ITEMS) {
+                ssize_t      retval = read_item(dev, buf, sizeof(buf), 0);
+                unsigned int head[2];
+                
+                if (retval == -EAGAIN) {
+                    this_thread::yield();
+                    continue;
+                }
+                memcpy(head, buf, sizeof(head));
+                if (retval != (ssize_t)(sizeof(head) + (head[0] + head[1]) % 57) || head[0] >= MPMC_THREADS ||
+                    head[1] < seen[r][head[0]] || (retval > (ssize_t)sizeof(head) && buf[retval - 1] != (char)head[1])) {
+                    fail("Reader got a wrong or reordered item", r, head[1]);
+                }
+                seen[r][head[0]] = head[1] + 1;
+                __atomic_add_fetch(&total, 1, __ATOMIC_RELAXED);
+            }
+        });
+    }
+    for (thread &t : threads) {
+        t.join();
+    }
+    
+    chdev_get_stats(dev, &stats);
+    if (total != SPSC_ITEMS || stats.enqueued != SPSC_ITEMS || stats.dequeued != SPSC_ITEMS || chdev_num_item(dev)) {
+        fail("Items were lost or duplicated", 0, total);
+    }
+    free_dev(dev);
+    
+    cout << SPSC_ITEMS << " items, " << MPMC_THREADS << " writers and " << MPMC_THREADS << " readers" << endl << endl;
+}
+
+/*
+ * Writers on different CPUs fill different shards. With unordered=1 the reader must return the items
+ * of every shard in order, whatever the order between shards is; by default it must return all items
+ * in the order they were written.
+ */
+void sharded_test(bool ordered) {
+    const uint               nshards = 4;
+    struct chdev_dev         *dev    = make_dev(197, nshards);
+    vector<deque<string> >   fifo(nshards);
+    deque<string>            all;                /* every item in the order of writes */
+    char                     buf[128];
+    size_t                   total   = 0;
+    
+    cout << "--Sharded test (" << (ordered ? "ordered" : "unordered") << ")--" << endl;
+    
+    dev->unordered = !ordered;
+    srand(1);
+    for (int op = 0; op < OPS_PER_SEED; op++) {
+        if (rand() % 2) {
+            string item = random_item(40);
+            
+            chdev_shim_cpu = rand() % 8;
+            item.insert(0, 1, (char)(chdev_shim_cpu % nshards)); /* first byte names the shard */
+            if (write_item(dev, item) >= 0) {
+                fifo[chdev_shim_cpu % nshards].push_back(item);
+                all.push_back(item);
+                ++total;
+            }
+        }
+        else {
+            ssize_t retval = read_item(dev, buf, sizeof(buf), 0);
+            
+            if (retval == 0) {
+                if (total) {
+                    fail("Read from non-empty device returned nothing", 1, op);
+                }
+                continue;
+            }
+            if (retval < 1 || (uint)buf[0] >= nshards || fifo[buf[0]].empty() ||
+                (size_t)retval != fifo[buf[0]].front().size() ||
+                memcmp(buf, fifo[buf[0]].front().data(), retval)) {
+                fail("Read returned wrong item", 1, op);
+            }
+            if (ordered && string(buf, retval) != all.front()) {
+                fail("Read returned items of different shards out of order", 1, op);
+            }
+            all.erase(find(all.begin(), all.end(), fifo[buf[0]].front()));
+            fifo[buf[0]].pop_front();
+            --total;
+        }
+        if (chdev_num_item(dev) != total) {
+            fail("Item counter differs from the reference", 1, op);
+        }
+    }
+    
+    /* writer which must not sleep fails instead of waiting for the lock of its shard */
+    struct iov_iter iter;
+    
+    chdev_shim_cpu = 0;
+    down_interruptible(&dev->shards[0].sem);
+    chdev_shim_iter(&iter, buf, 1);
+    if (chdev_write_common(dev, &iter, 1, 0, true) != -EAGAIN || chdev_num_item(dev) != total) {
+        fail("Writer without waiting took a locked shard", 2, 0);
+    }
+    up(&dev->shards[0].sem);
+    chdev_shim_iter(&iter, buf, 1);
+    if (chdev_write_common(dev, &iter, 1, 0, true) != 1) {
+        fail("Writer without waiting failed on a free shard", 2, 0);
+    }
+    free_dev(dev);
+    
+    cout << OPS_PER_SEED << " operations on " << nshards << " shards" << endl << endl;
+}
+
+/*
+ * Items larger than SHRT_MAX in a buffer larger than the largest page block (vmalloc'ed by the driver):
+ * items are padded at many offsets of the end of the buffer, and every item is read back whole.
+ */
+void large_test() {
+    const size_t     size = (9 << 20) + 13;     /* odd size, rounded down by the device */
+    struct chdev_dev *dev = make_dev(size, 0);
+    deque<string>    fifo;
+    vector<char>     buf(size);
+    size_t           bytes = 0;
+    struct iov_iter  iter;
+    
+    cout << "--Large test--" << endl;
+    
+    srand(1);
+    for (int op = 0; op < 400; op++) {
+        if (rand() % 2) {
+            string item(SHRT_MAX + 1 + (size_t)rand() % (3 << 20), (char)op);
+            
+            item[item.size() / 2] = (char)rand();
+            ssize_t retval = write_item(dev, item);
+            
+            if (retval == (ssize_t)item.size()) {
+                fifo.push_back(item);
+                bytes += item.size();
+            }
+            else if (retval != -ENOMEM || chdev_can_write(dev, item.size(), 0)) {
+                fail("Large item was not written to a buffer with room for it", 1, op);
+            }
+        }
+        else {
+            ssize_t retval = read_item(dev, buf.data(), buf.size(), 0);
+            
+            if (fifo.empty() ? retval != 0 :
+                retval != (ssize_t)fifo.front().size() || memcmp(buf.data(), fifo.front().data(), retval)) {
+                fail("Large item was not read back whole", 1, op);
+            }
+            if (!fifo.empty()) {
+                fifo.pop_front();
+            }
+        }
+        if (chdev_num_item(dev) != fifo.size()) {
+            fail("Item counter differs from the reference", 1, op);
+        }
+    }
+    
+    /* length of an item must fit into its header, the check comes before the iterator is touched */
+    chdev_shim_iter(&iter, buf.data(), (size_t)CHDEV_ITEM_MAX + 1);
+    if (chdev_write_common(dev, &iter, (size_t)CHDEV_ITEM_MAX + 1, 0, false) != -EINVAL) {
+        fail("Item longer than the header allows was accepted", 1, 0);
+    }
+    
+    /* record larger than half of the buffer may never fit after padding, it is rejected at once */
+    while (read_item(dev, buf.data(), buf.size(), 0) > 0);
+    if (write_item(dev, string(chdev_item_max(dev) + 1, 'x')) != -ENOMEM ||
+        write_item(dev, string(chdev_item_max(dev), 'x')) != (ssize_t)chdev_item_max(dev)) {
+        fail("Item larger than half of the buffer was accepted, or the largest item was not", 1, 0);
+    }
+    free_dev(dev);
+    
+    cout << bytes << " bytes in items of up to 3 MB, " << size << " byte buffer" << endl << endl;
+}
+
+/*
+ * Producer and consumer of mapped roles as user space implements them on the mapped buffer and control page:
+ * records are aligned to CHDEV_ITEM_ALIGN, and the rest of the buffer is padded if a record does not fit there.
+ * Returns false if the item does not fit, or if there is no item.
+ */
+bool map_push(struct chdev_ring *ring, const string &item) {
+    struct chdev_ring_ctrl *ctrl   = ring->ctrl;
+    size_t                 wr     = ctrl->wr_pos;
+    size_t                 rd     = __atomic_load_n(&ctrl->rd_pos, __ATOMIC_ACQUIRE);
+    size_t                 off    = wr % ring->buf_size;
+    size_t                 len    = record_len(item.size());
+    size_t                 pad    = len > ring->buf_size - off ? ring->buf_size - off : 0;
+    u32                    header = item.size();
+    
+    if (pad + len > ring->buf_size - (wr - rd)) {
+        return false;
+    }
+    if (pad) {
+        memset(ring->buf + off, 0xff, sizeof(u32));
+        off = 0;
+    }
+    memcpy(ring->buf + off, &header, sizeof(u32));
+    memcpy(ring->buf + off + sizeof(u32), item.data(), item.size());
+    __atomic_store_n(&ctrl->wr_pos, wr + pad + len, __ATOMIC_RELEASE);
+    return true;
+}
+
+bool map_pop(struct chdev_ring *ring, string &item) {
+    struct chdev_ring_ctrl *ctrl = ring->ctrl;
+    size_t                 rd    = ctrl->rd_pos;
+    size_t                 wr    = __atomic_load_n(&ctrl->wr_pos, __ATOMIC_ACQUIRE);
+    size_t                 off   = rd % ring->buf_size;
+    u32                    header;
+    
+    if (rd == wr) {
+        return false;
+    }
+    if (!memcmp(ring->buf + off, "\xff\xff\xff\xff", sizeof(u32))) {
+        rd += ring->buf_size - off;
+        off = 0;
+    }
+    memcpy(&header, ring->buf + off, sizeof(u32));
+    item.assign(ring->buf + off + sizeof(u32), header);
+    __atomic_store_n(&ctrl->rd_pos, rd + record_len(header), __ATOMIC_RELEASE);
+    return true;
+}
+
+/*
+ * Offset of the header of the record written at position pos, after the padding before it.
+ */
+size_t map_header(struct chdev_ring *ring, size_t pos) {
+    size_t off = pos % ring->buf_size;
+    
+    return memcmp(ring->buf + off, "\xff\xff\xff\xff", sizeof(u32)) ? off : 0;
+}
+
+/*
+ * Positions of mapped roles are taken by the driver only up to the last whole item, and items move between
+ * mapped owners and the driver in order. With both sides mapped items move without the driver at all, which
+ * checks the positions concurrently and counts the items once a side is taken back.
+ */
+void mapped_test() {
+    struct chdev_dev       *dev = make_dev(1021, 0);
+    struct chdev_ring      *ring = &dev->ring;
+    struct chdev_ring_ctrl *ctrl;
+    deque<string>          fifo;
+    char                   buf[256];
+    string                 item;
+    size_t                 pos, end, header;
+    size_t                 pulls = 0;
+    atomic<bool>           done(false);
+    
+    cout << "--Mapped test--" << endl;
+    
+    if (posix_memalign((void **)&ctrl, PAGE_SIZE, PAGE_SIZE)) {
+        cerr << "ERROR: Out of memory." << endl;
+        exit(EXIT_FAILURE);
+    }
+    memset(ctrl, 0, PAGE_SIZE);
+    ring->ctrl = ctrl;
+    
+    /* mapped producer, items are read by the driver */
+    srand(1);
+    chdev_map_side(dev, CHDEV_ROLE_PRODUCER, true);
+    for (int op = 0; op < OPS_PER_SEED; op++) {
+        if (rand() % 2) {
+            item = random_item(200);
+            if (map_push(ring, item)) {
+                fifo.push_back(item);
+            }
+        }
+        else {
+            ssize_t retval = read_item(dev, buf, sizeof(buf), 0);
+            
+            if (fifo.empty() ? retval != 0 : (retval != (ssize_t)fifo.front().size() || memcmp(buf, fifo.front().data(), retval))) {
+                fail("Driver read wrong item of the mapped producer", 1, op);
+            }
+            if (!fifo.empty()) {
+                fifo.pop_front();
+            }
+            if (chdev_num_item(dev) != fifo.size() || ctrl->rd_pos != ring->rd_bytes) {
+                fail("Driver did not take every item of the mapped producer", 1, op);
+            }
+        }
+    }
+    
+    /* partial item, forged flags and a position past the consumer are not taken */
+    map_push(ring, "whole");
+    fifo.push_back("whole");
+    pos = ctrl->wr_pos;
+    map_push(ring, "partial");
+    ctrl->wr_pos -= 3;
+    if (chdev_pull_mapped(dev) != -EINVAL || chdev_num_item(dev) != fifo.size() || ring->wr_bytes != pos) {
+        fail("Driver took a partial item", 1, 0);
+    }
+    ctrl->wr_pos = pos;
+    map_push(ring, "forged");
+    end    = ctrl->wr_pos;
+    header = map_header(ring, pos);
+    buf[0] = ring->buf[header + 3];
+    ring->buf[header + 3] |= 0x80;   /* CHDEV_ITEM_LZ4 */
+    if (chdev_pull_mapped(dev) != -EINVAL || chdev_num_item(dev) != fifo.size()) {
+        fail("Driver took an item with flags", 1, 0);
+    }
+    ring->buf[header + 3] = buf[0];
+    ctrl->wr_pos = ctrl->rd_pos + ring->buf_size + CHDEV_ITEM_ALIGN;
+    if (chdev_pull_mapped(dev) != -EINVAL || chdev_num_item(dev) != fifo.size()) {
+        fail("Driver took a position past the consumer", 1, 0);
+    }
+    ctrl->wr_pos = end;
+    fifo.push_back("forged");
+    chdev_map_side(dev, CHDEV_ROLE_PRODUCER, false);
+    while (!fifo.empty()) {
+        if (read_item(dev, buf, sizeof(buf), 0) != (ssize_t)fifo.front().size() || memcmp(buf, fifo.front().data(), fifo.front().size())) {
+            fail("Driver lost items of the mapped producer which was taken back", 1, 0);
+        }
+        fifo.pop_front();
+    }
+    
+    /* mapped consumer, items are written by the driver */
+    chdev_map_side(dev, CHDEV_ROLE_CONSUMER, true);
+    for (int op = 0; op < OPS_PER_SEED; op++) {
+        if (rand() % 2) {
+            item = random_item(200);
+            if (write_item(dev, item) >= 0) {
+                fifo.push_back(item);
+            }
+        }
+        else if (map_pop(ring, item)) {
+            if (fifo.empty() || item != fifo.front()) {
+                fail("Mapped consumer read wrong item of the driver", 2, op);
+            }
+            fifo.pop_front();
+        }
+        else if (!fifo.empty()) {
+            fail("Mapped consumer did not see items of the driver", 2, op);
+        }
+        if (chdev_pull_mapped(dev) || chdev_num_item(dev) != fifo.size() || ctrl->wr_pos != ring->wr_bytes) {
+            fail("Driver did not take the position of the mapped consumer", 2, op);
+        }
+    }
+    pos = ctrl->rd_pos;
+    ctrl->rd_pos = ring->wr_bytes + CHDEV_ITEM_ALIGN;
+    if (chdev_pull_mapped(dev) != -EINVAL || ring->rd_bytes != pos) {
+        fail("Driver took a position past the producer", 2, 0);
+    }
+    ctrl->rd_pos = pos;
+    
+    /* both sides are mapped only while the buffer is empty */
+    if (!fifo.empty() && chdev_map_side(dev, CHDEV_ROLE_PRODUCER, true) != -EBUSY) {
+        fail("Both sides were mapped with items in the buffer", 3, 0);
+    }
+    while (map_pop(ring, item)) {
+        fifo.pop_front();
+    }
+    if (chdev_map_side(dev, CHDEV_ROLE_PRODUCER, true)) {
+        fail("Both sides were not mapped on an empty buffer", 3, 0);
+    }
+    
+    /* items move without the driver, which checks positions concurrently */
+    thread producer([&] {
+        for (uint seq = 0; seq < SPSC_ITEMS; seq++) {
+            string out((const char *)&seq, sizeof(uint));
+            
+            out.append(seq % 97, (char)seq);
+            while (!map_push(ring, out)) {
+                this_thread::yield();
+            }
+        }
+    });
+    thread driver([&] {
+        while (!done.load()) {
+            if (chdev_pull_mapped(dev)) {
+                fail("Driver rejected valid positions of mapped owners", 3, 0);
+            }
+            ++pulls;
+            this_thread::yield();
+        }
+    });
+    for (uint seq = 0; seq < SPSC_ITEMS; seq++) {
+        while (!map_pop(ring, item)) {
+            this_thread::yield();
+        }
+        if (item.size() != sizeof(uint) + seq % 97 || memcmp(item.data(), &seq, sizeof(uint))) {
+            fail("Mapped consumer read wrong item of the mapped producer", 3, seq);
+        }
+    }
+    done = true;
+    producer.join();
+    driver.join();
+    
+    /* records are aligned, so is every position */
+    ctrl->wr_pos += 1;
+    if (chdev_pull_mapped(dev) != -EINVAL) {
+        fail("Driver took a position which is not aligned", 3, 0);
+    }
+    ctrl->wr_pos -= 1;
+    
+    /* items left when a side is taken back are counted and read by the driver */
+    for (int i = 0; i < 3; i++) {
+        map_push(ring, "left" + to_string(i));
+    }
+    chdev_map_side(dev, CHDEV_ROLE_CONSUMER, false);
+    if (chdev_num_item(dev) != 3 || chdev_pull_mapped(dev)) {
+        fail("Driver did not count the items left by mapped owners", 3, 0);
+    }
+    for (int i = 0; i < 3; i++) {
+        if (read_item(dev, buf, sizeof(buf), 0) != 5 || memcmp(buf, ("left" + to_string(i)).data(), 5)) {
+            fail("Driver read wrong item left by mapped owners", 3, i);
+        }
+    }
+    chdev_map_side(dev, CHDEV_ROLE_PRODUCER, false);
+    if (write_item(dev, "last") != 4 || ctrl->wr_pos != ring->wr_bytes || ctrl->wr_item - ctrl->rd_item != 1) {
+        fail("Driver did not publish its positions again", 3, 0);
+    }
+    free_dev(dev);
+    
+    cout << SPSC_ITEMS << " items without the driver, " << pulls << " checks of positions" << endl << endl;
+}
+
+/*
+ * Headers rewritten through a writable mapping after the items were written: readers and snapshots check
+ * every header again and fail with -EIO, leaving the item in the buffer, instead of moving past the used bytes.
+ */
+void corrupt_test() {
+    struct chdev_dev    *dev  = make_dev(256, 0);
+    struct chdev_ring   *ring = &dev->ring;
+    struct chdev_cursor cursors[2];
+    struct iov_iter     iter;
+    char                buf[256];
+    char                copy[256 + CHDEV_LZ4_MAX];
+    char                *payload;
+    size_t              count;
+    ssize_t             len;
+    uint                total;
+    u32                 header;
+    const u32           forged[] = { 1000, CHDEV_ITEM_PAD, CHDEV_ITEM_TS | 4, CHDEV_ITEM_LZ4 | 2 };
+    
+    cout << "--Corrupt test--" << endl;
+    
+    /* item past the used bytes, padding with nothing after it, item without room for its stamp or length */
+    write_item(dev, "first");
+    write_item(dev, "second");
+    for (int i = 0; i < 4; i++) {
+        memcpy(&header, ring->beg, sizeof(u32));
+        memcpy(ring->beg, &forged[i], sizeof(u32));
+        if (read_item(dev, buf, sizeof(buf), 0) != -EIO || chdev_peek_common(dev, &count) != ERR_PTR(-EIO) ||
+            chdev_drop_common(dev) != -EIO || chdev_snapshot(dev, copy, &total) != -EIO ||
+            chdev_num_item(dev) != 2 || ring->beg != ring->buf) {
+            fail("Corrupted header was read", 1, i);
+        }
+        memcpy(ring->beg, &header, sizeof(u32));
+    }
+    
+    /* snapshot copies no more than the used bytes, and its items do not run past them */
+    len = chdev_snapshot(dev, copy, &total);
+    if (len != 2 * sizeof(u32) + 11 || total != 2) {
+        fail("Snapshot copied more than the items", 1, 0);
+    }
+    memcpy(copy + sizeof(u32) + 5, &forged[0], sizeof(u32));
+    chdev_shim_iter(&iter, buf, sizeof(buf));
+    if (chdev_snapshot_to_iter(dev, copy, len, &iter, copy + 256, &total) != -EIO) {
+        fail("Snapshot item ran past the copied bytes", 1, 0);
+    }
+    if (read_item(dev, buf, sizeof(buf), 0) != 5 || read_item(dev, buf, sizeof(buf), 0) != 6) {
+        fail("Restored items were not read", 1, 0);
+    }
+    
+    /* item after padding left by a reservation, the padding is not skipped while the item is corrupted */
+    write_item(dev, string(120, 'x'));
+    read_item(dev, buf, sizeof(buf), 0);
+    payload = chdev_reserve_common(dev, 100);
+    if (IS_ERR(payload) || payload != ring->buf + sizeof(u32)) {
+        fail("Item was not reserved after padding", 2, 0);
+    }
+    chdev_commit_common(dev);
+    write_item(dev, string(13, 'y'));
+    memcpy(&header, ring->buf, sizeof(u32));
+    memcpy(ring->buf, &forged[0], sizeof(u32));
+    if (read_item(dev, buf, sizeof(buf), 0) != -EIO || ring->beg == ring->buf || chdev_num_item(dev) != 2) {
+        fail("Corrupted header after padding was read", 2, 0);
+    }
+    memcpy(ring->buf, &header, sizeof(u32));
+    if (read_item(dev, buf, sizeof(buf), 0) != 100 || read_item(dev, buf, sizeof(buf), 0) != 13) {
+        fail("Restored items after padding were not read", 2, 0);
+    }
+    
+    /* eviction stops at the corrupted item in overwrite mode */
+    dev->mode = CHDEV_MODE_OVERWRITE;
+    write_item(dev, string(100, 'x'));
+    write_item(dev, string(100, 'y'));
+    memcpy(&header, ring->beg, sizeof(u32));
+    memcpy(ring->beg, &forged[0], sizeof(u32));
+    if (write_item(dev, string(100, 'z')) != -EIO || chdev_num_item(dev) != 2) {
+        fail("Corrupted header was evicted", 3, 0);
+    }
+    memcpy(ring->beg, &header, sizeof(u32));
+    if (write_item(dev, string(100, 'z')) != 100 || chdev_num_item(dev) != 2) {
+        fail("Restored item was not evicted", 3, 0);
+    }
+    free_dev(dev);
+    
+    /* reclaim stops at the corrupted item, which the cursor reads as soon as it is restored */
+    dev  = make_dev(256, 0);
+    ring = &dev->ring;
+    dev->mode = CHDEV_MODE_BROADCAST;
+    for (int i = 0; i < 2; i++) {
+        memset(&cursors[i], 0, sizeof(struct chdev_cursor));
+        INIT_LIST_HEAD(&cursors[i].node);
+    }
+    write_item(dev, "a");
+    write_item(dev, "b");
+    write_item(dev, "c");
+    chdev_shim_iter(&iter, buf, sizeof(buf));
+    chdev_cursor_read(dev, &cursors[0], &iter, 0);  /* the only subscriber, "a" is removed */
+    chdev_shim_iter(&iter, buf, sizeof(buf));
+    chdev_cursor_read(dev, &cursors[1], &iter, 0);  /* subscribes at "b" and reads it */
+    memcpy(&header, ring->beg, sizeof(u32));
+    memcpy(ring->beg, &forged[0], sizeof(u32));
+    chdev_shim_iter(&iter, buf, sizeof(buf));
+    if (chdev_cursor_read(dev, &cursors[0], &iter, 0) != -EIO) {
+        fail("Cursor read a corrupted header", 4, 0);
+    }
+    chdev_cursor_detach(dev, &cursors[0]);
+    if (chdev_num_item(dev) != 2) {
+        fail("Corrupted item was reclaimed", 4, 0);
+    }
+    memcpy(ring->beg, &header, sizeof(u32));
+    chdev_shim_iter(&iter, buf, sizeof(buf));
+    if (chdev_cursor_read(dev, &cursors[1], &iter, 0) != 1 || buf[0] != 'c') {
+        fail("Cursor did not read the next item", 4, 0);
+    }
+    free_dev(dev);
+    
+    cout << "Corrupted headers rejected" << endl << endl;
+}
+
+/*
+ * Strict order always returns an item of the highest non-empty class; weighted order returns
+ * weights[p] items of class p in a row while the class has items, visiting classes from the highest down.
+ */
+void priority_test() {
+    const uint             nprio = 3;
+    struct chdev_dev       *dev  = make_dev(307, nprio);
+    vector<deque<string> > fifo(nprio);
+    char                   buf[64];
+    uint                   prio, last = 0, run = 0;
+    
+    cout << "--Priority test--" << endl;
+    
+    dev->nprio = nprio;
+    for (uint p = 0; p < nprio; p++) {
+        dev->weights[p] = p + 1;
+    }
+    
+    srand(1);
+    for (int op = 0; op < OPS_PER_SEED; op++) {
+        /* second half of the test reads in weighted order */
+        if (op == OPS_PER_SEED / 2) {
+            dev->mode |= CHDEV_MODE_WEIGHTED;
+            last = nprio;
+        }
+        
+        if (rand() % 2) {
+            string item = random_item(30);
+            
+            prio = rand() % (nprio + 1);   /* too high priority means the highest class */
+            item.insert(0, 1, (char)min(prio, nprio - 1));
+            if (write_item(dev, item, prio) >= 0) {
+                fifo[min(prio, nprio - 1)].push_back(item);
+            }
+            continue;
+        }
+        
+        struct iov_iter iter;
+        ssize_t         retval;
+        
+        chdev_shim_iter(&iter, buf, sizeof(buf));
+        retval = chdev_read_class(dev, &iter, 0, &prio);
+        if (retval == 0) {
+            if (!fifo[0].empty() || !fifo[1].empty() || !fifo[2].empty()) {
+                fail("Read from non-empty device returned nothing", 1, op);
+            }
+            last = nprio;   /* all classes were visited */
+            continue;
+        }
+        if (retval < 1 || prio != (uint)buf[0] || fifo[prio].empty() || (size_t)retval != fifo[prio].front().size() ||
+            memcmp(buf, fifo[prio].front().data(), retval)) {
+            fail("Read returned wrong item", 1, op);
+        }
+        fifo[prio].pop_front();
+        
+        if (!(dev->mode & CHDEV_MODE_WEIGHTED)) {
+            for (uint p = prio + 1; p < nprio; p++) {
+                if (!fifo[p].empty()) {
+                    fail("Strict order skipped a higher class", 1, op);
+                }
+            }
+        }
+        else {
+            /* a class gets a fresh credit in a row only if all other classes are empty */
+            if (prio == last && run == dev->weights[prio]) {
+                for (uint p = 0; p < nprio; p++) {
+                    if (p != prio && !fifo[p].empty()) {
+                        fail("Weighted order read too many items of a class in a row", 1, op);
+                    }
+                }
+                run = 0;
+            }
+            run  = (prio == last) ? run + 1 : 1;
+            last = prio;
+        }
+    }
+    free_dev(dev);
+    
+    cout << OPS_PER_SEED << " operations on " << nprio << " classes" << endl << endl;
+}
+
+/*
+ * One producer and one consumer thread work on a ring without any lock, as in SPSC mode.
+ */
+void spsc_test() {
+    struct chdev_dev *dev = make_dev(4099, 0);
+    
+    cout << "--SPSC test--" << endl;
+    
+    thread producer([dev]() {
+        for (uint seq = 0; seq < SPSC_ITEMS; seq++) {
+            string item((char *)&seq, sizeof(uint));
+            
+            item.append(seq % 301, (char)seq);
+            while (!chdev_can_write(dev, item.size(), 0)) {
+                this_thread::yield();
+            }
+            if (write_item(dev, item) != (ssize_t)item.size()) {
+                fail("Producer write failed", 0, seq);
+            }
+        }
+    });
+    
+    char buf[512];
+    for (uint seq = 0; seq < SPSC_ITEMS; seq++) {
+        ssize_t retval;
+        
+        while ((retval = read_item(dev, buf, sizeof(buf), 0)) == 0) {
+            this_thread::yield();
+        }
+        if (retval != (ssize_t)(sizeof(uint) + seq % 301) || memcmp(buf, &seq, sizeof(uint))) {
+            fail("Consumer read wrong item", 0, seq);
+        }
+        for (ssize_t i = sizeof(uint); i < retval; i++) {
+            if (buf[i] != (char)seq) {
+                fail("Consumer read wrong payload", 0, seq);
+            }
+        }
+    }
+    producer.join();
+    free_dev(dev);
+    
+    cout << SPSC_ITEMS << " items" << endl << endl;
+}
+
+int main() {
+    cout << "CHDEV ENGINE TEST" << endl
+                                << endl;
+    
+    differential_test();
+    overwrite_test();
+    broadcast_test();
+    compress_test();
+    snapshot_test();
+    sharded_test(false);
+    sharded_test(true);
+    large_test();
+    mapped_test();
+    corrupt_test();
+    priority_test();
+    spsc_test();
+    slot_test();
+    notify_test();
+    timestamp_test();
+    
+    cout << "ALL TESTS PASSED SUCCESSFULLY" << endl;
+    
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,377 @@
+/* 
+ * Copyright (C) 2014 Sergey Morozov
+ * 
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.
+ * 
+ * Test of the client library (src/libchdev.cpp) against a device simulated in userspace, run it with:
+ *     make check
+ * The system calls used by the library are replaced by the functions below, so no module is needed.
+ */
+
+#include <iostream>
+#include <deque>
+#include <string>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "libchdev.h"
+
+#define MOCK_FD       1000
+#define MOCK_BUF_SIZE 131072
+#define MOCK_ITEM_MAX (MOCK_BUF_SIZE / 2 - 8)
+
+using namespace std;
+
+/*
+ * Simulated device: a FIFO of items. CHDEV_IOCTL_SET_ITEMS takes at most set_cap items, as the driver
+ * stops at the first item which does not fit; write() of a blocking file always succeeds, as if it had
+ * waited for free space. An old driver does not know CHDEV_IOCTL_GET_ITEM_MAX.
+ */
+static deque<string> fifo;
+static size_t        set_cap;
+static bool          mock_nonblock;
+static bool          mock_old_driver;
+static unsigned      set_calls, writes, reads;
+static size_t        read_count;        /* size of the buffer of the last read() */
+
+extern "C" int open(const char *path, int flags, ...) {
+    mock_nonblock = flags & O_NONBLOCK;
+    return MOCK_FD;
+}
+
+extern "C" int close(int fd) {
+    if (fd != MOCK_FD) {
+        errno = EBADF;
+        return -1;
+    }
+    return 0;
+}
+
+extern "C" int ioctl(int fd, unsigned long cmd, ...) {
+    struct chdev_items *vec;
+    va_list            ap;
+    void               *arg;
+    uint               i = 0;
+    
+    va_start(ap, cmd);
+    arg = va_arg(ap, void *);
+    va_end(ap);
+    
+    if (fd != MOCK_FD) {
+        errno = EBADF;
+        return -1;
+    }
+    vec = (struct chdev_items *)arg;
+    
+    switch (cmd) {
+        case CHDEV_IOCTL_GET_BUF_SIZE:
+            *(uint *)arg = MOCK_BUF_SIZE;
+            return 0;
+            
+        case CHDEV_IOCTL_GET_ITEM_MAX:
+            if (mock_old_driver) {
+                break;
+            }
+            *(uint *)arg = MOCK_ITEM_MAX;
+            return 0;
+            
+        case CHDEV_IOCTL_GET_ITEMS:
+            for (; i < vec->count && !fifo.empty(); i++) {
+                if (fifo.front().size() > (size_t)vec->items[i].size) {
+                    break;
+                }
+                memcpy(vec->items[i].buf, fifo.front().data(), fifo.front().size());
+                vec->items[i].size = (short)fifo.front().size();
+                fifo.pop_front();
+            }
+            if (!i && vec->count && !fifo.empty()) {
+                errno = ENOMEM;     /* the first item does not fit into its buffer */
+                return -1;
+            }
+            vec->count = i;
+            return 0;
+            
+        case CHDEV_IOCTL_SET_ITEMS:
+            ++set_calls;
+            for (; i < vec->count && fifo.size() < set_cap; i++) {
+                fifo.push_back(string(vec->items[i].buf, vec->items[i].size));
+            }
+            if (!i && vec->count) {
+                errno = ENOMEM;
+                return -1;
+            }
+            vec->count = i;
+            return 0;
+    }
+    errno = ENOTTY;
+    return -1;
+}
+
+extern "C" ssize_t read(int fd, void *buf, size_t count) {
+    size_t size;
+    
+    if (fd != MOCK_FD) {
+        errno = EBADF;
+        return -1;
+    }
+    read_count = count;
+    if (fifo.empty()) {
+        errno = EAGAIN;
+        return -1;
+    }
+    if ((size = fifo.front().size()) > count) {
+        errno = ENOMEM;
+        return -1;
+    }
+    ++reads;
+    memcpy(buf, fifo.front().data(), size);
+    fifo.pop_front();
+    return size;
+}
+
+extern "C" ssize_t write(int fd, const void *buf, size_t count) {
+    if (fd != MOCK_FD) {
+        errno = EBADF;
+        return -1;
+    }
+    if (mock_nonblock && fifo.size() >= set_cap) {
+        errno = EAGAIN;
+        return -1;
+    }
+    ++writes;
+    fifo.push_back(string((const char *)buf, count));
+    return count;
+}
+
+extern "C" int poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+    return fifo.empty() ? 0 : 1;
+}
+
+void reset_mock(size_t cap) {
+    fifo.clear();
+    set_cap   = cap;
+    set_calls = writes = reads = 0;
+}
+
+void fail(const char *what, int op) {
+    cerr << "ERROR: " << what << " (operation " << op << ")." << endl;
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Check that the device holds exactly the expected items, in order.
+ */
+void expect_fifo(const deque<string> &expected, const char *what) {
+    if (fifo != expected) {
+        fail(what, (int)fifo.size());
+    }
+}
+
+/*
+ * Items larger than the batch, and items which do not fit into a full buffer, are written after
+ * the coalesced items which were pushed before them.
+ */
+void coalescing_test() {
+    chdev::Device dev;
+    deque<string> expected;
+    string        large(200, 'L');
+    
+    cout << "--Coalescing test--" << endl;
+    
+    reset_mock(1000);
+    dev.open("/dev/chdev");
+    dev.set_coalescing(8, 64);
+    
+    /* an oversized item flushes the batch first */
+    for (int i = 0; i < 3; i++) {
+        expected.push_back("small" + to_string(i));
+        dev.push(expected.back());
+    }
+    if (!fifo.empty()) {
+        fail("Coalesced items were written before the batch was full", 0);
+    }
+    if (dev.push(large) != (ssize_t)large.size()) {
+        fail("Oversized item was not written", 0);
+    }
+    expected.push_back(large);
+    expect_fifo(expected, "Oversized item overtook coalesced items");
+    
+    /* batch is written when the next item does not fit into its bytes, or into its items */
+    for (int i = 0; i < 20; i++) {
+        expected.push_back(string(5 + i % 17, 'a' + i));
+        dev.push(expected.back());
+    }
+    dev.flush();
+    expect_fifo(expected, "Coalesced items were reordered");
+    
+    /* blocking file writes the item which did not fit into the buffer by write(), the rest by a batch */
+    reset_mock(2);
+    expected.clear();
+    for (int i = 0; i < 6; i++) {
+        expected.push_back("item" + to_string(i));
+        dev.push(expected.back());
+    }
+    if (dev.flush() || writes != 4) {
+        fail("Items which did not fit into the buffer were not written by write()", writes);
+    }
+    expect_fifo(expected, "Items written by write() were reordered");
+    dev.close();
+    
+    /* non-blocking file keeps the items which did not fit, and writes them by the next flush */
+    reset_mock(2);
+    expected.clear();
+    dev.open("/dev/chdev", O_RDWR | O_NONBLOCK);
+    dev.set_coalescing(8, 64);
+    for (int i = 0; i < 5; i++) {
+        expected.push_back("item" + to_string(i));
+        dev.push(expected.back());
+    }
+    if (dev.flush() != -EAGAIN || fifo.size() != 2) {
+        fail("Flush of a full non-blocking file did not return -EAGAIN", (int)fifo.size());
+    }
+    while (!fifo.empty()) {
+        if (fifo.front() != expected.front()) {
+            fail("Items kept by a full non-blocking file were reordered", (int)expected.size());
+        }
+        fifo.pop_front();
+        expected.pop_front();
+        dev.flush();
+    }
+    if (!expected.empty() || dev.flush()) {
+        fail("Items kept by a full non-blocking file were lost", (int)expected.size());
+    }
+    dev.close();
+    
+    cout << set_calls << " batches, " << writes << " writes" << endl << endl;
+}
+
+/*
+ * Item which does not fit into a buffer of the batch is received by read(), between the items
+ * received by batches before and after it.
+ */
+void receive_test() {
+    chdev::Device dev;
+    deque<string> expected;
+    chdev::Buffer buf;
+    char          small[16];
+    int           received = 0;
+    
+    cout << "--Receive test--" << endl;
+    
+    reset_mock(1000);
+    for (int i = 0; i < 40; i++) {
+        fifo.push_back(i % 13 == 5 ? string(CHDEV_LIB_ITEM_MAX + 1 + i, 'x') : "item" + to_string(i));
+    }
+    expected = fifo;
+    
+    dev.open("/dev/chdev", O_RDWR | O_NONBLOCK);
+    if (dev.interface() != chdev::Interface::Poll) {
+        fail("Non-blocking file does not use poll", 0);
+    }
+    dev.consume([&](chdev::Bytes item) {
+        if (item.str() != expected.front()) {
+            fail("Item was received out of order", received);
+        }
+        expected.pop_front();
+        return ++received < 40;
+    }, 0);
+    if (received != 40 || reads != 3) {
+        fail("Large items were not received by read()", received);
+    }
+    if (read_count != MOCK_ITEM_MAX) {
+        fail("Buffer for large items is not sized by the largest item", received);
+    }
+    
+    /* pop() keeps an item which does not fit into the buffer of the caller */
+    fifo.push_back("first");
+    fifo.push_back(string(100, 'y'));
+    fifo.push_back("last");
+    if (dev.pop(small, sizeof(small)) != 5 || memcmp(small, "first", 5)) {
+        fail("Item was not received", 0);
+    }
+    if (dev.pop(small, sizeof(small)) != -ENOMEM || dev.pop(buf) != 100 || buf.bytes().str() != string(100, 'y')) {
+        fail("Item which did not fit was lost", 0);
+    }
+    if (dev.pop(buf) != 4 || buf.bytes().str() != "last" || dev.pop(buf) != -EAGAIN) {
+        fail("Items after a large one were lost", 0);
+    }
+    if (dev.consume([&](chdev::Bytes item) { return true; }, 0) != -ETIMEDOUT) {
+        fail("Consumer of an empty device did not time out", 0);
+    }
+    
+    /* driver which does not tell the largest item takes items as large as its buffer */
+    mock_old_driver = true;
+    fifo.push_back(string(MOCK_ITEM_MAX + 1, 'z'));
+    if (dev.open("/dev/chdev", O_RDWR | O_NONBLOCK) || dev.pop(buf) != MOCK_ITEM_MAX + 1 || read_count != MOCK_BUF_SIZE) {
+        fail("Items of an old driver were not sized by its buffer", 0);
+    }
+    mock_old_driver = false;
+    
+    cout << received << " items, " << reads << " reads" << endl << endl;
+}
+
+/*
+ * Moved device keeps its coalesced items, the moved-from handle is closed and rejects every call.
+ */
+void move_test() {
+    chdev::Device dev, other;
+    deque<string> expected;
+    chdev::Buffer buf;
+    
+    cout << "--Move test--" << endl;
+    
+    reset_mock(1000);
+    dev.open("/dev/chdev");
+    dev.set_coalescing(8, 64);
+    for (int i = 0; i < 3; i++) {
+        expected.push_back("item" + to_string(i));
+        dev.push(expected.back());
+    }
+    
+    other = move(dev);
+    if (dev.file() != -1 || other.file() != MOCK_FD || !fifo.empty()) {
+        fail("Move wrote coalesced items or did not pass the file", 0);
+    }
+    if (dev.push(string("lost")) != -EBADF || dev.flush() || dev.pop(buf) != -EBADF) {
+        fail("Moved-from device accepted a call", 0);
+    }
+    
+    /* move assignment closes the target, which writes its coalesced items */
+    chdev::Device third(move(other));
+    third.push(string("item3"));
+    expected.push_back("item3");
+    other.open("/dev/chdev");
+    other.set_coalescing(8, 64);
+    other.push(string("other"));
+    other = move(third);
+    expected.push_front("other");
+    if (other.flush()) {
+        fail("Moved device did not flush", 0);
+    }
+    expect_fifo(expected, "Coalesced items were lost by a move");
+    
+    /* moved-from device can be opened again */
+    third.open("/dev/chdev");
+    if (third.push(string("again")) != 5 || fifo.back() != "again") {
+        fail("Moved-from device could not be reopened", 0);
+    }
+    
+    cout << fifo.size() << " items" << endl << endl;
+}
+
+int main() {
+    cout << "CHDEV LIBRARY TEST" << endl
+                                 << endl;
+    
+    coalescing_test();
+    receive_test();
+    move_test();
+    
+    cout << "ALL TESTS PASSED SUCCESSFULLY" << endl;
+    
+    return EXIT_SUCCESS;
+}
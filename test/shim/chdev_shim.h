@@ -0,0 +1,286 @@
+/* 
+ * Copyright (C) 2014 Sergey Morozov
+ * 
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.
+ */
+
+/*
+ * Userspace replacements of the kernel interfaces used by chdev_shared.c, so that the ring
+ * engine can be built and tested without loading the module (see test/ and "make check").
+ */
+
+#ifndef CHDEV_SHIM_H
+#define CHDEV_SHIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+    
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef struct { int counter; } atomic_t;
+typedef struct { long long counter; } atomic64_t;
+    
+#define __user
+#define ____cacheline_aligned_in_smp __attribute__ ((__aligned__(64)))
+#define L1_CACHE_BYTES               64
+#define ALIGN(x, a)                  (((x) + (a) - 1) & ~((size_t)(a) - 1))
+#define ERESTARTSYS                  512
+#define PAGE_SIZE                    4096UL
+#define PAGE_MASK                    (~(PAGE_SIZE - 1))
+    
+#ifndef __cplusplus
+#define min(a, b)                    ((a) < (b) ? (a) : (b))
+#endif
+    
+/*
+ * Memory ordering.
+ */
+#define READ_ONCE(x)                 (*(const volatile __typeof__(x) *)&(x))
+#define WRITE_ONCE(x, val)           (*(volatile __typeof__(x) *)&(x) = (val))
+#define smp_load_acquire(p)          __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define smp_store_release(p, val)    __atomic_store_n((p), (val), __ATOMIC_RELEASE)
+#define atomic_read(v)               __atomic_load_n(&(v)->counter, __ATOMIC_RELAXED)
+#define atomic_inc(v)                __atomic_add_fetch(&(v)->counter, 1, __ATOMIC_RELAXED)
+#define atomic_dec(v)                __atomic_sub_fetch(&(v)->counter, 1, __ATOMIC_RELAXED)
+#define atomic64_inc_return(v)       __atomic_add_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST)
+#define cmpxchg(p, old, new)         __sync_val_compare_and_swap((p), (old), (new))
+    
+/*
+ * Error pointers.
+ */
+static inline void *ERR_PTR(long err) {
+    return (void *)err;
+}
+    
+static inline long PTR_ERR(const void *ptr) {
+    return (long)ptr;
+}
+    
+static inline bool IS_ERR(const void *ptr) {
+    return (unsigned long)ptr >= (unsigned long)-4095;
+}
+    
+/*
+ * CPU of the caller, set by tests of sharded mode.
+ */
+extern int chdev_shim_cpu;
+    
+static inline int raw_smp_processor_id(void) {
+    return chdev_shim_cpu;
+}
+    
+/*
+ * Per-CPU data has a single copy, updated atomically because writers and readers of slot mode run concurrently.
+ */
+#define __percpu
+#define this_cpu_inc(var)            __atomic_add_fetch(&(var), 1, __ATOMIC_RELAXED)
+#define this_cpu_add(var, n)         __atomic_add_fetch(&(var), (n), __ATOMIC_RELAXED)
+#define this_cpu_read(var)           (var)
+#define this_cpu_write(var, val)     ((var) = (val))
+#define per_cpu_ptr(ptr, cpu)        (ptr)
+#define for_each_possible_cpu(cpu)   for ((cpu) = 0; (cpu) < 1; (cpu)++)
+
+/*
+ * Semaphores and spinlocks are mutexes, wait queues never have sleepers: tests poll instead of sleeping.
+ */
+struct semaphore {
+    pthread_mutex_t mutex;
+};
+    
+static inline void sema_init(struct semaphore *sem, int val) {
+    pthread_mutex_init(&sem->mutex, NULL);
+}
+    
+static inline int down_interruptible(struct semaphore *sem) {
+    return pthread_mutex_lock(&sem->mutex);
+}
+    
+static inline int down_trylock(struct semaphore *sem) {
+    return pthread_mutex_trylock(&sem->mutex);
+}
+
+static inline void up(struct semaphore *sem) {
+    pthread_mutex_unlock(&sem->mutex);
+}
+    
+typedef struct {
+    pthread_mutex_t mutex;
+} spinlock_t;
+    
+static inline void spin_lock_init(spinlock_t *lock) {
+    pthread_mutex_init(&lock->mutex, NULL);
+}
+    
+static inline void spin_lock(spinlock_t *lock) {
+    pthread_mutex_lock(&lock->mutex);
+}
+    
+static inline void spin_unlock(spinlock_t *lock) {
+    pthread_mutex_unlock(&lock->mutex);
+}
+    
+typedef struct {
+    int unused;
+} wait_queue_head_t;
+    
+static inline bool wq_has_sleeper(wait_queue_head_t *wq) {
+    return false;
+}
+    
+static inline void wake_up_interruptible(wait_queue_head_t *wq) {
+}
+    
+/*
+ * Doubly linked lists.
+ */
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+    
+struct list_head {
+    struct list_head *next, *prev;
+};
+    
+static inline void INIT_LIST_HEAD(struct list_head *list) {
+    list->next = list;
+    list->prev = list;
+}
+    
+static inline bool list_empty(const struct list_head *head) {
+    return head->next == head;
+}
+    
+static inline void list_add_tail(struct list_head *entry, struct list_head *head) {
+    entry->next      = head;
+    entry->prev      = head->prev;
+    head->prev->next = entry;
+    head->prev       = entry;
+}
+    
+static inline void list_del_init(struct list_head *entry) {
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    INIT_LIST_HEAD(entry);
+}
+    
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+#define list_for_each_entry(pos, head, member)                                  \
+    for (pos = list_entry((head)->next, __typeof__(*pos), member);              \
+         &pos->member != (head);                                                \
+         pos = list_entry(pos->member.next, __typeof__(*pos), member))
+    
+struct cdev {
+    dev_t dev;
+};
+
+#define MINOR(dev)                   ((unsigned int)((dev) & 0xfffff))
+
+static inline u64 ktime_get_ns(void) {
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+    
+static inline int fls64(u64 x) {
+    return x ? 64 - __builtin_clzll(x) : 0;
+}
+    
+/*
+ * Eventfd counts its signals, timers only remember that they were started: tests fire them by hand.
+ * Notifier is replaced by tests while no one reads it, so RCU readers need no protection.
+ */
+struct eventfd_ctx {
+    u64 count;
+};
+    
+static inline u64 eventfd_signal(struct eventfd_ctx *ctx, u64 n) {
+    __atomic_add_fetch(&ctx->count, n, __ATOMIC_RELAXED);
+    return n;
+}
+    
+typedef u64 ktime_t;
+    
+enum hrtimer_restart { HRTIMER_NORESTART, HRTIMER_RESTART };
+enum hrtimer_mode { HRTIMER_MODE_REL };
+    
+struct hrtimer {
+    enum hrtimer_restart (*function)(struct hrtimer *);
+    bool                 active;
+};
+    
+static inline ktime_t ns_to_ktime(u64 ns) {
+    return ns;
+}
+    
+static inline bool hrtimer_active(const struct hrtimer *timer) {
+    return timer->active;
+}
+    
+static inline void hrtimer_start(struct hrtimer *timer, ktime_t tim, enum hrtimer_mode mode) {
+    timer->active = true;
+}
+    
+#define __rcu
+#define rcu_read_lock()
+#define rcu_read_unlock()
+#define rcu_dereference(p)           (p)
+#define rcu_access_pointer(p)        (p)
+    
+struct file;
+    
+/*
+ * Iterator over a single plain buffer.
+ */
+struct iov_iter {
+    char   *buf;    /* current position */
+    size_t count;   /* bytes left */
+};
+    
+static inline void chdev_shim_iter(struct iov_iter *i, void *buf, size_t count) {
+    i->buf   = (char *)buf;
+    i->count = count;
+}
+    
+static inline size_t iov_iter_count(const struct iov_iter *i) {
+    return i->count;
+}
+    
+static inline size_t copy_to_iter(const void *addr, size_t bytes, struct iov_iter *i) {
+    bytes = bytes < i->count ? bytes : i->count;
+    memcpy(i->buf, addr, bytes);
+    i->buf   += bytes;
+    i->count -= bytes;
+    return bytes;
+}
+    
+static inline size_t copy_from_iter(void *addr, size_t bytes, struct iov_iter *i) {
+    bytes = bytes < i->count ? bytes : i->count;
+    memcpy(addr, i->buf, bytes);
+    i->buf   += bytes;
+    i->count -= bytes;
+    return bytes;
+}
+    
+static inline void iov_iter_revert(struct iov_iter *i, size_t bytes) {
+    i->buf   -= bytes;
+    i->count += bytes;
+}
+    
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CHDEV_SHIM_H */
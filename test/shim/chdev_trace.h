@@ -0,0 +1,35 @@
+/* 
+ * Copyright (C) 2014 Sergey Morozov
+ * 
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.
+ */
+
+/*
+ * Tracepoints of include/chdev_trace.h are always disabled in userspace.
+ */
+
+#ifndef CHDEV_SHIM_TRACE_H
+#define CHDEV_SHIM_TRACE_H
+
+#include "chdev_shim.h"
+
+#define CHDEV_TRACE_FLAT       0
+#define CHDEV_TRACE_PAD        1
+
+#define CHDEV_SHIM_EVENT(name, proto)                           \
+    static inline void trace_##name proto {                     \
+    }                                                           \
+    static inline bool trace_##name##_enabled(void) {           \
+        return false;                                           \
+    }
+
+CHDEV_SHIM_EVENT(chdev_enqueue, (unsigned int minor, size_t len, size_t used, unsigned int items, int layout))
+CHDEV_SHIM_EVENT(chdev_dequeue, (unsigned int minor, size_t len, size_t used, unsigned int items, int layout))
+CHDEV_SHIM_EVENT(chdev_evict,   (unsigned int minor, size_t len, size_t used, unsigned int items, int layout))
+CHDEV_SHIM_EVENT(chdev_reject,  (unsigned int minor, bool write, size_t len, size_t used, int err))
+CHDEV_SHIM_EVENT(chdev_lock,    (unsigned int minor, u64 wait_ns, bool interrupted))
+CHDEV_SHIM_EVENT(chdev_wait,    (unsigned int minor, bool write, size_t len, u64 wait_ns, int ret))
+
+#endif /* CHDEV_SHIM_TRACE_H */
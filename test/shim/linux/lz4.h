@@ -0,0 +1,62 @@
+/* 
+ * Copyright (C) 2014 Sergey Morozov
+ * 
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.
+ */
+
+/*
+ * Stand-in for the kernel LZ4 interface: a byte run-length codec with the same calling
+ * conventions, enough to exercise compressed items of the ring engine in userspace.
+ * Compressed data is a sequence of (count, byte) pairs, count is 1..255.
+ */
+
+#ifndef CHDEV_SHIM_LZ4_H
+#define CHDEV_SHIM_LZ4_H
+
+#include "chdev_shim.h"
+
+#define LZ4_MEM_COMPRESS             16
+#define LZ4_COMPRESSBOUND(isize)     (2 * (unsigned int)(isize) + 16)
+
+static inline int LZ4_compress_default(const char *source, char *dest, int inputSize, int maxOutputSize, void *wrkmem) {
+    int in = 0, out = 0;
+    
+    (void)wrkmem;
+    while (in < inputSize) {
+        int run = 1;
+        
+        while (in + run < inputSize && run < 255 && source[in + run] == source[in]) {
+            ++run;
+        }
+        if (out + 2 > maxOutputSize) {
+            return 0;
+        }
+        dest[out++] = (char)run;
+        dest[out++] = source[in];
+        in += run;
+    }
+    return out;
+}
+    
+static inline int LZ4_decompress_safe(const char *source, char *dest, int compressedSize, int maxDecompressedSize) {
+    int in = 0, out = 0;
+    
+    if (compressedSize % 2) {
+        return -1;
+    }
+    while (in < compressedSize) {
+        int run = (unsigned char)source[in];
+        
+        if (!run || out + run > maxDecompressedSize) {
+            return -1;
+        }
+        memset(dest + out, source[in + 1], run);
+        out += run;
+        in  += 2;
+    }
+    return out;
+}
+
+#endif /* CHDEV_SHIM_LZ4_H */
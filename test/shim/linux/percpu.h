@@ -0,0 +1 @@
+#include "chdev_shim.h"